@@ -0,0 +1,61 @@
+#ifndef ALLOCATION_COUNTER_HPP
+#define ALLOCATION_COUNTER_HPP
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+// ##### Define the allocation counter
+// Built with -DCOUNT_ALLOCATIONS the global operator new is replaced to count
+// the allocations made by each thread, so the capture loop can check that it
+// runs without allocating once it has warmed up. OpenCV allocates cv::Mat data
+// with its own allocator, which is not counted, the frame pool counts those
+// misses instead. Include from one translation unit only, other builds keep
+// the standard allocator and count nothing.
+#ifdef COUNT_ALLOCATIONS
+static thread_local size_t threadAllocationCount = 0;
+
+void *operator new(std::size_t size) {
+  threadAllocationCount++;
+  void *memory = std::malloc(size != 0 ? size : 1);
+  if (memory == NULL) {
+    throw std::bad_alloc();
+  }
+  return memory;
+}
+
+void *operator new[](std::size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void *memory) noexcept {
+  std::free(memory);
+}
+
+void operator delete[](void *memory) noexcept {
+  std::free(memory);
+}
+
+void operator delete(void *memory, std::size_t) noexcept {
+  std::free(memory);
+}
+
+void operator delete[](void *memory, std::size_t) noexcept {
+  std::free(memory);
+}
+
+// Number of allocations made by the calling thread
+inline size_t threadAllocations() {
+  return threadAllocationCount;
+}
+
+const bool allocationCounterEnabled = true;
+#else
+inline size_t threadAllocations() {
+  return 0;
+}
+
+const bool allocationCounterEnabled = false;
+#endif
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef BOUNDED_QUEUE_HPP
+#define BOUNDED_QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// ##### Define the bounded lock-free queue
+// Multi-producer multi-consumer ring buffer (Dmitry Vyukov's design). Each cell
+// carries a sequence number that tells producers and consumers whether it is
+// free, so pushing and popping never take a lock. The capacity is rounded up
+// to a power of two.
+template <typename T>
+class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t requestedCapacity) : enqueuePosition(0), dequeuePosition(0) {
+    size_t capacity = 2;
+    while (capacity < requestedCapacity) {
+      capacity *= 2;
+    }
+    cells = std::vector<Cell>(capacity);
+    mask = capacity - 1;
+    for (size_t i = 0; i < capacity; i++) {
+      cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // Push a value, returns false without blocking if the queue is full
+  bool tryPush(T &&value) {
+    Cell *cell;
+    size_t position = enqueuePosition.load(std::memory_order_relaxed);
+
+    for (;;) {
+      cell = &cells[position & mask];
+      size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+      if (difference == 0) {
+        if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      }
+      else if (difference < 0) {
+        return false;
+      }
+      else {
+        position = enqueuePosition.load(std::memory_order_relaxed);
+      }
+    }
+
+    cell->value = std::move(value);
+    cell->sequence.store(position + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Pop a value, returns false without blocking if the queue is empty
+  bool tryPop(T &value) {
+    Cell *cell;
+    size_t position = dequeuePosition.load(std::memory_order_relaxed);
+
+    for (;;) {
+      cell = &cells[position & mask];
+      size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+      if (difference == 0) {
+        if (dequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      }
+      else if (difference < 0) {
+        return false;
+      }
+      else {
+        position = dequeuePosition.load(std::memory_order_relaxed);
+      }
+    }
+
+    value = std::move(cell->value);
+    cell->value = T();
+    cell->sequence.store(position + mask + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Number of queued values, only approximate while other threads are pushing or popping
+  size_t size() const {
+    size_t enqueued = enqueuePosition.load(std::memory_order_acquire);
+    size_t dequeued = dequeuePosition.load(std::memory_order_acquire);
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+  }
+
+  bool empty() const {
+    return size() == 0;
+  }
+
+  size_t capacity() const {
+    return mask + 1;
+  }
+
+private:
+  struct Cell {
+    Cell() : sequence(0) {}
+    Cell(const Cell &) : sequence(0) {}
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  // Keep the producer and consumer positions on separate cache lines
+  std::vector<Cell> cells;
+  size_t mask;
+  alignas(64) std::atomic<size_t> enqueuePosition;
+  alignas(64) std::atomic<size_t> dequeuePosition;
+};
+
+#endif
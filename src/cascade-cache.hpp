@@ -0,0 +1,199 @@
+#ifndef CASCADE_CACHE_HPP
+#define CASCADE_CACHE_HPP
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/objdetect/objdetect.hpp>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "hash.hpp"
+
+// ##### Define the cascades
+enum CascadeKind {
+  cascadeFace,
+  cascadeEye,
+  cascadeNose,
+  cascadeKindCount
+};
+
+inline const char *cascadeFileName(CascadeKind kind) {
+  static const char *names[cascadeKindCount] = {
+    "haarcascade_frontalface_default.xml", "haarcascade_eye.xml", "haarcascade_mcs_nose.xml"
+  };
+  return names[kind];
+}
+
+// ##### Define the function to copy a parsed file node into a file storage being written
+// Only the values are copied, so the comments, attributes and indentation of
+// the source are dropped. Sequences of plain values are written on one line.
+inline void copyFileNode(cv::FileStorage &output, const cv::FileNode &node) {
+  cv::FileNodeIterator child;
+
+  if (node.isMap()) {
+    output << "{";
+    for (child = node.begin(); child != node.end(); ++child) {
+      output << (*child).name();
+      copyFileNode(output, *child);
+    }
+    output << "}";
+  }
+  else if (node.isSeq()) {
+    bool flat = true;
+    for (child = node.begin(); child != node.end() && flat; ++child) {
+      flat = !(*child).isMap() && !(*child).isSeq();
+    }
+    output << (flat ? "[:" : "[");
+    for (child = node.begin(); child != node.end(); ++child) {
+      copyFileNode(output, *child);
+    }
+    output << "]";
+  }
+  else if (node.isInt()) {
+    output << (int)node;
+  }
+  else if (node.isReal()) {
+    output << (double)node;
+  }
+  else {
+    output << (std::string)node;
+  }
+}
+
+// ##### Define the cascade cache
+// Each cascade file is parsed once per process, by the first detection thread
+// that needs it, and every thread then builds its own classifier from the
+// parsed nodes instead of parsing the XML again. The first parse also writes
+// a compact YAML copy next to the source (<cascade>.xml.cache.yml) holding
+// the hash of the source XML, later starts parse the copy instead for as
+// long as the hash matches. Cascades in the old format are loaded from the source
+// by each thread as before.
+class CascadeCache {
+public:
+  explicit CascadeCache(const std::string &openCVCascadePath = "") : openCVCascadePath(openCVCascadePath) {
+    for (int i = 0; i < cascadeKindCount; i++) {
+      parsed[i] = false;
+    }
+  }
+
+  void setPath(const std::string &path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (path != openCVCascadePath) {
+      openCVCascadePath = path;
+      clear();
+    }
+  }
+
+  // Build a classifier from the cascade, parsing it first if no thread has yet
+  bool load(CascadeKind kind, cv::CascadeClassifier &classifier) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::string sourceFilePath = openCVCascadePath + cascadeFileName(kind);
+
+    if (!parsed[kind]) {
+      parse(kind);
+      parsed[kind] = true;
+    }
+    try {
+      if (!cascadeNodes[kind].empty() && classifier.read(cascadeNodes[kind])) {
+        return true;
+      }
+      return classifier.load(sourceFilePath);
+    }
+    catch (cv::Exception &ex) {
+      std::cerr << "Error loading cascade!..." << sourceFilePath << " " << ex.msg << std::endl;
+      return false;
+    }
+  }
+
+  // Free the parsed cascades once every thread has built its classifiers
+  void release() {
+    std::lock_guard<std::mutex> lock(mutex);
+    clear();
+  }
+
+private:
+  void clear() {
+    for (int i = 0; i < cascadeKindCount; i++) {
+      cascadeNodes[i] = cv::FileNode();
+      storages[i].release();
+      parsed[i] = false;
+    }
+  }
+
+  // ##### Define the function to parse a cascade, from the cache if it was written from the same source
+  void parse(CascadeKind kind) {
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    std::string sourceFilePath = openCVCascadePath + cascadeFileName(kind);
+    std::string cacheFilePath = sourceFilePath + ".cache.yml";
+    std::string sourceHash, cachedHash;
+    std::vector<char> buffer(64 * 1024);
+    uint64_t hash = 14695981039346656037ULL;
+
+    // Hash the source XML
+    std::ifstream sourceFile(sourceFilePath.c_str(), std::ios::binary);
+    if (!sourceFile) {
+      return;
+    }
+    while (sourceFile.read(&buffer[0], buffer.size()) || sourceFile.gcount() > 0) {
+      hash = hashBytes(hash, &buffer[0], (size_t)sourceFile.gcount());
+    }
+    sourceHash = formatHash(hash);
+
+    try {
+      // Parse the cache if it is up to date
+      if (storages[kind].open(cacheFilePath, cv::FileStorage::READ)) {
+        storages[kind]["sourceHash"] >> cachedHash;
+        if (cachedHash == sourceHash && !storages[kind]["cascade"].empty()) {
+          cascadeNodes[kind] = storages[kind]["cascade"];
+          std::cout << "Parsed cached cascade..." << cascadeFileName(kind) << " in "
+                    << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count() << "ms" << std::endl;
+          return;
+        }
+        storages[kind].release();
+      }
+
+      // Parse the source, old format cascades are left to CascadeClassifier::load
+      if (!storages[kind].open(sourceFilePath, cv::FileStorage::READ)) {
+        return;
+      }
+      cascadeNodes[kind] = storages[kind].getFirstTopLevelNode();
+      if (cascadeNodes[kind]["stageType"].empty()) {
+        cascadeNodes[kind] = cv::FileNode();
+        storages[kind].release();
+        return;
+      }
+      std::cout << "Parsed cascade..." << cascadeFileName(kind) << " in "
+                << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count() << "ms" << std::endl;
+
+      // Write the cache to a temporary file and rename it, a failure only means parsing the source again next start
+      std::string temporaryFilePath = sourceFilePath + ".cache.tmp.yml";
+      cv::FileStorage cacheFile(temporaryFilePath, cv::FileStorage::WRITE);
+      if (cacheFile.isOpened()) {
+        cacheFile << "sourceHash" << sourceHash;
+        cacheFile << "cascade";
+        copyFileNode(cacheFile, cascadeNodes[kind]);
+        cacheFile.release();
+        if (rename(temporaryFilePath.c_str(), cacheFilePath.c_str()) != 0) {
+          remove(temporaryFilePath.c_str());
+        }
+      }
+    }
+    catch (cv::Exception &ex) {
+      std::cerr << "Error parsing cascade!..." << sourceFilePath << " " << ex.msg << std::endl;
+      cascadeNodes[kind] = cv::FileNode();
+      storages[kind].release();
+    }
+  }
+
+  std::mutex mutex;
+  std::string openCVCascadePath;
+  cv::FileStorage storages[cascadeKindCount];
+  cv::FileNode cascadeNodes[cascadeKindCount];
+  bool parsed[cascadeKindCount];
+};
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef COMMAND_LINE_OPTIONS_HPP
+#define COMMAND_LINE_OPTIONS_HPP
+
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <vector>
+
+// ##### Define the command line options
+// Arguments of the form --name=value or --name are options, everything else is
+// kept in order as a positional argument.
+class CommandLineOptions {
+public:
+  CommandLineOptions(int argc, char **argv) {
+    std::string argument;
+    size_t equalsPosition;
+
+    for (int i = 1; i < argc; i++) {
+      argument = argv[i];
+      if (argument.size() > 2 && argument.compare(0, 2, "--") == 0) {
+        equalsPosition = argument.find('=');
+        if (equalsPosition == std::string::npos) {
+          options[argument.substr(2)] = "";
+        }
+        else {
+          options[argument.substr(2, equalsPosition - 2)] = argument.substr(equalsPosition + 1);
+        }
+      }
+      else {
+        positional.push_back(argument);
+      }
+    }
+  }
+
+  bool has(const std::string &name) const {
+    return options.find(name) != options.end();
+  }
+
+  std::string get(const std::string &name, const std::string &defaultValue) const {
+    std::map<std::string, std::string>::const_iterator findIterator = options.find(name);
+    return findIterator == options.end() ? defaultValue : findIterator->second;
+  }
+
+  int getInt(const std::string &name, int defaultValue) const {
+    std::string value = get(name, "");
+    return value.empty() ? defaultValue : atoi(value.c_str());
+  }
+
+  double getDouble(const std::string &name, double defaultValue) const {
+    std::string value = get(name, "");
+    return value.empty() ? defaultValue : atof(value.c_str());
+  }
+
+  std::vector<std::string> positional;
+
+private:
+  std::map<std::string, std::string> options;
+};
+
+#endif
@@ -0,0 +1,223 @@
+#ifndef CONTROL_SERVER_HPP
+#define CONTROL_SERVER_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// ##### Define the control command
+struct ControlCommand {
+  std::string name;       // stop, recognition, train, reload
+  std::string argument;   // on/off/toggle for recognition, the label (or off) for train
+};
+
+// ##### Define the function to check a training label
+// The label becomes the start of the training image file name, <label>_<timestamp>.jpg,
+// and is read back up to the first underscore, so it cannot hold a path, an
+// underscore or whitespace.
+inline bool isValidTrainingLabel(const std::string &label) {
+  if (label.empty() || label == "off" || label.find("..") != std::string::npos) {
+    return false;
+  }
+  for (size_t i = 0; i < label.size(); i++) {
+    if (label[i] == '/' || label[i] == '_' || ((unsigned char)label[i] < 0x80 && !isgraph((unsigned char)label[i]))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// ##### Define the flag set by the SIGTERM and SIGINT handler and read by the capture loop
+// One flag for the whole program, whichever translation units include this. It
+// is constant initialized, so the signal handler never runs its initialization.
+inline std::atomic<bool> &stopSignalReceived() {
+  static std::atomic<bool> received(false);
+  return received;
+}
+
+// ##### Define the function to handle the stop signals
+inline void handleStopSignal(int) {
+  stopSignalReceived() = true;
+}
+
+// ##### Define the function to install the stop signal handlers
+inline void installStopSignalHandlers() {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handleStopSignal;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGTERM, &action, NULL);
+  sigaction(SIGINT, &action, NULL);
+}
+
+// ##### Define the control server
+// Listens on a Unix domain socket for one line commands, one command per
+// connection, and answers with one or more lines:
+//   stop                        stop capturing and exit
+//   recognition on|off|toggle   switch face recognition
+//   train <label>|off           start training mode for a label, or stop it
+//   reload                      reload or retrain the face recognizer
+//   stats                       output the latest statistics
+// Commands are queued for the capture loop, which only checks an atomic flag
+// per frame, so the hot path makes no system calls for control.
+class ControlServer {
+public:
+  ControlServer() : listenSocket(-1), stopping(false), commandsPending(false) {}
+
+  ~ControlServer() {
+    stop();
+  }
+
+  // Start listening on the socket path, returns false if it cannot be bound
+  bool start(const std::string &path) {
+    sockaddr_un address;
+
+    if (path.size() >= sizeof(address.sun_path)) {
+      return false;
+    }
+    socketPath = path;
+    unlink(socketPath.c_str());
+
+    listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenSocket < 0) {
+      return false;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+    if (bind(listenSocket, (sockaddr *)&address, sizeof(address)) < 0 || listen(listenSocket, 4) < 0) {
+      close(listenSocket);
+      listenSocket = -1;
+      return false;
+    }
+
+    stopping = false;
+    serverThread = std::thread(&ControlServer::run, this);
+    return true;
+  }
+
+  void stop() {
+    if (listenSocket < 0) {
+      return;
+    }
+    stopping = true;
+    shutdown(listenSocket, SHUT_RDWR);
+    serverThread.join();
+    close(listenSocket);
+    listenSocket = -1;
+    unlink(socketPath.c_str());
+  }
+
+  // Cheap check for the capture loop
+  bool pending() const {
+    return commandsPending.load(std::memory_order_acquire);
+  }
+
+  // Take the next queued command, returns false if there is none
+  bool takeCommand(ControlCommand &command) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (commands.empty()) {
+      commandsPending = false;
+      return false;
+    }
+    command = commands.front();
+    commands.pop_front();
+    commandsPending = !commands.empty();
+    return true;
+  }
+
+  // Set the text returned by the stats command
+  void setStats(const std::string &text) {
+    std::lock_guard<std::mutex> lock(mutex);
+    stats = text;
+  }
+
+private:
+  // ##### Define the control server thread
+  void run() {
+    int clientSocket;
+    char buffer[256];
+    ssize_t received;
+    std::string line, reply;
+    timeval timeout = { 1, 0 };
+    int errorDelay = 0;   // Milliseconds
+
+    for (;;) {
+      clientSocket = accept(listenSocket, NULL, NULL);
+      if (clientSocket < 0) {
+        if (stopping) {
+          return;
+        }
+        // Back off on errors that persist, such as running out of file descriptors, instead of spinning
+        if (errno != EINTR && errno != ECONNABORTED) {
+          errorDelay = std::min(std::max(errorDelay * 2, 10), 1000);
+          std::this_thread::sleep_for(std::chrono::milliseconds(errorDelay));
+        }
+        continue;
+      }
+      errorDelay = 0;
+
+      // Read one line, a client that sends nothing is dropped after a second
+      setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      line.clear();
+      while (line.find('\n') == std::string::npos && line.size() < sizeof(buffer) && (received = recv(clientSocket, buffer, sizeof(buffer), 0)) > 0) {
+        line.append(buffer, (size_t)received);
+      }
+      line = line.substr(0, line.find_first_of("\r\n"));
+
+      reply = handleCommand(line);
+      send(clientSocket, reply.data(), reply.size(), MSG_NOSIGNAL);
+      close(clientSocket);
+    }
+  }
+
+  // ##### Define the function to check and queue a command, returns the reply
+  std::string handleCommand(const std::string &line) {
+    ControlCommand command;
+    size_t spacePosition = line.find(' ');
+
+    command.name = line.substr(0, spacePosition);
+    command.argument = spacePosition == std::string::npos ? "" : line.substr(spacePosition + 1);
+
+    if (command.name == "stats") {
+      std::lock_guard<std::mutex> lock(mutex);
+      return stats;
+    }
+    if (command.name == "recognition" && command.argument != "on" && command.argument != "off" && command.argument != "toggle") {
+      return "ERROR usage: recognition on|off|toggle\n";
+    }
+    if (command.name == "train" && command.argument != "off" && !isValidTrainingLabel(command.argument)) {
+      return "ERROR usage: train <label>|off, the label cannot contain /, _, .. or whitespace\n";
+    }
+    if (command.name != "stop" && command.name != "recognition" && command.name != "train" && command.name != "reload") {
+      return "ERROR unknown command: " + command.name + "\n";
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    commands.push_back(command);
+    commandsPending.store(true, std::memory_order_release);
+    return "OK\n";
+  }
+
+  int listenSocket;
+  std::string socketPath;
+  std::thread serverThread;
+  std::mutex mutex;
+  std::atomic<bool> stopping;
+  std::atomic<bool> commandsPending;
+  std::deque<ControlCommand> commands;
+  std::string stats;
+};
+
+#endif
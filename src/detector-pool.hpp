@@ -0,0 +1,301 @@
+#ifndef DETECTOR_POOL_HPP
+#define DETECTOR_POOL_HPP
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/objdetect/objdetect.hpp>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include "bounded-queue.hpp"
+#include "cascade-cache.hpp"
+#include "face-detection.hpp"
+#include "pipeline-stats.hpp"
+
+// ##### Define the detection job (a frame handed to the detector pool)
+struct DetectionJob {
+  DetectionJob() : stream(0), frameNumber(0), searchRegionCount(0) {}
+
+  size_t stream;        // Index of the stream the frame came from
+  size_t frameNumber;
+  cv::Mat frameGrey;    // Equalized greyscale frame, shared with the capture loop and only read
+  cv::Rect searchRegions[maxSearchRegions];
+  int searchRegionCount;   // The whole frame is searched when there are no search regions
+  DetectionParameters parameters;
+};
+
+// ##### Define the detection result (face ROI images are cut from the current frame when it is applied)
+struct DetectionResult {
+  DetectionResult() : stream(0), frameNumber(0), detectionTime(std::chrono::steady_clock::duration::zero()) {}
+
+  size_t stream;
+  size_t frameNumber;
+  std::vector<DetectedFace> faces;
+  std::chrono::steady_clock::duration detectionTime;   // Time spent in the cascades
+};
+
+// ##### Define the detector pool
+// A fixed set of long-lived detection threads shared by one or more streams.
+// Each thread owns its own face, eye and nose classifiers, built from cascades
+// parsed once for the whole pool. Every stream has a bounded lock-free job
+// queue and result queue; a thread takes jobs from the stream it is assigned
+// first and steals from the other streams' queues when that one is empty. A stream may only have its share of the threads
+// (rounded up) busy at once, so a busy stream cannot starve the others. Idle
+// threads sleep on a condition variable instead of spinning.
+class DetectorPool {
+public:
+  // The queues hold two jobs and two results per thread, the cascade times are recorded in the statistics if given
+  explicit DetectorPool(size_t threadCount, PipelineStats *pipelineStats = NULL, size_t streamCount = 1)
+    : requestedThreadCount(std::max(threadCount, (size_t)1)), streamQuota((requestedThreadCount + std::max(streamCount, (size_t)1) - 1) / std::max(streamCount, (size_t)1)),
+      pipelineStats(pipelineStats), stopping(false), loadFailed(false), workersReady(0), workersLoaded(0), jobsInFlight(0) {
+    for (size_t i = 0; i < std::max(streamCount, (size_t)1); i++) {
+      streams.push_back(std::unique_ptr<StreamQueues>(new StreamQueues(requestedThreadCount * 2)));
+    }
+  }
+
+  ~DetectorPool() {
+    stop();
+  }
+
+  // Start the threads and wait until every thread has loaded its cascades
+  bool start(const std::string &openCVCascadePath) {
+    stopping = false;
+    loadFailed = false;
+    workersReady = 0;
+    workersLoaded = 0;
+    cascadeCache.setPath(openCVCascadePath);
+
+    std::cout << "Starting detector threads..." << requestedThreadCount << std::endl;
+    for (size_t i = 0; i < requestedThreadCount; i++) {
+      workers.push_back(std::thread(&DetectorPool::run, this, i % streams.size()));
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    readyCondition.wait(lock, [&] { return workersReady == workers.size(); });
+    lock.unlock();
+
+    if (loadFailed) {
+      stop();
+      return false;
+    }
+    return true;
+  }
+
+  // Stop and join the threads, queued jobs are discarded
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    jobCondition.notify_all();
+    for (size_t i = 0; i < workers.size(); i++) {
+      workers[i].join();
+    }
+    workers.clear();
+  }
+
+  // True if another job of the stream can start straight away (no more jobs in flight than threads, nor than the stream's share)
+  bool idleWorkerAvailable(size_t stream = 0) const {
+    return jobsInFlight.load() < workers.size() && streams[stream]->jobsInFlight.load() < streamQuota;
+  }
+
+  // Queue a frame for detection, returns false without blocking if the stream's queue is full
+  bool submit(DetectionJob &&job) {
+    StreamQueues &queues = *streams[job.stream];
+    if (!queues.jobQueue.tryPush(std::move(job))) {
+      return false;
+    }
+    jobsInFlight++;
+    queues.jobsInFlight++;
+    {
+      // Taking the lock orders the push before any waiting thread re-checks the queue
+      std::lock_guard<std::mutex> lock(mutex);
+    }
+    jobCondition.notify_one();
+    return true;
+  }
+
+  // Take a finished result of the stream without blocking
+  bool tryGetResult(DetectionResult &result, size_t stream = 0) {
+    if (!streams[stream]->resultQueue.tryPop(result)) {
+      return false;
+    }
+    jobsInFlight--;
+    streams[stream]->jobsInFlight--;
+    return true;
+  }
+
+  // Block until a result of the stream is available, returns false if a thread has failed instead
+  bool waitResult(DetectionResult &result, size_t stream = 0) {
+    std::unique_lock<std::mutex> lock(mutex);
+    resultCondition.wait(lock, [&] { return !streams[stream]->resultQueue.empty() || loadFailed; });
+    lock.unlock();
+    return tryGetResult(result, stream);
+  }
+
+  bool running() const {
+    return !workers.empty();
+  }
+
+  // True once a thread has failed to load its eye and nose cascades, the pool cannot detect complete faces and must be stopped
+  bool failed() const {
+    return loadFailed;
+  }
+
+  size_t threadCount() const {
+    return workers.size();
+  }
+
+  size_t queueDepth() const {
+    size_t depth = 0;
+    for (size_t i = 0; i < streams.size(); i++) {
+      depth += streams[i]->jobQueue.size();
+    }
+    return depth;
+  }
+
+private:
+  // ##### Define the job and result queues of a stream
+  struct StreamQueues {
+    explicit StreamQueues(size_t capacity) : jobsInFlight(0), jobQueue(capacity), resultQueue(capacity) {}
+
+    // The queue positions are cache line aligned, which plain new does not honour before C++17
+    static void *operator new(size_t size) {
+      void *memory = NULL;
+      if (posix_memalign(&memory, 64, size) != 0) {
+        throw std::bad_alloc();
+      }
+      return memory;
+    }
+
+    static void operator delete(void *memory) {
+      free(memory);
+    }
+
+    std::atomic<size_t> jobsInFlight;
+    BoundedQueue<DetectionJob> jobQueue;
+    BoundedQueue<DetectionResult> resultQueue;
+  };
+
+  // Take a job from the thread's own stream, or steal one from the next stream that has one
+  bool takeJob(size_t ownStream, DetectionJob &job) {
+    for (size_t i = 0; i < streams.size(); i++) {
+      if (streams[(ownStream + i) % streams.size()]->jobQueue.tryPop(job)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool jobQueued() const {
+    for (size_t i = 0; i < streams.size(); i++) {
+      if (!streams[i]->jobQueue.empty()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // ##### Define the detection thread
+  void run(size_t ownStream) {
+    cv::CascadeClassifier faceCascade, eyeCascade, noseCascade;
+    DetectionJob job;
+    DetectionResult result;
+    DetectionScratch scratch;
+
+    // Build this thread's own face classifier, the pool is ready as soon as every thread has one
+    std::cout << "Loading face cascade..." << std::endl;
+    bool loaded = cascadeCache.load(cascadeFace, faceCascade);
+    if (!loaded) {
+      std::cerr << "Error loading face cascade!" << std::endl;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!loaded) {
+        loadFailed = true;
+      }
+      workersReady++;
+    }
+    readyCondition.notify_all();
+    if (!loaded) {
+      return;
+    }
+
+    // Build the eye and nose classifiers while capture starts, the parsed cascades are freed once every thread has them
+    std::cout << "Loading eye and nose cascades..." << std::endl;
+    loaded = cascadeCache.load(cascadeEye, eyeCascade) && cascadeCache.load(cascadeNose, noseCascade);
+    if (++workersLoaded == requestedThreadCount) {
+      cascadeCache.release();
+    }
+    if (!loaded) {
+      std::cerr << "Error loading eye and nose cascades!" << std::endl;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        loadFailed = true;
+      }
+      resultCondition.notify_all();
+      return;
+    }
+
+    for (;;) {
+      // Wait for a job
+      if (!takeJob(ownStream, job)) {
+        std::unique_lock<std::mutex> lock(mutex);
+        jobCondition.wait(lock, [&] { return stopping || jobQueued(); });
+        if (stopping) {
+          return;
+        }
+        continue;
+      }
+
+      // Detect the faces
+      result.stream = job.stream;
+      result.frameNumber = job.frameNumber;
+      detectFaces(result.faces, job.frameGrey, job.searchRegions, job.searchRegionCount, faceCascade, eyeCascade, noseCascade, job.parameters, scratch);
+      result.detectionTime = scratch.faceTime + scratch.eyeTime + scratch.noseTime;
+      if (pipelineStats != NULL) {
+        pipelineStats->record(stageDetectFace, scratch.faceTime);
+        pipelineStats->record(stageDetectEyes, scratch.eyeTime);
+        pipelineStats->record(stageDetectNose, scratch.noseTime);
+      }
+      job = DetectionJob();
+
+      // Post the result, this only spins if the capture loop stops reading results
+      while (!streams[result.stream]->resultQueue.tryPush(std::move(result))) {
+        if (stopping) {
+          return;
+        }
+        std::this_thread::yield();
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+      }
+      resultCondition.notify_all();
+    }
+  }
+
+  size_t requestedThreadCount;
+  size_t streamQuota;
+  PipelineStats *pipelineStats;
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable jobCondition;
+  std::condition_variable resultCondition;
+  std::condition_variable readyCondition;
+  std::atomic<bool> stopping;
+  std::atomic<bool> loadFailed;
+  size_t workersReady;
+  std::atomic<size_t> workersLoaded;
+  std::atomic<size_t> jobsInFlight;
+  CascadeCache cascadeCache;
+  std::vector<std::unique_ptr<StreamQueues>> streams;
+};
+
+#endif
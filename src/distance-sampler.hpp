@@ -0,0 +1,176 @@
+#ifndef DISTANCE_SAMPLER_HPP
+#define DISTANCE_SAMPLER_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "gpio.hpp"
+
+// ##### Define the ultrasonic distance sampler
+// Measures the HC-SR04 distance on its own thread. Each measurement times the
+// echo pulse edges against deadlines, so a missed echo costs at most the
+// timeout instead of hanging, and the latest median filtered distance is
+// published through an atomic the capture loop reads without blocking. After
+// a run of failed measurements the distance is no longer valid, so a sensor
+// that stops answering does not leave a stale distance on screen.
+class DistanceSampler {
+public:
+  DistanceSampler(std::unique_ptr<Gpio> gpio, int triggerGpioPin, int echoGpioPin)
+    : gpio(std::move(gpio)), triggerGpioPin(triggerGpioPin), echoGpioPin(echoGpioPin),
+      sampleInterval(200), medianWindow(5), maximumConsecutiveFailures(5), stopping(false), latestDistance(0.0), distanceValid(false),
+      measurementCount(0), failedMeasurements(0) {}
+
+  ~DistanceSampler() {
+    stop();
+  }
+
+  // Set up the pins and start sampling every interval, the distance is invalid after the given number of failures in a row
+  bool start(int sampleIntervalMilliseconds, size_t medianWindowSize, int maximumFailures = 5) {
+    sampleInterval = std::max(sampleIntervalMilliseconds, 60);   // The sensor needs 60ms between measurements
+    medianWindow = std::max(medianWindowSize, (size_t)1);
+    maximumConsecutiveFailures = std::max(maximumFailures, 1);
+    if (!gpio->setup()) {
+      return false;
+    }
+    gpio->setOutput(triggerGpioPin);
+    gpio->setInput(echoGpioPin);
+    gpio->write(triggerGpioPin, false);
+
+    stopping = false;
+    samplerThread = std::thread(&DistanceSampler::run, this);
+    return true;
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    condition.notify_all();
+    if (samplerThread.joinable()) {
+      samplerThread.join();
+    }
+  }
+
+  // Get the latest distance in centimetres, returns false until a measurement has succeeded or after a run of failures
+  bool latest(double &distance) const {
+    distance = latestDistance.load();
+    return distanceValid.load();
+  }
+
+  // Number of measurements taken, successful or not
+  size_t measurements() const {
+    return measurementCount.load();
+  }
+
+  size_t failures() const {
+    return failedMeasurements.load();
+  }
+
+  // ##### Define the function to take a single measurement, returns a negative distance on timeout
+  double measure() {
+    const double speedOfSound = 340.29;   // Metres Per Second at sea level
+    const uint64_t echoStartTimeout = 30000;   // Microseconds
+    const uint64_t echoEndTimeout = 30000;     // Microseconds, about 5 metres round trip
+    uint64_t deadline, startTime, endTime;
+
+    // Make sure a previous echo has finished
+    deadline = gpio->microseconds() + echoEndTimeout;
+    while (gpio->read(echoGpioPin)) {
+      if (gpio->microseconds() > deadline) {
+        return -1.0;
+      }
+    }
+
+    // Triggering the sensor for 10 microseconds
+    // Will send out 8 ultrasonic (40kHz) bursts and listen for echos
+    gpio->write(triggerGpioPin, true);
+    gpio->sleepMicroseconds(10);
+    gpio->write(triggerGpioPin, false);
+
+    // Waiting for echo start
+    deadline = gpio->microseconds() + echoStartTimeout;
+    while (!gpio->read(echoGpioPin)) {
+      if (gpio->microseconds() > deadline) {
+        return -1.0;
+      }
+    }
+    startTime = gpio->microseconds();
+
+    // Waiting for echo end
+    deadline = startTime + echoEndTimeout;
+    while (gpio->read(echoGpioPin)) {
+      if (gpio->microseconds() > deadline) {
+        return -1.0;
+      }
+    }
+    endTime = gpio->microseconds();
+
+    // Calculate distance in centimetres
+    return (((endTime - startTime) / 1000000.0) * speedOfSound) / 2 * 100;
+  }
+
+private:
+  // ##### Define the sampler thread
+  void run() {
+    std::deque<double> window;
+    std::vector<double> sorted;
+    double distance;
+    int consecutiveFailures = 0;
+
+    for (;;) {
+      distance = measure();
+      if (distance >= 0) {
+        consecutiveFailures = 0;
+        // Publish the median of the last few measurements
+        window.push_back(distance);
+        if (window.size() > medianWindow) {
+          window.pop_front();
+        }
+        sorted.assign(window.begin(), window.end());
+        std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+        latestDistance = sorted[sorted.size() / 2];
+        distanceValid = true;
+      }
+      else {
+        failedMeasurements++;
+
+        // Expire the distance and start the median afresh once the sensor has stopped answering
+        if (++consecutiveFailures >= maximumConsecutiveFailures) {
+          distanceValid = false;
+          window.clear();
+        }
+      }
+      measurementCount++;
+
+      std::unique_lock<std::mutex> lock(mutex);
+      if (condition.wait_for(lock, std::chrono::milliseconds(sampleInterval), [&] { return stopping.load(); })) {
+        return;
+      }
+    }
+  }
+
+  std::unique_ptr<Gpio> gpio;
+  int triggerGpioPin;
+  int echoGpioPin;
+  int sampleInterval;
+  size_t medianWindow;
+  int maximumConsecutiveFailures;
+  std::thread samplerThread;
+  std::mutex mutex;
+  std::condition_variable condition;
+  std::atomic<bool> stopping;
+  std::atomic<double> latestDistance;
+  std::atomic<bool> distanceValid;
+  std::atomic<size_t> measurementCount;
+  std::atomic<size_t> failedMeasurements;
+};
+
+#endif
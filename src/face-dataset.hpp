@@ -0,0 +1,396 @@
+#ifndef FACE_DATASET_HPP
+#define FACE_DATASET_HPP
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "hash.hpp"
+#include "recognizer-model-cache.hpp"
+#include "training-images.hpp"
+
+// ##### Define the face dataset file format
+// An append-only file of raw 100x100 greyscale face images. After the file
+// header every record is a record header followed by its payload, padded to
+// 8 bytes. A label record names the next label number, an image record holds
+// the pixels of one face with its label number and capture time. Each record
+// carries a checksum, so a record cut short by a crash is found and dropped.
+const char faceDatasetMagic[4] = {'F', 'D', 'A', 'T'};
+const uint32_t faceDatasetVersion = 1;
+
+struct FaceDatasetHeader {
+  char magic[4];
+  uint32_t version;
+  uint16_t imageWidth;
+  uint16_t imageHeight;
+  uint32_t reserved;
+};
+
+enum FaceDatasetRecordType {
+  faceDatasetLabel = 1,     // Payload is the label name
+  faceDatasetImage = 2      // Payload is imageWidth * imageHeight pixels
+};
+
+struct FaceDatasetRecord {
+  uint32_t type;
+  uint32_t label;
+  int64_t timestamp;        // Seconds since the epoch
+  uint32_t length;          // Payload bytes, before padding
+  uint32_t checksum;        // FNV-1a of the fields above and the payload, folded to 32 bits
+};
+
+inline size_t faceDatasetPadded(size_t length) {
+  return (length + 7) & ~(size_t)7;
+}
+
+inline uint32_t faceDatasetChecksum(const FaceDatasetRecord &record, const char *payload) {
+  uint64_t hash = hashBytes(14695981039346656037ULL, (const char *)&record, offsetof(FaceDatasetRecord, checksum));
+  hash = hashBytes(hash, payload, record.length);
+  return (uint32_t)(hash ^ (hash >> 32));
+}
+
+// ##### Define the face dataset
+// Opening maps the file read only and indexes it, the images are returned as
+// views straight into the mapping, so loading costs no decoding and no copy
+// and only stays valid while the dataset is open and its images have not been
+// released. Opened for appending it is still loaded from, and new records are
+// written with one write each and synced every syncInterval images rather
+// than every image.
+class FaceDataset {
+public:
+  explicit FaceDataset(size_t syncInterval = 10)
+    : syncInterval(std::max(syncInterval, (size_t)1)), fileDescriptor(-1), mapping(NULL), mappingLength(0), validLength(0),
+      datasetHash(14695981039346656037ULL), unsyncedRecords(0) {}
+
+  ~FaceDataset() {
+    close();
+  }
+
+  // Open and index the dataset, creating it when appending. A cut short record at the end is truncated away when appending.
+  bool open(const std::string &datasetFilePath, bool append) {
+    struct stat status;
+
+    close();
+    path = datasetFilePath;
+    fileDescriptor = ::open(path.c_str(), append ? O_RDWR | O_CREAT | O_APPEND : O_RDONLY, 0644);
+    if (fileDescriptor < 0 || fstat(fileDescriptor, &status) != 0) {
+      std::cerr << "Error opening face dataset!..." << path << " " << strerror(errno) << std::endl;
+      close();
+      return false;
+    }
+
+    // Write the header of a new dataset
+    if (status.st_size == 0 && append) {
+      FaceDatasetHeader header;
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, faceDatasetMagic, sizeof(header.magic));
+      header.version = faceDatasetVersion;
+      header.imageWidth = faceRecognizerImageWidth;
+      header.imageHeight = faceRecognizerImageHeight;
+      if (!writeAll((const char *)&header, sizeof(header)) || fsync(fileDescriptor) != 0) {
+        std::cerr << "Error creating face dataset!..." << path << std::endl;
+        close();
+        return false;
+      }
+      validLength = sizeof(header);
+      return true;
+    }
+
+    // Map the whole file and walk the records
+    mappingLength = (size_t)status.st_size;
+    if (mappingLength < sizeof(FaceDatasetHeader)) {
+      std::cerr << "Not a face dataset!..." << path << std::endl;
+      close();
+      return false;
+    }
+    mapping = (const char *)mmap(NULL, mappingLength, PROT_READ, MAP_SHARED, fileDescriptor, 0);
+    if (mapping == MAP_FAILED) {
+      mapping = NULL;
+      std::cerr << "Error mapping face dataset!..." << path << " " << strerror(errno) << std::endl;
+      close();
+      return false;
+    }
+    madvise((void *)mapping, mappingLength, MADV_WILLNEED);
+    if (!index()) {
+      close();
+      return false;
+    }
+
+    if (validLength < mappingLength) {
+      std::cerr << "Face dataset ends in a damaged record, " << mappingLength - validLength << " bytes ignored..." << path << std::endl;
+      if (append && ftruncate(fileDescriptor, (off_t)validLength) != 0) {
+        std::cerr << "Error truncating face dataset!..." << path << std::endl;
+        close();
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Release the mapping once the images are no longer needed, the dataset can still be appended to
+  void releaseImages() {
+    if (mapping != NULL) {
+      munmap((void *)mapping, mappingLength);
+      mapping = NULL;
+    }
+    mappingLength = 0;
+    imageOffsets.clear();
+    imageLabels.clear();
+    imageTimestamps.clear();
+  }
+
+  // Sync the appended records and release the mapping
+  void close() {
+    sync();
+    releaseImages();
+    if (fileDescriptor >= 0) {
+      ::close(fileDescriptor);
+      fileDescriptor = -1;
+    }
+    validLength = 0;
+    datasetHash = 14695981039346656037ULL;
+    names.clear();
+    labelIndex.clear();
+  }
+
+  // Add the images mapped when the dataset was opened and their labels to the arrays, the images are read only
+  void images(std::vector<cv::Mat> &faceImages, std::vector<int> &faceLabels) const {
+    faceImages.reserve(faceImages.size() + imageOffsets.size());
+    faceLabels.reserve(faceLabels.size() + imageOffsets.size());
+    for (size_t i = 0; i < imageOffsets.size(); i++) {
+      faceImages.push_back(cv::Mat(faceRecognizerImageHeight, faceRecognizerImageWidth, CV_8UC1, (void *)(mapping + imageOffsets[i])));
+      faceLabels.push_back(imageLabels[i]);
+    }
+  }
+
+  // Append a face image, adding its label first if it is new. The face is converted to greyscale and resized if need be.
+  bool append(const std::string &labelName, const cv::Mat &faceImage, int64_t timestamp) {
+    std::unordered_map<std::string, int>::const_iterator findIterator = labelIndex.find(labelName);
+    int label;
+
+    if (fileDescriptor < 0 || faceImage.empty()) {
+      return false;
+    }
+    if (findIterator == labelIndex.end()) {
+      label = (int)names.size() + 1;
+      if (!writeRecord(faceDatasetLabel, label, timestamp, labelName.c_str(), labelName.size())) {
+        return false;
+      }
+      names.push_back(labelName);
+      labelIndex[labelName] = label;
+    }
+    else {
+      label = findIterator->second;
+    }
+
+    const cv::Mat *faceGrey = &faceImage;
+    if (faceImage.channels() == 3) {
+      cv::cvtColor(faceImage, greyImage, cv::COLOR_BGR2GRAY);
+      faceGrey = &greyImage;
+    }
+    if (faceGrey->cols != faceRecognizerImageWidth || faceGrey->rows != faceRecognizerImageHeight) {
+      cv::resize(*faceGrey, appendImage, cv::Size(faceRecognizerImageWidth, faceRecognizerImageHeight), 0, 0, cv::INTER_AREA);
+    }
+    else {
+      faceGrey->copyTo(appendImage);
+    }
+    if (!writeRecord(faceDatasetImage, label, timestamp, (const char *)appendImage.data, appendImage.total())) {
+      return false;
+    }
+
+    // Sync in batches, a crash loses at most the images since the last sync
+    if (++unsyncedRecords >= syncInterval) {
+      return sync();
+    }
+    return true;
+  }
+
+  // Flush the appended records to disk
+  bool sync() {
+    if (fileDescriptor < 0 || unsyncedRecords == 0) {
+      return true;
+    }
+    unsyncedRecords = 0;
+    if (fdatasync(fileDescriptor) != 0) {
+      std::cerr << "Error syncing face dataset!..." << path << " " << strerror(errno) << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  bool isOpen() const {
+    return fileDescriptor >= 0;
+  }
+
+  // Number of images mapped when the dataset was opened
+  size_t size() const {
+    return imageOffsets.size();
+  }
+
+  // Label and capture time of a mapped image
+  int label(size_t i) const {
+    return imageLabels[i];
+  }
+
+  int64_t timestamp(size_t i) const {
+    return imageTimestamps[i];
+  }
+
+  // Label names, numbered from 1, including the labels appended since opening
+  const std::vector<std::string> &labelNames() const {
+    return names;
+  }
+
+  // Hash of every record checksum, changes whenever a record is appended
+  uint64_t hash() const {
+    return datasetHash;
+  }
+
+private:
+  // ##### Define the function to walk the records, stopping at the first one that is cut short or damaged
+  bool index() {
+    const FaceDatasetHeader *header = (const FaceDatasetHeader *)mapping;
+    const size_t imageLength = (size_t)faceRecognizerImageWidth * faceRecognizerImageHeight;
+    size_t offset = sizeof(FaceDatasetHeader);
+    FaceDatasetRecord record;
+
+    if (memcmp(header->magic, faceDatasetMagic, sizeof(header->magic)) != 0 || header->version != faceDatasetVersion) {
+      std::cerr << "Not a face dataset!..." << path << std::endl;
+      return false;
+    }
+    if (header->imageWidth != faceRecognizerImageWidth || header->imageHeight != faceRecognizerImageHeight) {
+      std::cerr << "Face dataset image size does not match!..." << header->imageWidth << "x" << header->imageHeight << std::endl;
+      return false;
+    }
+
+    while (offset + sizeof(FaceDatasetRecord) <= mappingLength) {
+      memcpy(&record, mapping + offset, sizeof(record));
+      const char *payload = mapping + offset + sizeof(record);
+      if (record.length > mappingLength - offset - sizeof(record) || faceDatasetChecksum(record, payload) != record.checksum) {
+        break;
+      }
+      if (record.type == faceDatasetLabel && record.label == names.size() + 1) {
+        names.push_back(std::string(payload, record.length));
+        labelIndex[names.back()] = (int)record.label;
+      }
+      else if (record.type == faceDatasetImage && record.length == imageLength && record.label >= 1 && record.label <= names.size()) {
+        imageOffsets.push_back(offset + sizeof(record));
+        imageLabels.push_back((int)record.label);
+        imageTimestamps.push_back(record.timestamp);
+      }
+      else {
+        break;
+      }
+      datasetHash = hashBytes(datasetHash, (const char *)&record.checksum, sizeof(record.checksum));
+      offset = std::min(offset + sizeof(record) + faceDatasetPadded(record.length), mappingLength);
+    }
+    validLength = offset;
+    return true;
+  }
+
+  // ##### Define the function to write a record with its padding in one write
+  bool writeRecord(FaceDatasetRecordType type, int label, int64_t timestamp, const char *payload, size_t length) {
+    FaceDatasetRecord record;
+
+    record.type = type;
+    record.label = (uint32_t)label;
+    record.timestamp = timestamp;
+    record.length = (uint32_t)length;
+    record.checksum = faceDatasetChecksum(record, payload);
+
+    recordBuffer.assign(sizeof(record) + faceDatasetPadded(length), 0);
+    memcpy(&recordBuffer[0], &record, sizeof(record));
+    memcpy(&recordBuffer[sizeof(record)], payload, length);
+    if (!writeAll(&recordBuffer[0], recordBuffer.size())) {
+      std::cerr << "Error writing face dataset!..." << path << " " << strerror(errno) << std::endl;
+      return false;
+    }
+    validLength += recordBuffer.size();
+    datasetHash = hashBytes(datasetHash, (const char *)&record.checksum, sizeof(record.checksum));
+    return true;
+  }
+
+  bool writeAll(const char *bytes, size_t length) {
+    ssize_t written;
+    while (length > 0) {
+      written = write(fileDescriptor, bytes, length);
+      if (written < 0 && errno == EINTR) {
+        continue;
+      }
+      if (written <= 0) {
+        return false;
+      }
+      bytes += written;
+      length -= (size_t)written;
+    }
+    return true;
+  }
+
+  std::string path;
+  size_t syncInterval;
+  int fileDescriptor;
+  const char *mapping;
+  size_t mappingLength;
+  size_t validLength;
+  uint64_t datasetHash;
+  size_t unsyncedRecords;
+  std::vector<size_t> imageOffsets;
+  std::vector<int> imageLabels;
+  std::vector<int64_t> imageTimestamps;
+  std::vector<std::string> names;
+  std::unordered_map<std::string, int> labelIndex;
+  std::vector<char> recordBuffer;
+  cv::Mat greyImage;
+  cv::Mat appendImage;
+};
+
+// ##### Define the training set (the face dataset when there is one, otherwise the training image directory)
+struct TrainingSet {
+  std::string imagesPath;
+  std::string datasetFilePath;    // Empty to use the training image directory
+};
+
+// ##### Define the function to hash the training set, the dataset hash always covers the image contents
+// The dataset is opened read only unless it is open already, and stays open for loadTrainingSet.
+inline uint64_t trainingSetHash(const TrainingSet &trainingSet, bool contents, FaceDataset &dataset) {
+  if (!trainingSet.datasetFilePath.empty()) {
+    return dataset.isOpen() || dataset.open(trainingSet.datasetFilePath, false) ? dataset.hash() : 0;
+  }
+  return contents ? trainingManifestHash(trainingSet.imagesPath) : trainingNamesHash(trainingSet.imagesPath);
+}
+
+// ##### Define the function to load the training set, images from the dataset are only valid while it stays open
+// An open dataset is used as it is, so its file is only mapped and checked once.
+inline bool loadTrainingSet(const TrainingSet &trainingSet, FaceDataset &dataset, std::vector<cv::Mat> &faceRecognizerImages, std::vector<int> &faceRecognizerLabels, std::vector<std::string> &faceRecognizerLabelNames) {
+  std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+  if (trainingSet.datasetFilePath.empty()) {
+    return loadFaceRecognizerTrainingImages(trainingSet.imagesPath, faceRecognizerImages, faceRecognizerLabels, faceRecognizerLabelNames);
+  }
+
+  if (!dataset.isOpen() && !dataset.open(trainingSet.datasetFilePath, false)) {
+    return false;
+  }
+  dataset.images(faceRecognizerImages, faceRecognizerLabels);
+  faceRecognizerLabelNames = dataset.labelNames();
+  for (size_t i = 0; i < faceRecognizerLabelNames.size(); i++) {
+    std::cout << "Face Recognizer Label Name..." << i + 1 << " " << faceRecognizerLabelNames[i] << std::endl;
+  }
+  std::cout << "Loaded face dataset..." << dataset.size() << " images in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count() << "ms" << std::endl;
+  return true;
+}
+
+#endif
@@ -0,0 +1,283 @@
+#ifndef FACE_DETECTION_HPP
+#define FACE_DETECTION_HPP
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/objdetect/objdetect.hpp>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// ##### Define the face detection parameters
+// Faces are searched for on a downscaled copy of the frame and the boxes mapped
+// back to full resolution. Eyes are only searched for in a band across the
+// upper part of each face and the nose in a box in its centre, the bounds are
+// fractions of the face width and height. The scale factor, minimum
+// neighbours and size bounds of each cascade are passed to detectMultiScale,
+// the face sizes are in full resolution pixels and the eye and nose sizes in
+// pixels of the face. Without the feature stages the eyes and nose are not
+// searched for and every face found is complete.
+struct DetectionParameters {
+  DetectionParameters()
+    : faceDownscale(2.0),
+      eyeRegionTop(0.15), eyeRegionBottom(0.6),
+      noseRegionTop(0.3), noseRegionBottom(0.85), noseRegionLeft(0.2), noseRegionRight(0.8),
+      faceScaleFactor(1.1), faceMinNeighbors(5), faceMinSize(20), faceMaxSize(400),
+      eyeScaleFactor(1.1), eyeMinNeighbors(5), eyeMinSize(10), eyeMaxSize(50),
+      noseScaleFactor(1.1), noseMinNeighbors(5), noseMinSize(10), noseMaxSize(200),
+      featureStages(true) {}
+
+  double faceDownscale;
+  double eyeRegionTop, eyeRegionBottom;
+  double noseRegionTop, noseRegionBottom, noseRegionLeft, noseRegionRight;
+  double faceScaleFactor;
+  int faceMinNeighbors, faceMinSize, faceMaxSize;
+  double eyeScaleFactor;
+  int eyeMinNeighbors, eyeMinSize, eyeMaxSize;
+  double noseScaleFactor;
+  int noseMinNeighbors, noseMinSize, noseMaxSize;
+  bool featureStages;
+};
+
+// ##### Define the function to check that the eye and nose regions are within the face, reports the first that is not
+// Each region needs 0 <= top < bottom <= 1 and 0 <= left < right <= 1, otherwise it would be empty or outside the face.
+inline bool checkDetectionRegions(const DetectionParameters &parameters) {
+  const struct {
+    const char *name;
+    double start, end;
+  } bounds[] = {
+    { "eye region top and bottom", parameters.eyeRegionTop, parameters.eyeRegionBottom },
+    { "nose region top and bottom", parameters.noseRegionTop, parameters.noseRegionBottom },
+    { "nose region left and right", parameters.noseRegionLeft, parameters.noseRegionRight }
+  };
+
+  for (size_t i = 0; i < sizeof(bounds) / sizeof(bounds[0]); i++) {
+    if (!(bounds[i].start >= 0.0 && bounds[i].start < bounds[i].end && bounds[i].end <= 1.0)) {
+      std::cerr << "Invalid " << bounds[i].name << ", they must be fractions with 0 <= start < end <= 1!..." << bounds[i].start << " " << bounds[i].end << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// ##### Define the function to save the detection parameters as a detector profile
+inline bool saveDetectionProfile(const std::string &profileFilePath, const DetectionParameters &parameters) {
+  try {
+    cv::FileStorage profileFile(profileFilePath, cv::FileStorage::WRITE);
+    if (!profileFile.isOpened()) {
+      return false;
+    }
+    profileFile << "faceDownscale" << parameters.faceDownscale;
+    profileFile << "eyeRegionTop" << parameters.eyeRegionTop << "eyeRegionBottom" << parameters.eyeRegionBottom;
+    profileFile << "noseRegionTop" << parameters.noseRegionTop << "noseRegionBottom" << parameters.noseRegionBottom;
+    profileFile << "noseRegionLeft" << parameters.noseRegionLeft << "noseRegionRight" << parameters.noseRegionRight;
+    profileFile << "faceScaleFactor" << parameters.faceScaleFactor << "faceMinNeighbors" << parameters.faceMinNeighbors;
+    profileFile << "faceMinSize" << parameters.faceMinSize << "faceMaxSize" << parameters.faceMaxSize;
+    profileFile << "eyeScaleFactor" << parameters.eyeScaleFactor << "eyeMinNeighbors" << parameters.eyeMinNeighbors;
+    profileFile << "eyeMinSize" << parameters.eyeMinSize << "eyeMaxSize" << parameters.eyeMaxSize;
+    profileFile << "noseScaleFactor" << parameters.noseScaleFactor << "noseMinNeighbors" << parameters.noseMinNeighbors;
+    profileFile << "noseMinSize" << parameters.noseMinSize << "noseMaxSize" << parameters.noseMaxSize;
+  }
+  catch (cv::Exception &ex) {
+    std::cerr << "Error saving detector profile!..." << ex.msg << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// ##### Define the function to load a detector profile, values missing from it are left as they are and the regions are checked
+inline bool loadDetectionProfile(const std::string &profileFilePath, DetectionParameters &parameters) {
+  try {
+    cv::FileStorage profileFile(profileFilePath, cv::FileStorage::READ);
+    if (!profileFile.isOpened()) {
+      std::cerr << "Error opening detector profile!..." << profileFilePath << std::endl;
+      return false;
+    }
+    cv::read(profileFile["faceDownscale"], parameters.faceDownscale, parameters.faceDownscale);
+    cv::read(profileFile["eyeRegionTop"], parameters.eyeRegionTop, parameters.eyeRegionTop);
+    cv::read(profileFile["eyeRegionBottom"], parameters.eyeRegionBottom, parameters.eyeRegionBottom);
+    cv::read(profileFile["noseRegionTop"], parameters.noseRegionTop, parameters.noseRegionTop);
+    cv::read(profileFile["noseRegionBottom"], parameters.noseRegionBottom, parameters.noseRegionBottom);
+    cv::read(profileFile["noseRegionLeft"], parameters.noseRegionLeft, parameters.noseRegionLeft);
+    cv::read(profileFile["noseRegionRight"], parameters.noseRegionRight, parameters.noseRegionRight);
+    cv::read(profileFile["faceScaleFactor"], parameters.faceScaleFactor, parameters.faceScaleFactor);
+    cv::read(profileFile["faceMinNeighbors"], parameters.faceMinNeighbors, parameters.faceMinNeighbors);
+    cv::read(profileFile["faceMinSize"], parameters.faceMinSize, parameters.faceMinSize);
+    cv::read(profileFile["faceMaxSize"], parameters.faceMaxSize, parameters.faceMaxSize);
+    cv::read(profileFile["eyeScaleFactor"], parameters.eyeScaleFactor, parameters.eyeScaleFactor);
+    cv::read(profileFile["eyeMinNeighbors"], parameters.eyeMinNeighbors, parameters.eyeMinNeighbors);
+    cv::read(profileFile["eyeMinSize"], parameters.eyeMinSize, parameters.eyeMinSize);
+    cv::read(profileFile["eyeMaxSize"], parameters.eyeMaxSize, parameters.eyeMaxSize);
+    cv::read(profileFile["noseScaleFactor"], parameters.noseScaleFactor, parameters.noseScaleFactor);
+    cv::read(profileFile["noseMinNeighbors"], parameters.noseMinNeighbors, parameters.noseMinNeighbors);
+    cv::read(profileFile["noseMinSize"], parameters.noseMinSize, parameters.noseMinSize);
+    cv::read(profileFile["noseMaxSize"], parameters.noseMaxSize, parameters.noseMaxSize);
+  }
+  catch (cv::Exception &ex) {
+    std::cerr << "Error loading detector profile!..." << ex.msg << std::endl;
+    return false;
+  }
+  if (!checkDetectionRegions(parameters)) {
+    std::cerr << "Error loading detector profile!..." << profileFilePath << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// A detection searches at most this many regions of the frame
+const int maxSearchRegions = 4;
+
+// ##### Define the function to get a sub-region of a face from fractions of its size
+inline cv::Rect faceSubRegion(const cv::Rect &face, double top, double bottom, double left, double right) {
+  cv::Rect region;
+  region.x = (int)(face.width * left);
+  region.y = (int)(face.height * top);
+  region.width = std::max((int)(face.width * right) - region.x, 1);
+  region.height = std::max((int)(face.height * bottom) - region.y, 1);
+  return region & cv::Rect(0, 0, face.width, face.height);
+}
+
+// ##### Define the detected face (the eyes and nose are only set when complete, relative to the face)
+struct DetectedFace {
+  DetectedFace() : complete(false), featuresFound(false) {}
+
+  cv::Rect rect;
+  bool complete;          // Two eyes and a nose were found, or the feature stages were skipped
+  bool featuresFound;     // The eyes and nose are set
+  cv::Rect eyes[2];
+  cv::Rect nose;
+};
+
+// ##### Define the detection scratch buffers, kept by each detection thread so that detections reuse them
+struct DetectionScratch {
+  cv::Mat frameGreySmall;
+  std::vector<cv::Rect> faces;
+  std::vector<cv::Rect> regionFaces;
+  std::vector<cv::Rect> eyes;
+  std::vector<cv::Rect> nose;
+  std::chrono::steady_clock::duration faceTime, eyeTime, noseTime;   // Time spent in each cascade by the last detection
+};
+
+// ##### Define the method to perform the face detection
+// The cascades are passed by reference and are not thread safe, each detection thread must own its own set
+// The frame is the equalized greyscale frame, it is only read so it can be shared with the capture loop
+// Faces are only searched for in the search regions, or in the whole frame when there are none
+inline void detectFaces(std::vector<DetectedFace> &detectedFaces, const cv::Mat &frameGrey, const cv::Rect *searchRegions, int searchRegionCount, cv::CascadeClassifier &faceCascade, cv::CascadeClassifier &eyeCascade, cv::CascadeClassifier &noseCascade, const DetectionParameters &parameters, DetectionScratch &scratch) {
+  // Intialise the function objects
+  std::vector<cv::Rect> &faces = scratch.faces;
+  std::vector<cv::Rect> &regionFaces = scratch.regionFaces;
+  std::vector<cv::Rect> &eyes = scratch.eyes;
+  std::vector<cv::Rect> &nose = scratch.nose;
+  cv::Mat faceROIGrey;
+  cv::Rect eyeRegion, noseRegion, searchRect, face;
+  cv::Rect frameRect(0, 0, frameGrey.cols, frameGrey.rows);
+  double downscale = std::max(parameters.faceDownscale, 1.0);
+  int faceMinSize = std::max((int)(parameters.faceMinSize / downscale), 1);
+  int faceMaxSize = std::max((int)(parameters.faceMaxSize / downscale), faceMinSize);
+  std::chrono::steady_clock::time_point stageStart = std::chrono::steady_clock::now();
+
+  scratch.eyeTime = scratch.noseTime = std::chrono::steady_clock::duration::zero();
+
+  // Detect any faces in each search region on the downscaled frame and map them back to full resolution
+  faces.clear();
+  for (int r = 0; r < std::max(searchRegionCount, 1); r++) {
+    searchRect = searchRegionCount > 0 ? searchRegions[r] & frameRect : frameRect;
+    if ((int)(searchRect.width / downscale) < 1 || (int)(searchRect.height / downscale) < 1) {
+      continue;
+    }
+    if (downscale > 1.0) {
+      cv::resize(frameGrey(searchRect), scratch.frameGreySmall, cv::Size((int)(searchRect.width / downscale), (int)(searchRect.height / downscale)), 0, 0, cv::INTER_AREA);
+      faceCascade.detectMultiScale(scratch.frameGreySmall, regionFaces, parameters.faceScaleFactor, parameters.faceMinNeighbors, CV_HAAR_SCALE_IMAGE, cv::Size(faceMinSize, faceMinSize), cv::Size(faceMaxSize, faceMaxSize));
+    }
+    else {
+      faceCascade.detectMultiScale(frameGrey(searchRect), regionFaces, parameters.faceScaleFactor, parameters.faceMinNeighbors, CV_HAAR_SCALE_IMAGE, cv::Size(faceMinSize, faceMinSize), cv::Size(faceMaxSize, faceMaxSize));
+    }
+
+    // Skip a face already found in an overlapping region
+    for (size_t i = 0; i < regionFaces.size(); i++) {
+      face = cv::Rect((int)(regionFaces[i].x * downscale) + searchRect.x, (int)(regionFaces[i].y * downscale) + searchRect.y, (int)(regionFaces[i].width * downscale), (int)(regionFaces[i].height * downscale)) & frameRect;
+      bool duplicate = false;
+      for (size_t j = 0; j < faces.size() && !duplicate; j++) {
+        duplicate = (faces[j] & face).area() * 2 > std::min(faces[j].area(), face.area());
+      }
+      if (!duplicate) {
+        faces.push_back(face);
+      }
+    }
+  }
+
+  scratch.faceTime = std::chrono::steady_clock::now() - stageStart;
+
+  // Loop through each face
+  detectedFaces.resize(faces.size());
+  for (size_t i = 0; i < faces.size(); i++) {
+    detectedFaces[i] = DetectedFace();
+    detectedFaces[i].rect = faces[i];
+
+    // Without the feature stages every face is used as it is
+    if (!parameters.featureStages) {
+      detectedFaces[i].complete = true;
+      continue;
+    }
+
+    // Without the eye and nose cascades, which are loaded after the face cascade, the face cannot be complete
+    if (eyeCascade.empty() || noseCascade.empty()) {
+      continue;
+    }
+
+    // Get the face region of interest
+    faceROIGrey = frameGrey(faces[i]);
+
+    // Detect eyes in the upper part of the face only
+    stageStart = std::chrono::steady_clock::now();
+    eyeRegion = faceSubRegion(faces[i], parameters.eyeRegionTop, parameters.eyeRegionBottom, 0.0, 1.0);
+    eyeCascade.detectMultiScale(faceROIGrey(eyeRegion), eyes, parameters.eyeScaleFactor, parameters.eyeMinNeighbors, CV_HAAR_SCALE_IMAGE, cv::Size(parameters.eyeMinSize, parameters.eyeMinSize), cv::Size(parameters.eyeMaxSize, parameters.eyeMaxSize));
+    scratch.eyeTime += std::chrono::steady_clock::now() - stageStart;
+
+    // Stop early, without two eyes the face is not used so the nose search can be skipped
+    if (eyes.size() != 2) {
+      continue;
+    }
+
+    // Detect nose in the centre of the face only
+    stageStart = std::chrono::steady_clock::now();
+    noseRegion = faceSubRegion(faces[i], parameters.noseRegionTop, parameters.noseRegionBottom, parameters.noseRegionLeft, parameters.noseRegionRight);
+    noseCascade.detectMultiScale(faceROIGrey(noseRegion), nose, parameters.noseScaleFactor, parameters.noseMinNeighbors, CV_HAAR_SCALE_IMAGE, cv::Size(parameters.noseMinSize, parameters.noseMinSize), cv::Size(parameters.noseMaxSize, parameters.noseMaxSize));
+    scratch.noseTime += std::chrono::steady_clock::now() - stageStart;
+
+    // Keep the eyes and nose relative to the face
+    if (nose.size() == 1) {
+      detectedFaces[i].complete = detectedFaces[i].featuresFound = true;
+      for (size_t j = 0; j < 2; j++) {
+        detectedFaces[i].eyes[j] = eyes[j] + eyeRegion.tl();
+      }
+      detectedFaces[i].nose = nose[0] + noseRegion.tl();
+    }
+  }
+
+  return;
+}
+
+// ##### Define the function to draw the eyes and nose of a detected face onto its face ROI image
+inline void drawFaceFeatures(cv::Mat &faceROI, const DetectedFace &detectedFace) {
+  int lineThickness = 1;
+  int lineType = CV_AA;   // 8, 4 or CV_AA
+
+  if (!detectedFace.featuresFound) {
+    return;
+  }
+
+  // Draw an ellipse around each eye
+  for (size_t j = 0; j < 2; j++) {
+    const cv::Rect &eye = detectedFace.eyes[j];
+    cv::Point center(eye.x + eye.width * 0.5, eye.y + eye.height * 0.5);
+    cv::ellipse(faceROI, center, cv::Size(eye.width * 0.5, eye.height * 0.5), 0, 0, 360, cv::Scalar(255, 0, 0), lineThickness, lineType, 0);
+  }
+
+  // Draw a rectangle around the nose
+  cv::rectangle(faceROI, detectedFace.nose.tl(), detectedFace.nose.br(), cv::Scalar(255, 150, 0), lineThickness, lineType, 0);
+}
+
+#endif
@@ -0,0 +1,321 @@
+#ifndef FACE_GALLERY_HPP
+#define FACE_GALLERY_HPP
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/contrib/contrib.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// The face is split into an 8x8 grid of cells with a 59 bin uniform LBP
+// histogram each, every cell padded to 64 bytes so the rows of the grid line
+// up with the vector loads
+const int lbpGridSize = 8;
+const int lbpUniformBins = 59;
+const int lbpCellStride = 64;
+const int faceDescriptorLength = lbpGridSize * lbpGridSize * lbpCellStride;
+
+// ##### Define the table of the uniform LBP bin of each 8-bit code
+// The 58 codes with at most two 0/1 transitions around the circle get a bin
+// each, every other code shares the last bin.
+struct LbpUniformTable {
+  LbpUniformTable() {
+    int bin = 0;
+    for (int code = 0; code < 256; code++) {
+      int rotated = ((code << 1) | (code >> 7)) & 0xFF;
+      bins[code] = (uchar)(__builtin_popcount(code ^ rotated) <= 2 ? bin++ : lbpUniformBins - 1);
+    }
+  }
+
+  uchar bins[256];
+};
+
+inline const uchar *lbpUniformTable() {
+  static const LbpUniformTable table;
+  return table.bins;
+}
+
+// ##### Define the function to compute the LBP descriptor of a greyscale face image
+// Each cell histogram is normalized and square rooted (the Hellinger kernel),
+// so the plain L2 distance between two descriptors behaves like the
+// chi-square distance between the histograms, and then stored as a byte.
+inline void computeFaceDescriptor(const cv::Mat &faceGrey, uchar *descriptor) {
+  const uchar *uniform = lbpUniformTable();
+  int counts[lbpGridSize * lbpGridSize][lbpUniformBins];
+  int cellPixels[lbpGridSize * lbpGridSize];
+  int width = faceGrey.cols - 2;
+  int height = faceGrey.rows - 2;
+
+  CV_Assert(faceGrey.type() == CV_8UC1 && width >= lbpGridSize && height >= lbpGridSize);
+  memset(counts, 0, sizeof(counts));
+  memset(cellPixels, 0, sizeof(cellPixels));
+
+  // Compare each pixel with its 8 neighbours, clockwise from the top left
+  for (int y = 1; y <= height; y++) {
+    const uchar *above = faceGrey.ptr(y - 1);
+    const uchar *row = faceGrey.ptr(y);
+    const uchar *below = faceGrey.ptr(y + 1);
+    int cellRow = (y - 1) * lbpGridSize / height * lbpGridSize;
+
+    for (int x = 1; x <= width; x++) {
+      uchar centre = row[x];
+      int code = (above[x - 1] >= centre) << 7 | (above[x] >= centre) << 6 | (above[x + 1] >= centre) << 5 | (row[x + 1] >= centre) << 4
+               | (below[x + 1] >= centre) << 3 | (below[x] >= centre) << 2 | (below[x - 1] >= centre) << 1 | (row[x - 1] >= centre);
+      int cell = cellRow + (x - 1) * lbpGridSize / width;
+      counts[cell][uniform[code]]++;
+      cellPixels[cell]++;
+    }
+  }
+
+  memset(descriptor, 0, faceDescriptorLength);
+  for (int cell = 0; cell < lbpGridSize * lbpGridSize; cell++) {
+    for (int bin = 0; bin < lbpUniformBins; bin++) {
+      descriptor[cell * lbpCellStride + bin] = (uchar)(255.0 * std::sqrt((double)counts[cell][bin] / cellPixels[cell]) + 0.5);
+    }
+  }
+}
+
+// ##### Define the function to get the squared L2 distance between two descriptors
+// The length is a multiple of 16 for the vector loops.
+inline uint32_t descriptorDistance(const uchar *a, const uchar *b, int length) {
+  uint32_t distance = 0;
+  int i = 0;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+  uint32x4_t sums = vdupq_n_u32(0);
+  for (; i + 16 <= length; i += 16) {
+    uint8x16_t difference = vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+    sums = vpadalq_u16(sums, vmull_u8(vget_low_u8(difference), vget_low_u8(difference)));
+    sums = vpadalq_u16(sums, vmull_u8(vget_high_u8(difference), vget_high_u8(difference)));
+  }
+  distance = vgetq_lane_u32(sums, 0) + vgetq_lane_u32(sums, 1) + vgetq_lane_u32(sums, 2) + vgetq_lane_u32(sums, 3);
+#elif defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  __m128i sums = _mm_setzero_si128();
+  uint32_t lanes[4];
+
+  for (; i + 16 <= length; i += 16) {
+    __m128i aBytes = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i bBytes = _mm_loadu_si128((const __m128i *)(b + i));
+    __m128i difference = _mm_or_si128(_mm_subs_epu8(aBytes, bBytes), _mm_subs_epu8(bBytes, aBytes));
+    __m128i low = _mm_unpacklo_epi8(difference, zero);
+    __m128i high = _mm_unpackhi_epi8(difference, zero);
+    sums = _mm_add_epi32(sums, _mm_add_epi32(_mm_madd_epi16(low, low), _mm_madd_epi16(high, high)));
+  }
+  _mm_storeu_si128((__m128i *)lanes, sums);
+  distance = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+
+  // Scalar fallback, also handles the bytes left over by the vector loops
+  for (; i < length; i++) {
+    int difference = a[i] - b[i];
+    distance += (uint32_t)(difference * difference);
+  }
+  return distance;
+}
+
+// ##### Define the face gallery (a nearest neighbour face recognizer over LBP descriptors)
+// Unlike the Fisherfaces model it works with a single label, update() adds
+// faces without retraining, and a prediction is one pass over the contiguous
+// descriptors, a grid row at a time so a gallery entry is abandoned as soon as
+// it is further away than the best so far. The confidence is the distance,
+// lower is closer, between 0 and about 11.
+class FaceGallery : public cv::FaceRecognizer {
+public:
+  // Replace the gallery with the given greyscale face images
+  void train(cv::InputArrayOfArrays src, cv::InputArray labels) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      descriptors.clear();
+      descriptorLabels.clear();
+    }
+    update(src, labels);
+  }
+
+  // Add the given greyscale face images to the gallery
+  void update(cv::InputArrayOfArrays src, cv::InputArray labels) {
+    std::vector<cv::Mat> faceImages;
+    std::vector<uchar> added;
+    cv::Mat labelsMat = labels.getMat();
+
+    src.getMatVector(faceImages);
+    CV_Assert(labelsMat.total() == faceImages.size() && labelsMat.type() == CV_32SC1);
+
+    // Compute the descriptors outside the lock so predictions carry on meanwhile
+    added.resize(faceImages.size() * faceDescriptorLength);
+    for (size_t i = 0; i < faceImages.size(); i++) {
+      computeFaceDescriptor(faceImages[i], &added[i * faceDescriptorLength]);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    descriptors.insert(descriptors.end(), added.begin(), added.end());
+    descriptorLabels.insert(descriptorLabels.end(), labelsMat.ptr<int>(), labelsMat.ptr<int>() + faceImages.size());
+  }
+
+  int predict(cv::InputArray src) const {
+    int label;
+    double confidence;
+    predict(src, label, confidence);
+    return label;
+  }
+
+  // Find the closest face in the gallery, the label is -1 if the gallery is empty
+  void predict(cv::InputArray src, int &label, double &confidence) const {
+    uchar descriptor[faceDescriptorLength];
+    const int rowLength = lbpGridSize * lbpCellStride;
+    uint32_t bestDistance = UINT32_MAX;
+
+    computeFaceDescriptor(src.getMat(), descriptor);
+    label = -1;
+    confidence = DBL_MAX;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t i = 0; i < descriptorLabels.size(); i++) {
+      const uchar *entry = &descriptors[i * faceDescriptorLength];
+      uint32_t distance = 0;
+      for (int offset = 0; offset < faceDescriptorLength && distance < bestDistance; offset += rowLength) {
+        distance += descriptorDistance(descriptor + offset, entry + offset, rowLength);
+      }
+      if (distance < bestDistance) {
+        bestDistance = distance;
+        label = descriptorLabels[i];
+      }
+    }
+    if (label != -1) {
+      confidence = std::sqrt((double)bestDistance) / 255.0;
+    }
+  }
+
+  // The FileStorage form is for cv::FaceRecognizer compatibility, saveFile() is much faster to load
+  void save(cv::FileStorage &fs) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    fs << "labels" << descriptorLabels;
+    fs << "descriptors" << cv::Mat((int)descriptorLabels.size(), faceDescriptorLength, CV_8UC1, (void *)(descriptors.empty() ? NULL : &descriptors[0]));
+  }
+
+  void load(const cv::FileStorage &fs) {
+    std::vector<int> loadedLabels;
+    cv::Mat loadedDescriptors;
+
+    fs["labels"] >> loadedLabels;
+    fs["descriptors"] >> loadedDescriptors;
+    CV_Assert(loadedDescriptors.empty() || (loadedDescriptors.rows == (int)loadedLabels.size() && loadedDescriptors.cols == faceDescriptorLength && loadedDescriptors.isContinuous()));
+
+    std::lock_guard<std::mutex> lock(mutex);
+    descriptorLabels = loadedLabels;
+    descriptors.assign(loadedDescriptors.data, loadedDescriptors.data + loadedDescriptors.total());
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return descriptorLabels.size();
+  }
+
+  // ##### Define the function to save the gallery, its label names and the training image hash to a binary file
+  bool saveFile(const std::string &galleryFilePath, const std::vector<std::string> &labelNames, uint64_t manifestHash) const {
+    // Write to a temporary file and rename it so a crash never leaves a half written gallery
+    std::string temporaryFilePath = galleryFilePath + ".tmp";
+    FILE *galleryFile = fopen(temporaryFilePath.c_str(), "wb");
+    bool written;
+
+    if (galleryFile == NULL) {
+      return false;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      FileHeader header = {{'F', 'G', 'A', 'L'}, fileVersion, (uint32_t)faceDescriptorLength, (uint32_t)labelNames.size(), (uint64_t)descriptorLabels.size(), manifestHash};
+      written = fwrite(&header, sizeof(header), 1, galleryFile) == 1;
+      for (size_t i = 0; i < labelNames.size() && written; i++) {
+        uint32_t nameLength = (uint32_t)labelNames[i].size();
+        written = fwrite(&nameLength, sizeof(nameLength), 1, galleryFile) == 1 && fwrite(labelNames[i].data(), 1, nameLength, galleryFile) == nameLength;
+      }
+      if (written && !descriptorLabels.empty()) {
+        written = fwrite(&descriptorLabels[0], sizeof(int), descriptorLabels.size(), galleryFile) == descriptorLabels.size()
+               && fwrite(&descriptors[0], 1, descriptors.size(), galleryFile) == descriptors.size();
+      }
+    }
+    written = fclose(galleryFile) == 0 && written;
+
+    if (!written) {
+      remove(temporaryFilePath.c_str());
+      return false;
+    }
+    return rename(temporaryFilePath.c_str(), galleryFilePath.c_str()) == 0;
+  }
+
+  // ##### Define the function to load the gallery if it was saved for the same training images
+  // The labels and descriptors are read straight into place, there is nothing to parse.
+  bool loadFile(const std::string &galleryFilePath, std::vector<std::string> &labelNames, uint64_t manifestHash) {
+    FILE *galleryFile = fopen(galleryFilePath.c_str(), "rb");
+    FileHeader header;
+    std::vector<std::string> loadedNames;
+    std::vector<int> loadedLabels;
+    std::vector<uchar> loadedDescriptors;
+    bool loaded;
+
+    if (galleryFile == NULL) {
+      return false;
+    }
+    loaded = fread(&header, sizeof(header), 1, galleryFile) == 1 && memcmp(header.magic, "FGAL", 4) == 0
+          && header.version == fileVersion && header.descriptorLength == (uint32_t)faceDescriptorLength && header.manifestHash == manifestHash;
+    for (uint32_t i = 0; i < header.labelCount && loaded; i++) {
+      uint32_t nameLength = 0;
+      loaded = fread(&nameLength, sizeof(nameLength), 1, galleryFile) == 1 && nameLength < 4096;
+      if (loaded) {
+        std::string name(nameLength, '\0');
+        loaded = nameLength == 0 || fread(&name[0], 1, nameLength, galleryFile) == nameLength;
+        loadedNames.push_back(name);
+      }
+    }
+    if (loaded && header.entryCount > 0) {
+      loadedLabels.resize((size_t)header.entryCount);
+      loadedDescriptors.resize((size_t)header.entryCount * faceDescriptorLength);
+      loaded = fread(&loadedLabels[0], sizeof(int), loadedLabels.size(), galleryFile) == loadedLabels.size()
+            && fread(&loadedDescriptors[0], 1, loadedDescriptors.size(), galleryFile) == loadedDescriptors.size();
+    }
+    fclose(galleryFile);
+    if (!loaded) {
+      return false;
+    }
+
+    labelNames.swap(loadedNames);
+    std::lock_guard<std::mutex> lock(mutex);
+    descriptorLabels.swap(loadedLabels);
+    descriptors.swap(loadedDescriptors);
+    return true;
+  }
+
+private:
+  static const uint32_t fileVersion = 1;
+
+  struct FileHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t descriptorLength;
+    uint32_t labelCount;
+    uint64_t entryCount;
+    uint64_t manifestHash;
+  };
+
+  mutable std::mutex mutex;
+  std::vector<uchar> descriptors;   // faceDescriptorLength bytes per entry, one after another
+  std::vector<int> descriptorLabels;
+};
+
+// ##### Define the function to get the face gallery behind a face recognizer, NULL if it is another kind
+inline FaceGallery *faceGallery(cv::Ptr<cv::FaceRecognizer> &faceRecognizerModel) {
+  return faceRecognizerModel.empty() ? NULL : dynamic_cast<FaceGallery *>(&*faceRecognizerModel);
+}
+
+#endif
@@ -0,0 +1,92 @@
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <time.h>
+#include "face-dataset.hpp"
+#include "training-images.hpp"
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+// Converts between the training image directory and the packed face dataset:
+//   face-recognition-dataset import <images directory> <dataset file>
+//   face-recognition-dataset export <dataset file> <images directory>
+//   face-recognition-dataset list <dataset file>
+// Imported images are appended, so several directories can be merged into one dataset.
+int main(int argc, char **argv) {
+  string command = argc >= 2 ? argv[1] : "";
+  vector<cv::Mat> faceImages;
+  vector<int> faceLabels;
+  vector<string> faceLabelNames;
+  FaceDataset faceDataset(1000);
+
+  if (command == "import" && argc == 4) {
+    string imagesPath = string(argv[2]) + (string(argv[2]).back() == '/' ? "" : "/");
+    if (!loadFaceRecognizerTrainingImages(imagesPath, faceImages, faceLabels, faceLabelNames) || !faceDataset.open(argv[3], true)) {
+      return -1;
+    }
+
+    // The file names only hold the capture time to the second, so the images are stamped with the import time
+    time_t importTimestamp = time(NULL);
+    for (size_t i = 0; i < faceImages.size(); i++) {
+      if (!faceDataset.append(faceLabelNames[faceLabels[i] - 1], faceImages[i], (int64_t)importTimestamp)) {
+        return -1;
+      }
+    }
+    if (!faceDataset.sync()) {
+      return -1;
+    }
+    cout << "Imported face images..." << faceImages.size() << " into " << argv[3] << endl;
+  }
+  else if (command == "export" && argc == 4) {
+    string imagesPath = string(argv[3]) + (string(argv[3]).back() == '/' ? "" : "/");
+    char timestampFormatted[20];
+    char sequence[16];
+    time_t timestamp;
+
+    if (!faceDataset.open(argv[2], false)) {
+      return -1;
+    }
+
+    // Name the images <label>_<timestamp>_<number>.jpg, the number keeps captures in the same second apart
+    faceDataset.images(faceImages, faceLabels);
+    for (size_t i = 0; i < faceImages.size(); i++) {
+      timestamp = (time_t)faceDataset.timestamp(i);
+      strftime(timestampFormatted, sizeof(timestampFormatted), "%d%m%Y%H%M%S", localtime(&timestamp));
+      snprintf(sequence, sizeof(sequence), "%06zu", i);
+      if (!cv::imwrite(imagesPath + faceDataset.labelNames()[faceLabels[i] - 1] + "_" + timestampFormatted + "_" + sequence + ".jpg", faceImages[i])) {
+        cerr << "Error writing face image!..." << imagesPath << endl;
+        return -1;
+      }
+    }
+    cout << "Exported face images..." << faceImages.size() << " to " << imagesPath << endl;
+  }
+  else if (command == "list" && argc == 3) {
+    if (!faceDataset.open(argv[2], false)) {
+      return -1;
+    }
+
+    // Count the images of each label
+    vector<size_t> labelCounts(faceDataset.labelNames().size(), 0);
+    for (size_t i = 0; i < faceDataset.size(); i++) {
+      labelCounts[faceDataset.label(i) - 1]++;
+    }
+    for (size_t i = 0; i < labelCounts.size(); i++) {
+      cout << i + 1 << " " << faceDataset.labelNames()[i] << " " << labelCounts[i] << endl;
+    }
+    cout << "Face images..." << faceDataset.size() << endl;
+  }
+  else {
+    cerr << "Usage: face-recognition-dataset import <images directory> <dataset file>" << endl
+         << "       face-recognition-dataset export <dataset file> <images directory>" << endl
+         << "       face-recognition-dataset list <dataset file>" << endl;
+    return -1;
+  }
+
+  return 0;
+}
@@ -1,4 +1,3 @@
-#include <raspicam/raspicam_cv.h>
 #include <opencv2/core/core.hpp>
 #include <opencv2/contrib/contrib.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -7,201 +6,252 @@
 #include <iostream>
 #include <fstream>
 #include <future>
+#include <thread>
 #include <time.h>
 #include <dirent.h>
 #include <iomanip>
-#include <wiringPi.h>
+#include "allocation-counter.hpp"
+#include "command-line-options.hpp"
+#include "control-server.hpp"
+#include "detector-pool.hpp"
+#include "distance-sampler.hpp"
+#include "face-dataset.hpp"
+#include "face-gallery.hpp"
+#include "face-tracker.hpp"
+#include "frame-pool.hpp"
+#include "frame-preprocess.hpp"
+#include "frame-source.hpp"
+#include "load-governor.hpp"
+#include "mjpeg-server.hpp"
+#include "motion-gate.hpp"
+#include "overlay-renderer.hpp"
+#include "pipeline-benchmark.hpp"
+#include "pipeline-stats.hpp"
+#include "recognition-worker.hpp"
+#include "recognizer-model-cache.hpp"
+#include "snapshot-writer.hpp"
+#include "stream-pipeline.hpp"
+#include "training-images.hpp"
 
 using namespace std;
 
-// ##### Define the function to return the ultrasonic sensor distance
-double getDistance(int triggerGpioPin, int echoGpioPin) {
-  // Initialise the objects
-  long startTime, endTime, travelTime;
-  double speedOfSound = 340.29;	// Metres Per Second at sea level
-  double distance = 0.0;
-
-  // Initialise the Trigger pin to LOW and pause for 0.5 seconds
-  digitalWrite(triggerGpioPin, LOW);
-  delay(500);
-
-  // Triggering the sensor for 10 microseconds
-  // Will send out 8 ultrasonic (40kHz) bursts and listen for echos
-  digitalWrite(triggerGpioPin, HIGH);
-  delayMicroseconds(10);
-  digitalWrite(triggerGpioPin, LOW);
-
-  // Waiting for echo start
-  while (digitalRead(echoGpioPin) == LOW);
-  startTime = micros();
-
-  // Waiting for echo end
-  while (digitalRead(echoGpioPin) == HIGH);
-  endTime = micros();
-
-  // Calculate travel time
-  travelTime = endTime - startTime;
-
-  // Calculate distance
-  distance = ((travelTime / 1000000.0) * speedOfSound) / 2;
-
-  // Return distance in centimetres
-  return distance * 100;
-}
-
-// ##### Define the function to load the face detection cascade files
-bool loadCascadeFiles(string openCVCascadePath, cv::CascadeClassifier &faceCascade, cv::CascadeClassifier &eyeCascade, cv::CascadeClassifier &noseCascade) {
-  // Set the path to the cascade files
-  string faceCascadeFile = openCVCascadePath + "haarcascade_frontalface_default.xml";
-  string eyeCascadeFile = openCVCascadePath + "haarcascade_eye.xml";
-  string noseCascadeFile = openCVCascadePath + "haarcascade_mcs_nose.xml";
-
-  // Load face cascade
-  cout << "Loading face cascade..." << endl;
-  if (!faceCascade.load(faceCascadeFile)) {
-    cerr << "Error loading face cascade!" << endl;
-    return false;
+// ##### Define the overlay text fields, each one is rendered once and redrawn only when its text changes
+enum OverlayField {
+  overlayFieldName,
+  overlayFieldConfidence,
+  overlayFieldDate,
+  overlayFieldTime,
+  overlayFieldRecognitionMode,
+  overlayFieldTrainingMode,
+  overlayFieldFramesPerSecond,
+  overlayFieldDateTimestamp,
+  overlayFieldDistance,
+  overlayFieldTracks          // One field per track drawn, must be last
+};
+
+// ##### Define the function to load the saved face gallery, or load the training images and build it if they have changed
+// The gallery is created even without training images so faces can be added to it in training mode
+bool loadFaceGallery(const TrainingSet &trainingSet, FaceDataset &faceDataset, const string &openCVFaceGalleryFilePath, bool forceRetrain, cv::Ptr<cv::FaceRecognizer> &faceRecognizerModel, vector<string> &faceRecognizerLabelNames) {
+  vector<cv::Mat> faceRecognizerImages;
+  vector<int> faceRecognizerLabels;
+  uint64_t faceRecognizerNamesHash = trainingSetHash(trainingSet, false, faceDataset);
+  FaceGallery *gallery = new FaceGallery();
+
+  // Load the saved face gallery if the training images are the same as when it was saved
+  faceRecognizerModel = cv::Ptr<cv::FaceRecognizer>(gallery);
+  faceRecognizerLabelNames.clear();
+  if (!forceRetrain && gallery->loadFile(openCVFaceGalleryFilePath, faceRecognizerLabelNames, faceRecognizerNamesHash)) {
+    cout << "Loaded saved face gallery..." << gallery->size() << " faces, " << faceRecognizerLabelNames.size() << " labels" << endl;
+    return true;
   }
 
-  // Load eye cascade
-  cout << "Loading eye cascade..." << endl;
-  if (!eyeCascade.load(eyeCascadeFile)) {
-    cerr << "Error loading eye cascade!" << endl;
+  // Load in the face recognizer training images
+  if (!loadTrainingSet(trainingSet, faceDataset, faceRecognizerImages, faceRecognizerLabels, faceRecognizerLabelNames)) {
     return false;
   }
 
-  // Load nose cascade
-  cout << "Loading nose cascade..." << endl;
-  if (!noseCascade.load(noseCascadeFile)) {
-    cerr << "Error loading nose cascade!" << endl;
-    return false;
+  // Add every training image to the gallery and save it for the next start
+  cout << "Building face gallery..." << endl;
+  if (!faceRecognizerImages.empty()) {
+    gallery->train(faceRecognizerImages, faceRecognizerLabels);
+  }
+  if (!gallery->saveFile(openCVFaceGalleryFilePath, faceRecognizerLabelNames, faceRecognizerNamesHash)) {
+    cerr << "Error saving face gallery!" << endl;
   }
 
   return true;
 }
 
-// ##### Define the function to load the face recognizer training images
-bool loadFaceRecognizerTrainingImages(string openCVFaceRecognizerImagesPath, vector<cv::Mat> &faceRecognizerImages, vector<int> &faceRecognizerLabels, vector<string> &faceRecognizerLabelNames) {
-  // Initialise variables for loading of training face image files
-  DIR* dir;
-  dirent* pdir;
-  vector<string> faceImageFilenames;
-  string faceImageFilename;
-  string faceRecognizerLabelName;
-  cv::Mat faceRecognizerImageLoad;
-  size_t underscorePosition;
-  vector<string>::iterator findIterator;
-  int index;
-
-  // Read in the face recognizer image filenames
-  dir = opendir(openCVFaceRecognizerImagesPath.c_str());
-  while ((pdir = readdir(dir))) {
-    faceImageFilename = pdir->d_name;
-
-    if (faceImageFilename.size() > 4) {
-      if (faceImageFilename.substr(faceImageFilename.size() - 4, 4) == ".jpg") {
-        faceImageFilenames.push_back(pdir->d_name);
-      }
-    }
+// ##### Define the function to save the face gallery with the names of the training images it now holds
+bool saveFaceGallery(cv::Ptr<cv::FaceRecognizer> &faceRecognizerModel, const TrainingSet &trainingSet, FaceDataset &faceDataset, const string &openCVFaceGalleryFilePath, const vector<string> &faceRecognizerLabelNames) {
+  FaceGallery *gallery = faceGallery(faceRecognizerModel);
+  if (gallery == NULL || !gallery->saveFile(openCVFaceGalleryFilePath, faceRecognizerLabelNames, trainingSetHash(trainingSet, false, faceDataset))) {
+    cerr << "Error saving face gallery!" << endl;
+    return false;
   }
+  cout << "Saved face gallery..." << gallery->size() << " faces" << endl;
+  return true;
+}
 
-  // Read in the face recognizer images
-  for (size_t i = 0; i < faceImageFilenames.size(); i++) {
-    faceImageFilename = faceImageFilenames[i];
-    cout << "Loading face recognizer images and labels..." << faceImageFilename << endl;
-
-    // Load the face image and add to array
-    faceRecognizerImageLoad = cv::imread(openCVFaceRecognizerImagesPath + faceImageFilename, CV_LOAD_IMAGE_GRAYSCALE);
-    cv::resize(faceRecognizerImageLoad, faceRecognizerImageLoad, cv::Size(100, 100));
-    faceRecognizerImages.push_back(faceRecognizerImageLoad);
+// ##### Define the function to load the saved face recognizer, or load the training images and train it if they have changed
+// The face dataset, if any, is opened read only unless it is open already, and is used for both the hash and the images.
+bool loadFaceRecognizer(const TrainingSet &trainingSet, FaceDataset &faceDataset, const string &openCVFaceRecognizerModelFilePath, bool useFaceGallery, bool forceRetrain, cv::Ptr<cv::FaceRecognizer> &faceRecognizerModel, vector<string> &faceRecognizerLabelNames) {
+  vector<cv::Mat> faceRecognizerImages;
+  vector<int> faceRecognizerLabels;
+  uint64_t faceRecognizerManifestHash;
 
-    // Find the position of the underscore in the filename and retrieve the label name
-    underscorePosition = faceImageFilename.find_first_of("_");
-    faceRecognizerLabelName = faceImageFilename.substr(0, underscorePosition);
+  // The LBP face gallery keeps its own file
+  if (useFaceGallery) {
+    return loadFaceGallery(trainingSet, faceDataset, openCVFaceRecognizerModelFilePath, forceRetrain, faceRecognizerModel, faceRecognizerLabelNames);
+  }
 
-    // Check if the label name exists in the label names array
-    findIterator = find(faceRecognizerLabelNames.begin(), faceRecognizerLabelNames.end(), faceRecognizerLabelName);
-    if (findIterator == faceRecognizerLabelNames.end()) {
-      faceRecognizerLabelNames.push_back(faceRecognizerLabelName);
-      faceRecognizerLabels.push_back(faceRecognizerLabelNames.size());
-    }
-    else {
-      index = distance(faceRecognizerLabelNames.begin(), findIterator);
-      faceRecognizerLabels.push_back(index + 1);
-    }
+  // Load the saved face recognizer if the training images are the same as when it was trained
+  faceRecognizerManifestHash = trainingSetHash(trainingSet, true, faceDataset);
+  faceRecognizerLabelNames.clear();
+  if (!forceRetrain && loadFaceRecognizerModel(openCVFaceRecognizerModelFilePath, faceRecognizerModel, faceRecognizerLabelNames, faceRecognizerManifestHash)) {
+    cout << "Loaded saved face recognizer..." << faceRecognizerLabelNames.size() << " labels" << endl;
+    return true;
   }
 
-  // Output the face recognizer labels and label names
-  for (size_t i = 0; i < faceRecognizerLabels.size(); i++) {
-    cout << "Face Recognizer Label..." << faceRecognizerLabels[i] << endl;
+  // Load in the face recognizer training images
+  if (!loadTrainingSet(trainingSet, faceDataset, faceRecognizerImages, faceRecognizerLabels, faceRecognizerLabelNames)) {
+    return false;
   }
-  for (size_t i = 0; i < faceRecognizerLabelNames.size(); i++) {
-    cout << "Face Recognizer Label Name..." << faceRecognizerLabelNames[i] << endl;
+
+  // Create a face recognizer, train it on the given images and save it for the next start
+  if (faceRecognizerLabelNames.size() >= 2) {
+    cout << "Training face recognizer..." << endl;
+    try {
+      faceRecognizerModel = cv::createFisherFaceRecognizer();
+      faceRecognizerModel->train(faceRecognizerImages, faceRecognizerLabels);
+    }
+    catch (cv::Exception ex) {
+      cerr << "Error training face recognizer!..." << ex.msg << endl;
+      return false;
+    }
+    if (!saveFaceRecognizerModel(openCVFaceRecognizerModelFilePath, faceRecognizerModel, faceRecognizerLabelNames, faceRecognizerManifestHash)) {
+      cerr << "Error saving face recognizer!" << endl;
+    }
   }
 
   return true;
 }
 
-// ##### Define the method to perform the face detection
-void detectFaces(vector<cv::Mat> &faceROIImages, cv::Mat frame, cv::CascadeClassifier faceCascade, cv::CascadeClassifier eyeCascade, cv::CascadeClassifier noseCascade, bool trainingMode) {
-  // Intialise the function objects
-  cv::Mat frameGrey;
-  cv::Mat faceROI;
-  cv::Mat faceROIGrey;
-  vector<cv::Rect> faces;
-  vector<cv::Rect> eyes;
-  vector<cv::Rect> nose;
-  int lineThickness = 1;
-  int lineType = CV_AA;   // 8, 4 or CV_AA
-
-  // Convert frame to grayscale, normalize the brightness, and increase the contrast
-  cv::cvtColor(frame, frameGrey, cv::COLOR_BGR2GRAY);
-  cv::equalizeHist(frameGrey, frameGrey);
-
-  // Detect any faces
-  faceCascade.detectMultiScale(frameGrey, faces, 1.1, 5, CV_HAAR_SCALE_IMAGE, cv::Size(10, 10), cv::Size(400, 400));
-
-  // Loop through each face
-  for (size_t i = 0; i < faces.size(); i++) {
-    // Get the face region of interest
-    faceROI = frame(faces[i]);
-    faceROIGrey = frameGrey(faces[i]);
+// ##### Define the function to write the statistics file
+// The statistics are written to a temporary file which then replaces the old
+// one, so a reader never sees a half written file.
+bool writeStatsFile(const string &statsFilePath, const string &statsText) {
+  string temporaryFilePath = statsFilePath + ".tmp";
+  ofstream statsFile(temporaryFilePath.c_str(), ios::trunc);
+  if (!statsFile) {
+    return false;
+  }
+  statsFile << statsText;
+  statsFile.close();
+  return statsFile && rename(temporaryFilePath.c_str(), statsFilePath.c_str()) == 0;
+}
 
-    // Draw a rectangle around the face
-    //cv::Point topLeft(faces[i].x, faces[i].y);
-    //cv::Point bottomRight(faces[i].x + faces[i].width, faces[i].y + faces[i].height);
-    //cv::rectangle(faceROI, topLeft, bottomRight , cv::Scalar(255, 255, 255), lineThickness, lineType, 0);
+// ##### Define the face recognizer reload (the result of loading or retraining on a background thread)
+struct FaceRecognizerReload {
+  bool loaded;
+  cv::Ptr<cv::FaceRecognizer> faceRecognizerModel;
+  vector<string> faceRecognizerLabelNames;
+};
+
+// ##### Define the function to run the configured streams until stopped
+// Every stream captures, tracks and draws on its own thread while this thread
+// handles the control commands and gathers the statistics of all of them.
+int runStreamPipelines(const vector<StreamConfig> &streamConfigs, DetectorPool &detectorPool, const DetectionParameters &detectionParameters, PipelineStats &pipelineStats,
+                       ControlServer &controlServer, const TrainingSet &trainingSet, const string &openCVFaceRecognizerModelFilePath, bool useFaceGallery,
+                       cv::Ptr<cv::FaceRecognizer> faceRecognizerModel, vector<string> faceRecognizerLabelNames, size_t faceRecognizerMinimumLabels,
+                       double statsInterval, const string &statsFilePath) {
+  vector<unique_ptr<StreamPipeline>> streamPipelines;
+  ControlCommand controlCommand;
+  bool stopRequested = false;
+  bool faceRecognizerReloading = false;
+  future<FaceRecognizerReload> faceRecognizerReload;
+  chrono::steady_clock::time_point now, statsStartTime, latencyStartTime;
+  string statsText, latencyText;
+  int streamResult = 0;
+
+  // Start the streams, each one on its own share of the detector pool
+  for (size_t i = 0; i < streamConfigs.size(); i++) {
+    streamPipelines.push_back(unique_ptr<StreamPipeline>(new StreamPipeline(i, streamConfigs[i], detectorPool, detectionParameters, pipelineStats)));
+    if (!streamPipelines.back()->start(faceRecognizerModel, faceRecognizerLabelNames, faceRecognizerMinimumLabels)) {
+      return -1;
+    }
+  }
 
-    // Detect eyes
-    eyeCascade.detectMultiScale(faceROIGrey, eyes, 1.1, 5, CV_HAAR_SCALE_IMAGE, cv::Size(10, 10), cv::Size(50, 50));
+  statsStartTime = latencyStartTime = chrono::steady_clock::now();
+  while (!stopRequested && !stopSignalReceived()) {
+    this_thread::sleep_for(chrono::milliseconds(50));
+    if (detectorPool.failed()) {
+      cerr << "Error in detector threads, stopping!" << endl;
+      streamResult = -1;
+      break;
+    }
 
-    // Draw an ellipse around each eye
-    if (eyes.size() == 2 && !trainingMode) {
-      for (size_t j = 0; j < 2; j++) {
-        cv::Point center(eyes[j].x + eyes[j].width * 0.5, eyes[j].y + eyes[j].height * 0.5);
-        cv::ellipse(faceROI, center, cv::Size(eyes[j].width * 0.5, eyes[j].height * 0.5), 0, 0, 360, cv::Scalar(255, 0, 0), lineThickness, lineType, 0);
+    // Handle the control commands, recognition and training are per frame settings of the single stream loop
+    while (controlServer.takeCommand(controlCommand)) {
+      cout << "Control command..." << controlCommand.name << " " << controlCommand.argument << endl;
+      if (controlCommand.name == "stop") {
+        stopRequested = true;
+      }
+      else if (controlCommand.name == "reload" && !faceRecognizerReloading) {
+        faceRecognizerReloading = true;
+        faceRecognizerReload = async(launch::async, [=]() {
+          FaceRecognizerReload reload;
+          FaceDataset reloadDataset;
+          reload.loaded = loadFaceRecognizer(trainingSet, reloadDataset, openCVFaceRecognizerModelFilePath, useFaceGallery, false, reload.faceRecognizerModel, reload.faceRecognizerLabelNames);
+          return reload;
+        });
+      }
+      else if (controlCommand.name != "reload") {
+        cout << "Not available in multi-stream mode..." << controlCommand.name << endl;
       }
     }
 
-    // Detect nose
-    noseCascade.detectMultiScale(faceROIGrey, nose, 1.1, 5, CV_HAAR_SCALE_IMAGE, cv::Size(10, 10), cv::Size(200, 200));
-
-    // Draw a rectangle around the nose
-    if (nose.size() == 1 && !trainingMode) {
-      //cv::Point center(nose[0].x + nose[0].width * 0.5, nose[0].y + nose[0].height * 0.5);
-      //cv::ellipse(faceROI, center, cv::Size(nose[0].width * 0.5, nose[0].height * 0.5), 0, 0, 360, cv::Scalar(255, 150, 0), lineThickness, lineType, 0);
-      cv::Point topLeft(nose[0].x, nose[0].y);
-      cv::Point bottomRight(nose[0].x + nose[0].width, nose[0].y + nose[0].height);
-      cv::rectangle(faceROI, topLeft, bottomRight , cv::Scalar(255, 150, 0), lineThickness, lineType, 0);
+    // Hand the reloaded face recognizer to every stream once it is ready
+    if (faceRecognizerReloading && faceRecognizerReload.wait_for(chrono::seconds(0)) == future_status::ready) {
+      FaceRecognizerReload reload = faceRecognizerReload.get();
+      faceRecognizerReloading = false;
+      if (reload.loaded) {
+        faceRecognizerModel = reload.faceRecognizerModel;
+        faceRecognizerLabelNames = reload.faceRecognizerLabelNames;
+        for (size_t i = 0; i < streamPipelines.size(); i++) {
+          streamPipelines[i]->setModel(faceRecognizerModel, faceRecognizerLabelNames);
+        }
+        cout << "Face recognizer reloaded..." << faceRecognizerLabelNames.size() << " labels" << endl;
+      }
     }
 
-    // Add to the face ROI images array
-    if (eyes.size() == 2 && nose.size() == 1) {
-      faceROIImages.push_back(faceROI);
+    // Update the statistics of all the streams once a second, the latency percentiles cover every stream
+    now = chrono::steady_clock::now();
+    if (now - statsStartTime >= chrono::seconds(1)) {
+      statsStartTime = now;
+      if (now - latencyStartTime >= chrono::duration<double>(statsInterval)) {
+        latencyStartTime = now;
+        latencyText.clear();
+        pipelineStats.report(latencyText);
+      }
+      statsText = "streams " + to_string(streamPipelines.size()) + "\n"
+                  + "labels " + to_string(faceRecognizerLabelNames.size()) + "\n"
+                  + "detector_queue " + to_string(detectorPool.queueDepth()) + "\n";
+      for (size_t i = 0; i < streamPipelines.size(); i++) {
+        streamPipelines[i]->appendStats(statsText);
+      }
+      statsText += latencyText;
+      controlServer.setStats(statsText);
+      if (!statsFilePath.empty()) {
+        writeStatsFile(statsFilePath, statsText);
+      }
     }
   }
 
-  return;
+  for (size_t i = 0; i < streamPipelines.size(); i++) {
+    streamPipelines[i]->stop();
+  }
+  return streamResult;
 }
 
 int main(int argc, char **argv) {
@@ -209,8 +259,30 @@ int main(int argc, char **argv) {
   bool faceRecognitionMode = false;
   bool trainingMode = false;
   bool showPreview = false;   // Set to true to display video window (stop VNC desktop first)
-  bool ultrasonicSensor = false;
+  bool benchmarkMode = false;
   string trainingLabel;
+  CommandLineOptions options(argc, argv);
+  string ultrasonicSensor = options.get("ultrasonic", "off");   // off, gpio or sim
+
+  // Initialise the control objects, commands arrive on a Unix domain socket and SIGTERM stops cleanly
+  ControlServer controlServer;
+  ControlCommand controlCommand;
+  bool stopRequested = false;
+  bool detectorFailed = false;
+
+  // Initialise the statistics objects, every stage of the pipeline is timed and the latency percentiles are refreshed every interval
+  PipelineStats pipelineStats;
+  chrono::steady_clock::time_point frameStartTime, captureEndTime, stageStartTime, statsStartTime;
+  chrono::steady_clock::duration convertDuration, overlayDuration;
+  double statsInterval = options.getDouble("stats-interval", 10.0);
+  string statsFilePath = options.get("stats-file", "");
+  string statsText, latencyText;
+  size_t detectionsSkipped = 0;
+
+  // Initialise the output objects, frames are written to image.jpg or streamed over HTTP from the built in MJPEG server
+  bool mjpegOutput = options.get("output", "file") == "mjpeg";
+  MjpegServer mjpegServer(&pipelineStats);
+  SnapshotWriter snapshotWriter(&pipelineStats);
 
   // Initialise the font for display of text
   int font = cv::FONT_HERSHEY_DUPLEX;
@@ -220,37 +292,121 @@ int main(int argc, char **argv) {
   int fontLineThickness = 1;
   int fontLineType = CV_AA;   // 8, 4 or CV_AA
   string text;
+  char textBuffer[128];
   cv::Size textSize;
-  int textBaseline = 0;
   int textMargin = 10;
+  OverlayRenderer overlay(font, fontColour, fontLineThickness, fontLineType);
 
   // Initialise the OpenCV directory path
   string openCVPath = "/home/pi/projects/facerecognition/";
   string openCVCascadePath = openCVPath + "data/haarcascades/";
   string openCVFaceRecognizerImagesPath = openCVPath + "data/faceimages/";
-  string stopVideoCaptureFilePath = openCVPath + "stop-video-capture.txt";
+  string openCVFaceDatasetFilePath = openCVPath + "data/faces.dat";
+  string trainingStore = options.get("training-store", access(openCVFaceDatasetFilePath.c_str(), F_OK) == 0 ? "dataset" : "images");
+  TrainingSet trainingSet = { openCVFaceRecognizerImagesPath, trainingStore == "dataset" ? openCVFaceDatasetFilePath : "" };
+  bool useFaceGallery = options.get("recognizer", "fisher") == "lbp";
+  string openCVFaceRecognizerModelFilePath = openCVPath + (useFaceGallery ? "data/face-gallery.bin" : "data/facerecognizer-model.yml");
+  string controlSocketPath = openCVPath + "face-recognition.sock";
 
   // Initialise the camera objects
-  raspicam::RaspiCam_Cv camera;
+  unique_ptr<FrameSource> frameSource;
+  string frameSourceSpecification = options.get("source", "camera");
   int cameraWidth = 640;
   int cameraHeight = 480;
-  size_t frameCount = 0, startFrameCount = 0, framesPerSecond = 0;
-  time_t startTime, endTime;
+  size_t frameCount = 0, startFrameCount = 0;
+  double framesPerSecond = 0.0;
+  chrono::steady_clock::time_point fpsStartTime;
+  cv::Mat capturedFrame;
   cv::Mat frame;
   time_t dateTimestamp;
   char dateTimestampFormatted[20];
 
-  // Initialise the file cascade objects
-  cv::CascadeClassifier faceCascade, eyeCascade, noseCascade;
+  // Initialise the benchmark objects
+  PipelineBenchmark benchmark;
+  size_t benchmarkFrames = 0;
+  vector<uchar> benchmarkEncodedFrame;
+  size_t benchmarkAllocationCount = 0;
 
-  // Initialise the async future objects
-  bool futureFacesRunning = false;
-  future<void> futureFaces;
-  future_status futureStatus;
+  // Initialise the pre-processing objects, the greyscale frame is only built when face recognition is on
+  FramePreprocessor framePreprocessor;
+  cv::Mat frameGrey;
+
+  // Initialise the frame pools, display frames are shared with the output threads and equalized greyscale frames with the detector threads
+  FramePool displayFramePool(6, cameraHeight, cameraWidth, CV_8UC3);
+  size_t lastAllocationCount = 0, captureAllocations = 0;
+
+  // Initialise the stream objects, with a stream configuration file every stream runs its own pipeline sharing the detector pool
+  vector<StreamConfig> streamConfigs;
+  StreamConfig streamDefaults;
+  streamDefaults.source = frameSourceSpecification;
+  streamDefaults.output = options.get("output", "file");
+  streamDefaults.snapshotPath = openCVPath;
+  streamDefaults.port = options.getInt("mjpeg-port", 8080);
+  streamDefaults.jpegQuality = options.getInt("jpeg-quality", 80);
+  streamDefaults.snapshotFramesPerSecond = options.getDouble("snapshot-fps", 15.0);
+  streamDefaults.detectionInterval = options.getInt("detection-interval", 5);
+  streamDefaults.trackingDownscale = options.getInt("tracking-downscale", 2);
+  streamDefaults.recognitionMaximumAge = options.getDouble("recognition-max-age", 5.0);
+  streamDefaults.recognitionChangeThreshold = options.getInt("recognition-change-threshold", 8);
+  streamDefaults.motionGate = options.has("motion-gate");
+  streamDefaults.motionDownscale = options.getInt("motion-downscale", 8);
+  streamDefaults.motionThreshold = options.getInt("motion-threshold", 20);
+  streamDefaults.motionMinimumArea = options.getDouble("motion-min-area", 0.005);
+  streamDefaults.motionCoolDown = options.getDouble("motion-cooldown", 3.0);
+  streamDefaults.motionMargin = options.getInt("motion-margin", 48);
+  streamDefaults.frameBudget = options.getDouble("frame-budget", 0.0);
+  if (options.has("streams") && !loadStreamConfigs(options.get("streams", ""), streamDefaults, streamConfigs)) {
+    return -1;
+  }
+
+  // Initialise the detector pool objects, by default one detection thread per core less one for capture
+  size_t detectorThreads = (size_t)options.getInt("detector-threads", max((int)thread::hardware_concurrency() - 1, 1));
+  DetectorPool detectorPool(detectorThreads, &pipelineStats, max(streamConfigs.size(), (size_t)1));
+  FramePool greyFramePool(detectorThreads * 3 + 2, cameraHeight, cameraWidth, CV_8UC1);
+  DetectionJob detectionJob;
+  DetectionResult detectionResult;
+  size_t latestDetectionFrameNumber = 0;
+
+  // Initialise the face tracker, full detection runs every few frames or when a track is lost
+  FaceTracker faceTracker(options.getInt("detection-interval", 5), options.getInt("tracking-downscale", 2));
+  vector<FaceTrack>::const_iterator faceTrack;
+  cv::Rect faceTrackRect;
+
+  // Initialise the motion gate, while nothing is tracked detection only starts on motion and only searches the changed regions
+  unique_ptr<MotionGate> motionGate;
+  bool motionGateOpen = true;
+  bool detectionDue;
+  size_t detectionsGated = 0;
+  if (options.has("motion-gate")) {
+    motionGate.reset(new MotionGate(options.getInt("motion-downscale", 8), options.getInt("motion-threshold", 20), options.getDouble("motion-min-area", 0.005),
+                                    options.getDouble("motion-cooldown", 3.0), options.getInt("motion-margin", 48)));
+  }
+
+  // Initialise the detection parameters, from the detector profile if there is one and then the options, the eye and nose regions are fractions of the face size
+  DetectionParameters detectionParameters;
+  if (options.has("detector-profile") && !loadDetectionProfile(options.get("detector-profile", ""), detectionParameters)) {
+    return -1;
+  }
+  detectionParameters.faceDownscale = options.getDouble("face-downscale", detectionParameters.faceDownscale);
+  detectionParameters.eyeRegionTop = options.getDouble("eye-region-top", detectionParameters.eyeRegionTop);
+  detectionParameters.eyeRegionBottom = options.getDouble("eye-region-bottom", detectionParameters.eyeRegionBottom);
+  detectionParameters.noseRegionTop = options.getDouble("nose-region-top", detectionParameters.noseRegionTop);
+  detectionParameters.noseRegionBottom = options.getDouble("nose-region-bottom", detectionParameters.noseRegionBottom);
+  detectionParameters.noseRegionLeft = options.getDouble("nose-region-left", detectionParameters.noseRegionLeft);
+  detectionParameters.noseRegionRight = options.getDouble("nose-region-right", detectionParameters.noseRegionRight);
+  if (!checkDetectionRegions(detectionParameters)) {
+    return -1;
+  }
+
+  // Initialise the load governor, it scales the detection work to hold the frame time within the budget
+  unique_ptr<LoadGovernor> loadGovernor;
+  double frameBudget = options.getDouble("frame-budget", 0.0);
 
   // Initialise the face ROI objects
-  vector<cv::Mat> faceROIImages;
-  cv::Mat faceROIImage, faceROIImageGrey;
+  vector<RecognitionRequest> faceROIImages;
+  cv::Mat faceROIImage;
+  int faceROITrackId = 0;
+  bool faceROIPredicted = false;
   int faceROIImageWidth = 100;
   int faceROIImageHeight = 100;
   time_t faceROITimestamp;
@@ -261,144 +417,409 @@ int main(int argc, char **argv) {
 
   // Initialise the face recognizer objects
   string faceImageFilename;
-  vector<cv::Mat> faceRecognizerImages;
-  vector<int> faceRecognizerLabels;
   vector<string> faceRecognizerLabelNames;
   cv::Ptr<cv::FaceRecognizer> faceRecognizerModel;
+  bool faceRecognizerReloading = false;
+  future<FaceRecognizerReload> faceRecognizerReload;
   int faceRecognizerPredictionLabel = 0;
   string faceRecognizerPredictionLabelName;
   double faceRecognizerPredictionConfidence = 0.0;
-
-  // Initialise the training objects
+  size_t faceRecognizerMinimumLabels = useFaceGallery ? 1 : 2;   // Fisherfaces needs two labels to tell apart
+  int faceRecognizerLabel;
+  cv::Mat enrollFaceImage;
+  bool faceGalleryChanged = false;
+
+  // Initialise the recognition objects, predictions are cached per track and made in batches on a worker thread
+  RecognitionWorker recognitionWorker(&pipelineStats);
+  RecognitionCache recognitionCache(options.getDouble("recognition-max-age", 5.0), options.getInt("recognition-change-threshold", 8));
+  vector<RecognitionRequest> recognitionBatch;
+  vector<RecognitionResult> recognitionResults;
+  int trackPredictionLabel = 0;
+  double trackPredictionConfidence = 0.0;
+
+  // Initialise the training objects, with the dataset store the faces are appended to the face dataset and synced every training run
   int trainingFaceImageCounter = 0, maxTrainingFaceImages = 10;
+  FaceDataset faceDataset(maxTrainingFaceImages);
   time_t trainingFilenameTimestamp;
   char trainingFilenameTimestampFormatted[20];
 
-  // Initialise the Ultrasonic Sensor objects
+  // Initialise the Ultrasonic Sensor objects, the distance is measured on its own thread
   int triggerGpioPin = 23;
   int echoGpioPin  = 24;
+  unique_ptr<DistanceSampler> distanceSampler;
   double distanceToObject = 0.0;
 
   // Check the input arguments and set the face recognition mode
-  if (argc >= 2) {
-    if (string(argv[1]) == "TRUE") {
+  if (options.positional.size() >= 1) {
+    if (options.positional[0] == "TRUE") {
       faceRecognitionMode = true;
       cout << "Face Recognition Mode...ON" << endl;
     }
-    if (argv[2] != NULL) {
+    if (options.positional.size() >= 2) {
+      if (!isValidTrainingLabel(options.positional[1])) {
+        cerr << "Invalid training label, it cannot contain /, _, .. or whitespace!..." << options.positional[1] << endl;
+        return -1;
+      }
       trainingMode = true;
-      trainingLabel = string(argv[2]);
+      trainingLabel = options.positional[1];
       cout << "Training Mode...ON..." << trainingLabel << endl;
     }
   }
 
+  // Check the benchmark option, the benchmark replays a fixed clip as fast as possible and writes nothing to disk
+  if (options.has("benchmark")) {
+    benchmarkMode = true;
+    benchmarkFrames = (size_t)options.getInt("benchmark-frames", 300);
+    if (!options.has("source")) {
+      frameSourceSpecification = "synthetic";
+    }
+    showPreview = false;
+    ultrasonicSensor = "off";
+    if (trainingMode) {
+      cout << "Training Mode...OFF (not available in benchmark mode)" << endl;
+      trainingMode = false;
+    }
+    cout << "Benchmark Mode...ON..." << benchmarkFrames << " frames" << endl;
+  }
+
+  // Start the load governor, benchmarks run at fixed settings so that runs can be compared
+  if (frameBudget > 0.0 && !benchmarkMode) {
+    loadGovernor.reset(new LoadGovernor(frameBudget, options.getInt("detection-interval", 5), detectionParameters.faceDownscale));
+    cout << "Load governor...ON..." << frameBudget << "ms frame budget" << endl;
+  }
+
   // If preview mode then create a window to display the video
   if (showPreview) {
     cv::namedWindow("Video", 1);
   }
-  
-  // Load the face detection cascade files
-  loadCascadeFiles(openCVCascadePath, faceCascade, eyeCascade, noseCascade);
 
-  // Load in the face recognizer training images
-  loadFaceRecognizerTrainingImages(openCVFaceRecognizerImagesPath, faceRecognizerImages, faceRecognizerLabels, faceRecognizerLabelNames);
+  // Check the streams option, several streams replace the single capture loop and always detect faces
+  if (!streamConfigs.empty()) {
+    if (benchmarkMode || trainingMode) {
+      cerr << "Benchmark and training modes are not available with several streams!" << endl;
+      return -1;
+    }
+    faceRecognitionMode = true;
+    ultrasonicSensor = "off";
+    cout << "Multi-stream Mode...ON..." << streamConfigs.size() << " streams" << endl;
+  }
 
-  // Create a face recognizer and train it on the given images
-  if (faceRecognizerLabelNames.size() >= 2) {
-    cout << "Training face recognizer..." << endl;
-    try {
-      faceRecognizerModel = cv::createFisherFaceRecognizer();
-      faceRecognizerModel->train(faceRecognizerImages, faceRecognizerLabels);
+  // Start the MJPEG server
+  if (mjpegOutput && !benchmarkMode && streamConfigs.empty()) {
+    if (!mjpegServer.start(options.getInt("mjpeg-port", 8080), options.getInt("jpeg-quality", 80))) {
+      cerr << "Error starting MJPEG server!" << endl;
+      return -1;
     }
-    catch (cv::Exception ex) {
-      cerr << "Error training face recognizer!..." << ex.msg << endl;
+    cout << "MJPEG server listening...port " << options.getInt("mjpeg-port", 8080) << endl;
+  }
+
+  // Start the snapshot writer, image.jpg is encoded and replaced on its own thread
+  if (!mjpegOutput && !showPreview && !benchmarkMode && streamConfigs.empty()) {
+    snapshotWriter.start(openCVPath + "image.jpg", options.getDouble("snapshot-fps", 15.0), options.getInt("jpeg-quality", 80));
+  }
+  
+  // Start the control server
+  installStopSignalHandlers();
+  if (!controlServer.start(controlSocketPath)) {
+    cerr << "Error starting control server!..." << controlSocketPath << endl;
+  }
+
+  // Start the detector threads, each one builds its own face classifier from the cascade files parsed once for all of them
+  if (faceRecognitionMode) {
+    if (!detectorPool.start(openCVCascadePath)) {
+      cerr << "Error starting detector threads!" << endl;
       return -1;
     }
   }
 
-  // Setup the GPIO wiring pins for the Ultrasonic Sensor
-  if (ultrasonicSensor) {
-    cout << "Initialising GPIO pins..." << endl;
-    wiringPiSetupGpio();
-    pinMode(triggerGpioPin, OUTPUT);
-    pinMode(echoGpioPin, INPUT);
+  // Open the face dataset once, the face recognizer is loaded from it and training mode appends to it
+  if (trainingStore != "images" && trainingStore != "dataset") {
+    cerr << "Unknown training store..." << trainingStore << endl;
+    return -1;
+  }
+  if (!trainingSet.datasetFilePath.empty() && !faceDataset.open(trainingSet.datasetFilePath, true)) {
+    return -1;
+  }
+
+  // Load the saved face recognizer, or train it if the training images have changed
+  if (!loadFaceRecognizer(trainingSet, faceDataset, openCVFaceRecognizerModelFilePath, useFaceGallery, options.has("retrain"), faceRecognizerModel, faceRecognizerLabelNames)) {
+    return -1;
+  }
+  faceDataset.releaseImages();
+  // Run the streams, each with its own recognition worker, until stopped
+  if (!streamConfigs.empty()) {
+    int streamResult = runStreamPipelines(streamConfigs, detectorPool, detectionParameters, pipelineStats, controlServer, trainingSet,
+                                          openCVFaceRecognizerModelFilePath, useFaceGallery, faceRecognizerModel, faceRecognizerLabelNames, faceRecognizerMinimumLabels,
+                                          statsInterval, statsFilePath);
+    detectorPool.stop();
+    controlServer.stop();
+    return streamResult;
   }
 
-  // Set camera params
-  camera.set(CV_CAP_PROP_FRAME_WIDTH, cameraWidth);
-  camera.set(CV_CAP_PROP_FRAME_HEIGHT, cameraHeight);
-  camera.set(CV_CAP_PROP_FORMAT, CV_8UC3); // For color
-  //camera.set(CV_CAP_PROP_FPS, 10);
-  //camera.set(CV_CAP_PROP_BRIGHTNESS, 75); // 0 - 100
-  //camera.set(CV_CAP_PROP_CONTRAST, 60); // 0 - 100
+  // Start the recognition worker of the single capture loop
+  if (faceRecognizerLabelNames.size() >= faceRecognizerMinimumLabels) {
+    recognitionWorker.setModel(faceRecognizerModel);
+  }
+  recognitionWorker.start();
+
+  // Start the Ultrasonic Sensor sampler, the simulated GPIO stands in for the sensor without wiringPi hardware
+  if (ultrasonicSensor != "off") {
+    cout << "Initialising GPIO pins..." << ultrasonicSensor << endl;
+    unique_ptr<Gpio> gpio = createGpio(ultrasonicSensor, triggerGpioPin, echoGpioPin, options.getDouble("ultrasonic-sim-distance", 100.0));
+    if (!gpio) {
+      return -1;
+    }
+    distanceSampler.reset(new DistanceSampler(std::move(gpio), triggerGpioPin, echoGpioPin));
+    if (!distanceSampler->start(options.getInt("ultrasonic-interval", 200), 5)) {
+      cerr << "Error initialising GPIO pins!" << endl;
+      distanceSampler.reset();
+    }
+  }
+
+  // Create the frame source, offline sources loop unless benchmarking
+  frameSource = createFrameSource(frameSourceSpecification, cameraWidth, cameraHeight, !benchmarkMode);
+  if (!frameSource) {
+    return -1;
+  }
 
   // Open camera
-  cout << "Opening camera..." << endl;
-  if (!camera.open()) {
+  cout << "Opening camera..." << frameSource->name() << endl;
+  if (!frameSource->open()) {
     cerr << "Error opening camera!" << endl;
     return -1;
   }
   cout << "Camera opened successfully..." << endl;
 
-  // Start capturing
-  for (;;frameCount++) {
-    // Set the start time if on the first frame
-    if (frameCount == 1) {
-      time(&startTime);
+  // Preload the benchmark clip so that decoding is not part of the measurement
+  if (benchmarkMode) {
+    vector<cv::Mat> benchmarkClip;
+    while (benchmarkClip.size() < benchmarkFrames && frameSource->read(frame)) {
+      benchmarkClip.push_back(frame.clone());
+    }
+    frameSource->release();
+    cout << "Benchmark clip loaded..." << benchmarkClip.size() << " frames" << endl;
+
+    // Check the fused pre-processing against the OpenCV functions it replaces
+    if (!benchmarkClip.empty() && !checkFramePreprocessor(benchmarkClip[0], cout)) {
+      return -1;
     }
 
-    // Set the end time
-    time(&endTime);
+    frameSource.reset(new MemoryFrameSource(benchmarkClip, benchmarkClip.size()));
+    frameSource->open();
+    benchmark.reserve(benchmarkClip.size());
+    benchmark.start();
+    benchmarkAllocationCount = threadAllocations();
+  }
 
-    // Check if 1 seconds has passed
-    if (endTime - startTime == 1) {
+  // Start capturing
+  fpsStartTime = statsStartTime = chrono::steady_clock::now();
+  for (;;frameCount++) {
+    // Check if 1 second has passed, the frames per second are measured over the exact time elapsed
+    frameStartTime = chrono::steady_clock::now();
+    if (frameStartTime - fpsStartTime >= chrono::seconds(1)) {
       // Calculate the frames per second (FPS)
-      framesPerSecond = frameCount - startFrameCount;
+      framesPerSecond = (frameCount - startFrameCount) / chrono::duration<double>(frameStartTime - fpsStartTime).count();
 
       // Reset the start time and start frame counter
-      time(&startTime);
+      fpsStartTime = frameStartTime;
       startFrameCount = frameCount;
+
+      // Count the allocations made by the capture loop in the last second, debug builds only
+      captureAllocations = threadAllocations() - lastAllocationCount;
+
+      // Refresh the latency percentiles every interval, the benchmark reports them once at the end instead
+      if (!benchmarkMode && frameStartTime - statsStartTime >= chrono::duration<double>(statsInterval)) {
+        statsStartTime = frameStartTime;
+        latencyText.clear();
+        pipelineStats.report(latencyText);
+      }
+
+      // Update the statistics returned by the control server
+      statsText = "frames " + to_string(frameCount) + "\n"
+                  + "fps " + cv::format("%.2f", framesPerSecond) + "\n"
+                  + "recognition " + (faceRecognitionMode ? "on" : "off") + "\n"
+                  + "training " + (trainingMode ? trainingLabel + " " + to_string(trainingFaceImageCounter) + "/" + to_string(maxTrainingFaceImages) : "off") + "\n"
+                  + "labels " + to_string(faceRecognizerLabelNames.size()) + "\n"
+                  + "tracks " + to_string(faceTracker.tracks().size()) + "\n"
+                  + "detector_queue " + to_string(detectorPool.queueDepth()) + "\n"
+                  + "frame_pool_misses " + to_string(displayFramePool.misses() + greyFramePool.misses()) + "\n"
+                  + "dropped_detections " + to_string(detectionsSkipped) + "\n"
+                  + (loadGovernor ? "governor_level " + loadGovernor->describe() + "\n" : "")
+                  + (motionGate ? "motion_gate " + string(motionGateOpen ? "open" : "closed") + "\n" + "motion_gated_detections " + to_string(detectionsGated) + "\n" : "")
+                  + "dropped_mjpeg_frames " + to_string(mjpegServer.replaced()) + "\n"
+                  + "rejected_mjpeg_clients " + to_string(mjpegServer.rejected()) + "\n"
+                  + "skipped_snapshots " + to_string(snapshotWriter.skipped()) + "\n"
+                  + (allocationCounterEnabled ? "capture_allocations " + to_string(captureAllocations) + "\n" : "")
+                  + latencyText;
+      controlServer.setStats(statsText);
+
+      // Write the statistics file, replacing it atomically
+      if (!statsFilePath.empty()) {
+        writeStatsFile(statsFilePath, statsText);
+      }
+      lastAllocationCount = threadAllocations();
     }
 
-    // Get the frame from the camera
-    camera.grab();
-    camera.retrieve(frame);
+    // Handle the control commands, only an atomic flag is checked unless a command has arrived
+    if (controlServer.pending()) {
+      while (controlServer.takeCommand(controlCommand)) {
+        cout << "Control command..." << controlCommand.name << " " << controlCommand.argument << endl;
+        if (controlCommand.name == "stop") {
+          stopRequested = true;
+        }
+        else if (controlCommand.name == "recognition") {
+          faceRecognitionMode = controlCommand.argument == "toggle" ? !faceRecognitionMode : controlCommand.argument == "on";
+          cout << "Face Recognition Mode..." << (faceRecognitionMode ? "ON" : "OFF") << endl;
+
+          // The detector threads are only started the first time they are needed
+          if (faceRecognitionMode && !detectorPool.running() && !detectorPool.start(openCVCascadePath)) {
+            cerr << "Error starting detector threads!" << endl;
+            faceRecognitionMode = false;
+          }
+        }
+        else if (controlCommand.name == "train") {
+          trainingMode = controlCommand.argument != "off" && !benchmarkMode;
+          trainingLabel = trainingMode ? controlCommand.argument : "";
+          trainingFaceImageCounter = 0;
+          faceDataset.sync();
+          cout << "Training Mode..." << (trainingMode ? "ON..." + trainingLabel : "OFF") << endl;
+        }
+        else if (controlCommand.name == "reload" && !faceRecognizerReloading) {
+          // Load or retrain on a background thread so capture carries on
+          faceRecognizerReloading = true;
+          faceRecognizerReload = async(launch::async, [=]() {
+            FaceRecognizerReload reload;
+            FaceDataset reloadDataset;
+            reload.loaded = loadFaceRecognizer(trainingSet, reloadDataset, openCVFaceRecognizerModelFilePath, useFaceGallery, false, reload.faceRecognizerModel, reload.faceRecognizerLabelNames);
+            return reload;
+          });
+        }
+      }
+    }
+
+    // Swap in the reloaded face recognizer once it is ready
+    if (faceRecognizerReloading && faceRecognizerReload.wait_for(chrono::seconds(0)) == future_status::ready) {
+      FaceRecognizerReload reload = faceRecognizerReload.get();
+      faceRecognizerReloading = false;
+      if (reload.loaded) {
+        faceRecognizerModel = reload.faceRecognizerModel;
+        faceRecognizerLabelNames = reload.faceRecognizerLabelNames;
+        faceGalleryChanged = false;
+        recognitionWorker.setModel(faceRecognizerLabelNames.size() >= faceRecognizerMinimumLabels ? faceRecognizerModel : cv::Ptr<cv::FaceRecognizer>());
+        recognitionCache.clear();
+        faceROIPredicted = false;
+        cout << "Face recognizer reloaded..." << faceRecognizerLabelNames.size() << " labels" << endl;
+      }
+    }
 
-    // Convert frame to RGB
-    cv::cvtColor(frame, frame, cv::COLOR_BGR2RGB);
+    // Save the face gallery once training has finished, it is loaded as is on the next start
+    if (faceGalleryChanged && (!trainingMode || trainingFaceImageCounter >= maxTrainingFaceImages)) {
+      saveFaceGallery(faceRecognizerModel, trainingSet, faceDataset, openCVFaceRecognizerModelFilePath, faceRecognizerLabelNames);
+      faceGalleryChanged = false;
+    }
 
-    // Flip the image around both x and y-axis
-    cv::flip(frame, frame, -1);
+    // Stop the loop on the stop command or signal, or if the detector threads have failed
+    if (stopRequested || stopSignalReceived()) {
+      break;
+    }
+    if (detectorPool.failed()) {
+      cerr << "Error in detector threads, stopping!" << endl;
+      detectorFailed = true;
+      break;
+    }
+
+    // Get the frame from the camera
+    if (benchmarkMode) {
+      benchmark.startFrame();
+    }
+    frameStartTime = chrono::steady_clock::now();
+    if (!frameSource->read(capturedFrame)) {
+      cout << "End of frames..." << frameSource->name() << endl;
+      break;
+    }
+    pipelineStats.record(stageCapture, frameStartTime);
+    captureEndTime = chrono::steady_clock::now();
+
+    // Convert frame to RGB and flip the image around both x and y-axis, in one pass that also builds the greyscale frame for detection
+    stageStartTime = chrono::steady_clock::now();
+    displayFramePool.acquire(frame);
+    framePreprocessor.process(capturedFrame, frame, faceRecognitionMode ? &frameGrey : NULL);
+    convertDuration = chrono::steady_clock::now() - stageStartTime;
+    overlayDuration = chrono::steady_clock::duration::zero();
 
     // Run the face detection if input argument is TRUE
     if (faceRecognitionMode) {
-      // Call the detect faces function asynchronously
-      if (!futureFacesRunning) {
-        // Detect faces
-        futureFaces = async(launch::async, detectFaces, ref(faceROIImages), frame.clone(), faceCascade, eyeCascade, noseCascade, trainingMode);
+      // Follow the tracked faces to this frame
+      stageStartTime = chrono::steady_clock::now();
+      faceTracker.prepareFrame(frameGrey);
+      faceTracker.update();
+      pipelineStats.record(stageTrack, stageStartTime);
+
+      // Check the motion gate, the tracked faces are followed by detection whether they move or not
+      if (motionGate) {
+        stageStartTime = chrono::steady_clock::now();
+        motionGateOpen = motionGate->update(frameGrey);
+        pipelineStats.record(stageMotion, stageStartTime);
+      }
+      detectionDue = faceTracker.detectionNeeded(frameCount);
+      if (detectionDue && !motionGateOpen && faceTracker.tracks().empty()) {
+        detectionsGated++;
+        detectionDue = false;
+      }
 
-        // Set the future faces running flag to true
-        futureFacesRunning = true;
+      // Count the detections that are due but have to wait for a detection thread
+      if (detectionDue && !detectorPool.idleWorkerAvailable()) {
+        detectionsSkipped++;
       }
 
-      // Get the status of the future
-      futureStatus = futureFaces.wait_for(chrono::seconds(0));
+      // Hand the equalized greyscale frame to the detector pool if detection is due and a detection thread is free
+      if (detectionDue && detectorPool.idleWorkerAvailable()) {
+        detectionJob.frameNumber = frameCount;
+        detectionJob.searchRegionCount = 0;
+        if (motionGate && faceTracker.tracks().empty()) {
+          detectionJob.searchRegionCount = motionGate->regionsFound();
+          for (int i = 0; i < detectionJob.searchRegionCount; i++) {
+            detectionJob.searchRegions[i] = motionGate->region(i);
+          }
+        }
+        stageStartTime = chrono::steady_clock::now();
+        greyFramePool.acquire(detectionJob.frameGrey);
+        framePreprocessor.equalize(frameGrey, detectionJob.frameGrey);
+        convertDuration += chrono::steady_clock::now() - stageStartTime;
+        detectionJob.parameters = detectionParameters;
+        if (detectorPool.submit(move(detectionJob))) {
+          faceTracker.startDetection(frameCount);
+        }
 
-      // Check if the future has completed
-      if (futureStatus == future_status::ready) {
-        // Get the images array from the future
-        futureFaces.get();
+        // Wait for the detection when benchmarking so every run does identical work
+        if (benchmarkMode) {
+          if (detectorPool.waitResult(detectionResult)) {
+            latestDetectionFrameNumber = detectionResult.frameNumber + 1;
+            applyDetectionResult(detectionResult, faceTracker, frame, trainingMode, faceROIImages, cv::Size(faceROIImageWidth, faceROIImageHeight));
+          }
+        }
+      }
 
-        // Reset the future faces running flag to false
-        futureFacesRunning = false;
+      // Collect the finished detections, results can arrive out of order so only keep the newest
+      while (detectorPool.tryGetResult(detectionResult)) {
+        if (loadGovernor) {
+          loadGovernor->recordDetection(detectionResult.detectionTime);
+        }
+        if (detectionResult.frameNumber + 1 > latestDetectionFrameNumber) {
+          latestDetectionFrameNumber = detectionResult.frameNumber + 1;
+          faceROIImages.clear();
+          applyDetectionResult(detectionResult, faceTracker, frame, trainingMode, faceROIImages, cv::Size(faceROIImageWidth, faceROIImageHeight));
+        }
       }
 
       // Check if there are some face ROI images returned
       if (faceROIImages.size() > 0) {
         cout << "Face(s) detected..." << faceROIImages.size() << endl;
 
-        // Retrieve the first face ROI image into the objects and resize
-        cv::resize(faceROIImages[0], faceROIImage, cv::Size(faceROIImageWidth, faceROIImageHeight));
+        // Retrieve the first face ROI image into the objects, it is already resized
+        faceROIImage = faceROIImages[0].faceImage;
+        faceROITrackId = faceROIImages[0].trackId;
+        faceROIPredicted = false;
 
         // Get the face ROI timestamp formatted char
         faceROITimestamp = time(NULL);
@@ -411,17 +832,63 @@ int main(int argc, char **argv) {
           // Get the timestamp formatted char
           trainingFilenameTimestamp = time(NULL);
           strftime(trainingFilenameTimestampFormatted, sizeof(trainingFilenameTimestampFormatted), "%d%m%Y%H%M%S", localtime(&trainingFilenameTimestamp));
+          cv::cvtColor(faceROIImage, enrollFaceImage, cv::COLOR_BGR2GRAY);
+
+          // Append the training face image to the face dataset, synced once the run is complete, or write it to jpg file
+          if (!trainingSet.datasetFilePath.empty()) {
+            if (!faceDataset.append(trainingLabel, enrollFaceImage, (int64_t)trainingFilenameTimestamp)) {
+              cerr << "Error appending to face dataset!..." << trainingLabel << endl;
+            }
+            else if (trainingFaceImageCounter >= maxTrainingFaceImages) {
+              faceDataset.sync();
+            }
+          }
+          else {
+            faceImageFilename = trainingLabel + "_" + trainingFilenameTimestampFormatted + ".jpg";
+            cv::imwrite(openCVFaceRecognizerImagesPath + faceImageFilename, faceROIImage);
+          }
+
+          // Add the face to the gallery straight away, there is nothing to retrain
+          if (faceGallery(faceRecognizerModel) != NULL) {
+            faceRecognizerLabel = find(faceRecognizerLabelNames.begin(), faceRecognizerLabelNames.end(), trainingLabel) - faceRecognizerLabelNames.begin() + 1;
+            if (faceRecognizerLabel > (int)faceRecognizerLabelNames.size()) {
+              faceRecognizerLabelNames.push_back(trainingLabel);
+            }
+            faceRecognizerModel->update(vector<cv::Mat>(1, enrollFaceImage), vector<int>(1, faceRecognizerLabel));
+            recognitionWorker.setModel(faceRecognizerModel);
+            faceGalleryChanged = true;
+          }
+        }
 
-          // Write the training face image to jpg file
-          faceImageFilename = trainingLabel + "_" + trainingFilenameTimestampFormatted + ".jpg";
-          cv::imwrite(openCVFaceRecognizerImagesPath + faceImageFilename, faceROIImage);
+        // Queue the face ROI images of every face whose cached prediction is missing, out of date or for a different looking crop
+        if (faceRecognizerLabelNames.size() >= faceRecognizerMinimumLabels) {
+          recognitionBatch.clear();
+          for (size_t i = 0; i < faceROIImages.size(); i++) {
+            if (faceROIImages[i].trackId != 0 && recognitionCache.needsPrediction(faceROIImages[i])) {
+              recognitionBatch.push_back(faceROIImages[i]);
+            }
+          }
+          recognitionWorker.submit(recognitionBatch);
+
+          // Wait for the predictions when benchmarking so every run does identical work
+          if (benchmarkMode) {
+            recognitionWorker.waitIdle();
+          }
         }
 
         // Reset the images array
         faceROIImages.clear();
       }
 
+      // Collect the finished predictions and forget the faces that are no longer tracked
+      recognitionWorker.collect(recognitionResults);
+      for (size_t i = 0; i < recognitionResults.size(); i++) {
+        recognitionCache.store(recognitionResults[i]);
+      }
+      recognitionCache.retainTracks(faceTracker.tracks());
+
       // Check if the face ROI image is not empty
+      stageStartTime = chrono::steady_clock::now();
       if (!faceROIImage.empty()) {
 		// Draw the rectangle background
         cv::Point topLeft(imageMargin, imageMargin);
@@ -431,112 +898,184 @@ int main(int argc, char **argv) {
         // Copy the face ROI image into the frame
         faceROIImage.copyTo(frame(cv::Rect(imageMargin, imageMargin, faceROIImage.cols, faceROIImage.rows)));
 
-        // Convert face ROI image to grayscale, normalize the brightness, and increase the contrast
-        cv::cvtColor(faceROIImage, faceROIImageGrey, cv::COLOR_BGR2GRAY);
-        cv::equalizeHist(faceROIImageGrey, faceROIImageGrey);
-
-        // Use the face recognizer model to perform the face recognition prediction
-        if (faceRecognizerLabelNames.size() >= 2) {
-          faceRecognizerModel->predict(faceROIImageGrey, faceRecognizerPredictionLabel, faceRecognizerPredictionConfidence);
+        // Use the cached face recognition prediction of the face's track, the last one is kept once the track has gone
+        if (recognitionCache.lookup(faceROITrackId, faceRecognizerPredictionLabel, faceRecognizerPredictionConfidence)) {
+          faceROIPredicted = true;
+        }
+        // The gallery predicts -1 for a face that matches no label, which has no name to show
+        if (faceRecognizerLabelNames.size() >= faceRecognizerMinimumLabels && faceROIPredicted
+            && faceRecognizerPredictionLabel >= 1 && faceRecognizerPredictionLabel <= (int)faceRecognizerLabelNames.size()) {
           faceRecognizerPredictionLabelName = faceRecognizerLabelNames[faceRecognizerPredictionLabel - 1];
 
           // Add the prediction image name text
-          text = "Name: "+ faceRecognizerPredictionLabelName;
-          textSize = cv::getTextSize(text, font, fontSizeSmall, fontLineThickness, &textBaseline);
-          cv::putText(frame, text, cv::Point(textMargin, faceROIImageHeight + imageMargin + textMargin + textSize.height), font, fontSizeSmall, fontColour, fontLineThickness, fontLineType);
+          text = "Name: ";
+          text += faceRecognizerPredictionLabelName;
+          textSize = overlay.prepare(overlayFieldName, text, fontSizeSmall);
+          overlay.draw(frame, overlayFieldName, cv::Point(textMargin, faceROIImageHeight + imageMargin + textMargin + textSize.height));
 
           // Add the prediction image confidence text
-          text = "Confidence: " + cv::format("%.2f", faceRecognizerPredictionConfidence);
-          textSize = cv::getTextSize(text, font, fontSizeSmall, fontLineThickness, &textBaseline);
-          cv::putText(frame, text, cv::Point(textMargin, faceROIImageHeight + imageMargin + (textMargin * 2) + (textSize.height * 2)), font, fontSizeSmall, fontColour, fontLineThickness, fontLineType);
+          snprintf(textBuffer, sizeof(textBuffer), "Confidence: %.2f", faceRecognizerPredictionConfidence);
+          text = textBuffer;
+          textSize = overlay.prepare(overlayFieldConfidence, text, fontSizeSmall);
+          overlay.draw(frame, overlayFieldConfidence, cv::Point(textMargin, faceROIImageHeight + imageMargin + (textMargin * 2) + (textSize.height * 2)));
 
           // Add the face ROI timestamp text
-          text = "Date: " + string(faceROITimestampFormatted).substr(0, 10);
-          textSize = cv::getTextSize(text, font, fontSizeSmall, fontLineThickness, &textBaseline);
-          cv::putText(frame, text, cv::Point(textMargin, faceROIImageHeight + imageMargin + (textMargin * 3) + (textSize.height * 3)), font, fontSizeSmall, fontColour, fontLineThickness, fontLineType);
+          text = "Date: ";
+          text.append(faceROITimestampFormatted, 10);
+          textSize = overlay.prepare(overlayFieldDate, text, fontSizeSmall);
+          overlay.draw(frame, overlayFieldDate, cv::Point(textMargin, faceROIImageHeight + imageMargin + (textMargin * 3) + (textSize.height * 3)));
 
           // Add the face ROI timestamp text
-          text = "Time: " + string(faceROITimestampFormatted).substr(11, 8);
-          textSize = cv::getTextSize(text, font, fontSizeSmall, fontLineThickness, &textBaseline);
-          cv::putText(frame, text, cv::Point(textMargin, faceROIImageHeight + imageMargin + (textMargin * 4) + (textSize.height * 4)), font, fontSizeSmall, fontColour, fontLineThickness, fontLineType);
+          text = "Time: ";
+          text.append(faceROITimestampFormatted + 11, 8);
+          textSize = overlay.prepare(overlayFieldTime, text, fontSizeSmall);
+          overlay.draw(frame, overlayFieldTime, cv::Point(textMargin, faceROIImageHeight + imageMargin + (textMargin * 4) + (textSize.height * 4)));
         }
       }
+      overlayDuration = chrono::steady_clock::now() - stageStartTime;
+    }
+    pipelineStats.record(stageConvert, convertDuration);
+
+    // Draw a rectangle and the track ID around each tracked face
+    stageStartTime = chrono::steady_clock::now();
+    if (faceRecognitionMode) {
+      size_t trackField = overlayFieldTracks;
+      for (faceTrack = faceTracker.tracks().begin(); faceTrack != faceTracker.tracks().end(); ++faceTrack, ++trackField) {
+        faceTrackRect = faceTrack->rect & cv::Rect(0, 0, frame.cols, frame.rows);
+        cv::rectangle(frame, faceTrackRect.tl(), faceTrackRect.br(), cv::Scalar(255, 255, 255), 1, lineType, 0);
+        snprintf(textBuffer, sizeof(textBuffer), "#%d", faceTrack->id);
+        text = textBuffer;
+        if (faceRecognizerLabelNames.size() >= faceRecognizerMinimumLabels && recognitionCache.lookup(faceTrack->id, trackPredictionLabel, trackPredictionConfidence)
+            && trackPredictionLabel >= 1 && trackPredictionLabel <= (int)faceRecognizerLabelNames.size()) {
+          text += " ";
+          text += faceRecognizerLabelNames[trackPredictionLabel - 1];
+        }
+        overlay.drawText(frame, trackField, text, fontSizeSmall, cv::Point(faceTrackRect.x, max(faceTrackRect.y - 4, textMargin)));
+      }
     }
 
     // Add the face recognition mode text
     if (faceRecognitionMode) {
       text = "Face Recognition Mode: ON";
-      textSize = cv::getTextSize(text, font, fontSizeLarge, fontLineThickness, &textBaseline);
-      cv::putText(frame, text, cv::Point(textMargin, cameraHeight - textSize.height - (textMargin * 2)), font, fontSizeLarge, fontColour, fontLineThickness, fontLineType);
+      textSize = overlay.prepare(overlayFieldRecognitionMode, text, fontSizeLarge);
+      overlay.draw(frame, overlayFieldRecognitionMode, cv::Point(textMargin, cameraHeight - textSize.height - (textMargin * 2)));
     }
     else {
       text = "Face Recognition Mode: OFF";
-      textSize = cv::getTextSize(text, font, fontSizeLarge, fontLineThickness, &textBaseline);
-      cv::putText(frame, text, cv::Point(textMargin, cameraHeight - textSize.height - (textMargin * 2)), font, fontSizeLarge, fontColour, fontLineThickness, fontLineType);
+      textSize = overlay.prepare(overlayFieldRecognitionMode, text, fontSizeLarge);
+      overlay.draw(frame, overlayFieldRecognitionMode, cv::Point(textMargin, cameraHeight - textSize.height - (textMargin * 2)));
     }
 
     // Add the training mode text
     if (trainingMode) {
-      text = "Training Mode: ON (" + trainingLabel + "..." + to_string(trainingFaceImageCounter) + "\\" + to_string(maxTrainingFaceImages) + ")";
-      textSize = cv::getTextSize(text, font, fontSizeLarge, fontLineThickness, &textBaseline);
-      cv::putText(frame, text, cv::Point(textMargin, cameraHeight - textMargin), font, fontSizeLarge, fontColour, fontLineThickness, fontLineType);
+      snprintf(textBuffer, sizeof(textBuffer), "Training Mode: ON (%s...%d\\%d)", trainingLabel.c_str(), trainingFaceImageCounter, maxTrainingFaceImages);
+      text = textBuffer;
+      textSize = overlay.prepare(overlayFieldTrainingMode, text, fontSizeLarge);
+      overlay.draw(frame, overlayFieldTrainingMode, cv::Point(textMargin, cameraHeight - textMargin));
     }
     else {
       text = "Training Mode: OFF";
-      textSize = cv::getTextSize(text, font, fontSizeLarge, fontLineThickness, &textBaseline);
-      cv::putText(frame, text, cv::Point(textMargin, cameraHeight - textMargin), font, fontSizeLarge, fontColour, fontLineThickness, fontLineType);
+      textSize = overlay.prepare(overlayFieldTrainingMode, text, fontSizeLarge);
+      overlay.draw(frame, overlayFieldTrainingMode, cv::Point(textMargin, cameraHeight - textMargin));
     }
 
     // Add the frames per second text
-    text = "FPS: " + to_string(framesPerSecond);
-    textSize = cv::getTextSize(text, font, fontSizeLarge, fontLineThickness, &textBaseline);
-    cv::putText(frame, text, cv::Point(cameraWidth - textSize.width - textMargin, cameraHeight - textSize.height - (textMargin * 2)), font, fontSizeLarge, fontColour, fontLineThickness, fontLineType);
+    snprintf(textBuffer, sizeof(textBuffer), "FPS: %.1f", framesPerSecond);
+    text = textBuffer;
+    textSize = overlay.prepare(overlayFieldFramesPerSecond, text, fontSizeLarge);
+    overlay.draw(frame, overlayFieldFramesPerSecond, cv::Point(cameraWidth - textSize.width - textMargin, cameraHeight - textSize.height - (textMargin * 2)));
 
     // Add the date and timestamp text
     dateTimestamp = time(NULL);
     strftime(dateTimestampFormatted, sizeof(dateTimestampFormatted), "%d/%m/%Y %H:%M:%S", localtime(&dateTimestamp));
     text = dateTimestampFormatted;
-    textSize = cv::getTextSize(text, font, fontSizeLarge, fontLineThickness, &textBaseline);
-    cv::putText(frame, text, cv::Point(cameraWidth - textSize.width - textMargin, cameraHeight - textMargin), font, fontSizeLarge, fontColour, fontLineThickness, fontLineType);
+    textSize = overlay.prepare(overlayFieldDateTimestamp, text, fontSizeLarge);
+    overlay.draw(frame, overlayFieldDateTimestamp, cv::Point(cameraWidth - textSize.width - textMargin, cameraHeight - textMargin));
 
     // Check if the ultrasonic distance is enabled
-    if (ultrasonicSensor) {
+    if (distanceSampler) {
 
-      // Get the ultrasonic distance
-      if (frameCount % 150 == 0) {
-        distanceToObject = getDistance(triggerGpioPin, echoGpioPin);
+      // Get the latest ultrasonic distance without waiting for a measurement
+      if (distanceSampler->latest(distanceToObject)) {
+        snprintf(textBuffer, sizeof(textBuffer), "Distance: %.2fcm", distanceToObject);
+        text = textBuffer;
+      }
+      else {
+        text = "Distance: -";
       }
 
       // Add the distance text
-      text = "Distance: " + cv::format("%.2f", distanceToObject) + "cm";
-      textSize = cv::getTextSize(text, font, fontSizeLarge, fontLineThickness, &textBaseline);
-      cv::putText(frame, text, cv::Point(cameraWidth - textSize.width - textMargin, textSize.height + textMargin), font, fontSizeLarge, fontColour, fontLineThickness, fontLineType);
+      textSize = overlay.prepare(overlayFieldDistance, text, fontSizeLarge);
+      overlay.draw(frame, overlayFieldDistance, cv::Point(cameraWidth - textSize.width - textMargin, textSize.height + textMargin));
     }
+    pipelineStats.record(stageOverlay, overlayDuration + (chrono::steady_clock::now() - stageStartTime));
     
     // Write the image file or display the frame
-	if (showPreview) {
+    stageStartTime = chrono::steady_clock::now();
+	if (benchmarkMode) {
+		// Encode the frame in memory only
+		cv::imencode(".jpg", frame, benchmarkEncodedFrame);
+		pipelineStats.record(stageEncode, stageStartTime);
+		benchmark.endFrame();
+	}
+	else if (showPreview) {
 		// Display the frame in the window
 		cv::imshow("Video", frame);
 	}
+	else if (mjpegOutput) {
+		// Hand the frame to the MJPEG server, it is encoded on the server's thread
+		mjpegServer.publish(frame);
+	}
 	else {
-		// Write the image to jpg file
-		cv::imwrite(openCVPath + "image.jpg", frame);
+		// Hand the frame to the snapshot writer to write the image to jpg file
+		snapshotWriter.submit(frame);
 	}
+    if (!benchmarkMode) {
+      pipelineStats.record(stageOutput, stageStartTime);
+    }
+    pipelineStats.record(stageFrame, frameStartTime);
+
+    // Scale the detection work to the frame budget while detecting, the wait for the camera is not part of the frame time
+    if (loadGovernor && faceRecognitionMode) {
+      loadGovernor->recordFrame(chrono::steady_clock::now() - captureEndTime);
+      if (loadGovernor->update()) {
+        faceTracker.setDetectionInterval(loadGovernor->current().detectionInterval);
+        detectionParameters.faceDownscale = loadGovernor->current().faceDownscale;
+        detectionParameters.featureStages = loadGovernor->current().featureStages;
+      }
+    }
+  }
 
-    // Check if the stop file exists
-    if (ifstream(stopVideoCaptureFilePath)) {
-      // Delete the stop file
-      remove(stopVideoCaptureFilePath.c_str());
-
-      // Stop the loop
-      break;
+  // Output the benchmark results
+  if (benchmarkMode) {
+    benchmark.stop();
+    benchmark.report(cout);
+    if (allocationCounterEnabled) {
+      cout << "Capture allocations..." << threadAllocations() - benchmarkAllocationCount << " (frame pool misses " << displayFramePool.misses() + greyFramePool.misses() << ")" << endl;
     }
+    latencyText.clear();
+    pipelineStats.report(latencyText);
+    cout << latencyText;
   }
 
   // Clean up the objects
+  if (faceRecognizerReloading) {
+    faceRecognizerReload.wait();
+  }
+  if (faceGalleryChanged) {
+    saveFaceGallery(faceRecognizerModel, trainingSet, faceDataset, openCVFaceRecognizerModelFilePath, faceRecognizerLabelNames);
+  }
+  faceDataset.close();
+  controlServer.stop();
+  if (distanceSampler) {
+    distanceSampler->stop();
+  }
+  recognitionWorker.stop();
+  mjpegServer.stop();
+  snapshotWriter.stop();
   cout << "Stopping camera..." << endl;
-  camera.release();
+  frameSource->release();
   
-  return 0;
+  return detectorFailed ? -1 : 0;
 }
 
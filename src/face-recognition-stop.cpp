@@ -1,12 +1,50 @@
 #include <iostream>
-#include <fstream>
+#include <string>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
-using std::fstream;
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
 
+// Sends a command to face-recognition-start over its control socket and outputs the reply.
+// With no arguments the command is stop, otherwise the arguments are the command,
+// e.g. "recognition toggle", "train <label>", "reload" or "stats".
 int main(int argc, char **argv) {
-  fstream stopFile;
-  stopFile.open("/home/pi/projects/facerecognition/stop-video-capture.txt", std::ios::out);
-  stopFile << fflush;
-  stopFile.close();
-}
+  string controlSocketPath = "/home/pi/projects/facerecognition/face-recognition.sock";
+  string command = "stop";
+  sockaddr_un address;
+  char reply[1024];
+  ssize_t received;
+
+  // Join the arguments into the command
+  if (argc >= 2) {
+    command = argv[1];
+    for (int i = 2; i < argc; i++) {
+      command += string(" ") + argv[i];
+    }
+  }
+  command += "\n";
+
+  // Connect to the control socket
+  int controlSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, controlSocketPath.c_str(), sizeof(address.sun_path) - 1);
+  if (controlSocket < 0 || connect(controlSocket, (sockaddr *)&address, sizeof(address)) < 0) {
+    cerr << "Error connecting to face recognition!..." << controlSocketPath << endl;
+    return -1;
+  }
 
+  // Send the command and output the reply
+  send(controlSocket, command.data(), command.size(), 0);
+  while ((received = recv(controlSocket, reply, sizeof(reply), 0)) > 0) {
+    cout.write(reply, received);
+  }
+  close(controlSocket);
+
+  return 0;
+}
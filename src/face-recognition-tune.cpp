@@ -0,0 +1,240 @@
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/objdetect/objdetect.hpp>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "cascade-cache.hpp"
+#include "command-line-options.hpp"
+#include "face-detection.hpp"
+#include "pipeline-benchmark.hpp"
+
+using namespace std;
+
+// ##### Define the annotated image (an equalized greyscale frame and the faces marked in it)
+struct AnnotatedImage {
+  string fileName;
+  cv::Mat frameGrey;
+  vector<cv::Rect> faces;
+};
+
+// ##### Define the sweep result (the accuracy and latency of one set of detection parameters)
+struct SweepResult {
+  DetectionParameters parameters;
+  double meanMilliseconds;
+  double p95Milliseconds;
+  double precision;
+  double recall;
+  double f1;
+};
+
+// ##### Define the function to load the annotations
+// The annotation file uses the opencv_createsamples info format, one image per line:
+//   <image file> <face count> <x> <y> <width> <height> ...
+// with the image file relative to the annotation file.
+bool loadAnnotatedImages(const string &annotationFilePath, vector<AnnotatedImage> &images) {
+  ifstream annotationFile(annotationFilePath.c_str());
+  string line, directory;
+  size_t slashPosition = annotationFilePath.find_last_of('/');
+  int faceCount;
+  cv::Rect face;
+
+  if (!annotationFile) {
+    cerr << "Error opening annotations!..." << annotationFilePath << endl;
+    return false;
+  }
+  directory = slashPosition == string::npos ? "" : annotationFilePath.substr(0, slashPosition + 1);
+
+  while (getline(annotationFile, line)) {
+    istringstream fields(line);
+    AnnotatedImage image;
+    if (!(fields >> image.fileName >> faceCount) || image.fileName[0] == '#') {
+      continue;
+    }
+    for (int i = 0; i < faceCount && fields >> face.x >> face.y >> face.width >> face.height; i++) {
+      image.faces.push_back(face);
+    }
+
+    // Equalize as the capture loop does before handing a frame to the detectors
+    cv::Mat frameGrey = cv::imread(directory + image.fileName, CV_LOAD_IMAGE_GRAYSCALE);
+    if (frameGrey.empty()) {
+      cerr << "Error loading annotated image!..." << image.fileName << endl;
+      continue;
+    }
+    cv::equalizeHist(frameGrey, image.frameGrey);
+    images.push_back(image);
+  }
+
+  cout << "Loaded annotated images..." << images.size() << endl;
+  return !images.empty();
+}
+
+// ##### Define the function to parse a comma separated list of numbers
+vector<double> parseList(const string &list) {
+  vector<double> values;
+  istringstream fields(list);
+  string field;
+
+  while (getline(fields, field, ',')) {
+    if (!field.empty()) {
+      values.push_back(atof(field.c_str()));
+    }
+  }
+  return values;
+}
+
+// ##### Define the function to count the detected faces that match a marked face
+// Each marked face matches at most one detected face, the one it overlaps most with an intersection over union of at least minimumOverlap
+int countMatches(const vector<DetectedFace> &detectedFaces, const vector<cv::Rect> &markedFaces, double minimumOverlap) {
+  vector<bool> used(detectedFaces.size(), false);
+  int matches = 0;
+
+  for (size_t i = 0; i < markedFaces.size(); i++) {
+    int best = -1;
+    double bestOverlap = minimumOverlap;
+    for (size_t j = 0; j < detectedFaces.size(); j++) {
+      double intersection = (markedFaces[i] & detectedFaces[j].rect).area();
+      double overlap = intersection / (markedFaces[i].area() + detectedFaces[j].rect.area() - intersection);
+      if (!used[j] && overlap >= bestOverlap) {
+        best = (int)j;
+        bestOverlap = overlap;
+      }
+    }
+    if (best >= 0) {
+      used[best] = true;
+      matches++;
+    }
+  }
+  return matches;
+}
+
+// Sweeps the face detection parameters over an annotated image set, reports the latency
+// and accuracy of each set of parameters and saves the most accurate set within the
+// latency budget as a detector profile for face-recognition-start --detector-profile:
+//   face-recognition-tune <annotation file> [--budget=<ms>] [--profile=<file>] [options]
+int main(int argc, char **argv) {
+  CommandLineOptions options(argc, argv);
+  string openCVCascadePath = options.get("cascades", "/home/pi/projects/facerecognition/data/haarcascades/");
+  string profileFilePath = options.get("profile", "detector-profile.yml");
+  double budgetMilliseconds = options.getDouble("budget", 50.0);
+  double minimumOverlap = options.getDouble("overlap", 0.5);
+  int repeats = max(options.getInt("repeat", 1), 1);
+  vector<double> scaleFactors = parseList(options.get("scale-factors", "1.05,1.1,1.2,1.3"));
+  vector<double> minNeighbors = parseList(options.get("min-neighbors", "2,3,5"));
+  vector<double> minSizes = parseList(options.get("min-sizes", "20,40"));
+  vector<double> maxSizes = parseList(options.get("max-sizes", "240,400"));
+  vector<double> downscales = parseList(options.get("downscales", "1,2,3"));
+  vector<AnnotatedImage> images;
+  vector<SweepResult> results;
+  vector<DetectedFace> detectedFaces;
+  DetectionScratch scratch;
+  PipelineBenchmark benchmark;
+  CascadeCache cascadeCache(openCVCascadePath);
+  cv::CascadeClassifier faceCascade, eyeCascade, noseCascade;
+  DetectionParameters parameters;
+  int best = -1;
+
+  if (options.positional.size() != 1) {
+    cerr << "Usage: face-recognition-tune <annotation file> [--budget=<ms>] [--profile=<file>] [--cascades=<directory>] [--repeat=<n>] [--overlap=<iou>]" << endl
+         << "       [--scale-factors=<list>] [--min-neighbors=<list>] [--min-sizes=<list>] [--max-sizes=<list>] [--downscales=<list>]" << endl;
+    return -1;
+  }
+
+  // Load the cascades and the annotated images, the eye and nose settings are kept from the starting profile
+  if (!cascadeCache.load(cascadeFace, faceCascade) || !cascadeCache.load(cascadeEye, eyeCascade) || !cascadeCache.load(cascadeNose, noseCascade)) {
+    cerr << "Error loading cascades!..." << openCVCascadePath << endl;
+    return -1;
+  }
+  cascadeCache.release();
+  if (options.has("start-profile") && !loadDetectionProfile(options.get("start-profile", ""), parameters)) {
+    return -1;
+  }
+  if (!loadAnnotatedImages(options.positional[0], images)) {
+    return -1;
+  }
+
+  // Run every combination, the detection time of each image includes the eye and nose stages as in the detector threads
+  cout << fixed << setprecision(2);
+  for (size_t a = 0; a < scaleFactors.size(); a++) {
+    for (size_t b = 0; b < minNeighbors.size(); b++) {
+      for (size_t c = 0; c < minSizes.size(); c++) {
+        for (size_t d = 0; d < maxSizes.size(); d++) {
+          for (size_t e = 0; e < downscales.size(); e++) {
+            SweepResult result;
+            int markedCount = 0, detectedCount = 0, matchCount = 0;
+
+            parameters.faceScaleFactor = scaleFactors[a];
+            parameters.faceMinNeighbors = (int)minNeighbors[b];
+            parameters.faceMinSize = (int)minSizes[c];
+            parameters.faceMaxSize = (int)maxSizes[d];
+            parameters.faceDownscale = downscales[e];
+            if (parameters.faceMaxSize < parameters.faceMinSize) {
+              continue;
+            }
+
+            benchmark.clear();
+            benchmark.start();
+            for (int r = 0; r < repeats; r++) {
+              for (size_t i = 0; i < images.size(); i++) {
+                benchmark.startFrame();
+                detectFaces(detectedFaces, images[i].frameGrey, NULL, 0, faceCascade, eyeCascade, noseCascade, parameters, scratch);
+                benchmark.endFrame();
+                if (r == 0) {
+                  markedCount += (int)images[i].faces.size();
+                  detectedCount += (int)detectedFaces.size();
+                  matchCount += countMatches(detectedFaces, images[i].faces, minimumOverlap);
+                }
+              }
+            }
+            benchmark.stop();
+
+            result.parameters = parameters;
+            result.meanMilliseconds = benchmark.meanLatency();
+            result.p95Milliseconds = benchmark.latencyPercentile(95);
+            result.precision = detectedCount > 0 ? (double)matchCount / detectedCount : 1.0;
+            result.recall = markedCount > 0 ? (double)matchCount / markedCount : 1.0;
+            result.f1 = result.precision + result.recall > 0 ? 2 * result.precision * result.recall / (result.precision + result.recall) : 0.0;
+            results.push_back(result);
+
+            cout << "TUNE scale_factor=" << parameters.faceScaleFactor << " min_neighbors=" << parameters.faceMinNeighbors
+                 << " min_size=" << parameters.faceMinSize << " max_size=" << parameters.faceMaxSize << " downscale=" << parameters.faceDownscale
+                 << " mean_ms=" << result.meanMilliseconds << " p95_ms=" << result.p95Milliseconds
+                 << " precision=" << result.precision << " recall=" << result.recall << " f1=" << result.f1 << endl;
+          }
+        }
+      }
+    }
+  }
+
+  // Recommend the most accurate combination whose p95 latency is within the budget, the fastest of equally accurate ones
+  for (size_t i = 0; i < results.size(); i++) {
+    if (results[i].p95Milliseconds > budgetMilliseconds) {
+      continue;
+    }
+    if (best < 0 || results[i].f1 > results[best].f1 + 1e-9
+        || (results[i].f1 > results[best].f1 - 1e-9 && results[i].p95Milliseconds < results[best].p95Milliseconds)) {
+      best = (int)i;
+    }
+  }
+  if (best < 0) {
+    cerr << "No parameters within the latency budget!..." << budgetMilliseconds << "ms" << endl;
+    return -1;
+  }
+
+  const SweepResult &recommended = results[best];
+  cout << "Recommended detector profile...scale_factor " << recommended.parameters.faceScaleFactor << " min_neighbors " << recommended.parameters.faceMinNeighbors
+       << " min_size " << recommended.parameters.faceMinSize << " max_size " << recommended.parameters.faceMaxSize << " downscale " << recommended.parameters.faceDownscale
+       << " (p95 " << recommended.p95Milliseconds << "ms, precision " << recommended.precision << ", recall " << recommended.recall << ")" << endl;
+  if (!saveDetectionProfile(profileFilePath, recommended.parameters)) {
+    cerr << "Error saving detector profile!..." << profileFilePath << endl;
+    return -1;
+  }
+  cout << "Saved detector profile..." << profileFilePath << endl;
+
+  return 0;
+}
@@ -0,0 +1,196 @@
+#ifndef FACE_TRACKER_HPP
+#define FACE_TRACKER_HPP
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <algorithm>
+#include <vector>
+
+// ##### Define the face track
+struct FaceTrack {
+  FaceTrack() : id(0), missedFrames(0), unconfirmedDetections(0) {}
+
+  int id;
+  cv::Rect rect;                // Full resolution position
+  cv::Mat appearance;           // Template cut from the downscaled tracking frame
+  int missedFrames;             // Consecutive frames the template was not found
+  int unconfirmedDetections;    // Consecutive detections that did not find this face
+};
+
+// ##### Define the face tracker
+// Follows each detected face between detections by matching its template in a
+// small window around the previous position on a downscaled greyscale frame.
+// Detections correct the tracks and start new ones, so the cascades only have
+// to run every few frames or when a track is lost.
+class FaceTracker {
+public:
+  FaceTracker(int detectionInterval, int trackingDownscale)
+    : detectionInterval(std::max(detectionInterval, 1)), trackingDownscale(std::max(trackingDownscale, 1)),
+      minimumScore(0.5), maximumMissedFrames(5), maximumUnconfirmedDetections(2), nextTrackId(1),
+      lastDetectionFrameNumber(0), trackLost(true) {}
+
+  // Build the downscaled greyscale frame used for tracking, from a colour or an already greyscale frame
+  void prepareFrame(const cv::Mat &frame) {
+    if (frame.channels() == 1) {
+      cv::resize(frame, trackingFrame, cv::Size(frame.cols / trackingDownscale, frame.rows / trackingDownscale), 0, 0, cv::INTER_NEAREST);
+      return;
+    }
+    cv::resize(frame, trackingFrameColour, cv::Size(frame.cols / trackingDownscale, frame.rows / trackingDownscale), 0, 0, cv::INTER_NEAREST);
+    cv::cvtColor(trackingFrameColour, trackingFrame, cv::COLOR_BGR2GRAY);
+  }
+
+  // Move every track to the best template match near its previous position
+  void update() {
+    cv::Rect frameRect(0, 0, trackingFrame.cols, trackingFrame.rows);
+    cv::Rect smallRect, searchWindow;
+    double maxScore;
+    cv::Point maxLocation;
+
+    for (size_t i = 0; i < trackList.size(); i++) {
+      FaceTrack &track = trackList[i];
+
+      // Search a window half a template larger on each side
+      smallRect = toTrackingRect(track.rect);
+      searchWindow = cv::Rect(smallRect.x - smallRect.width / 2, smallRect.y - smallRect.height / 2, smallRect.width * 2, smallRect.height * 2) & frameRect;
+      if (track.appearance.empty() || searchWindow.width < track.appearance.cols || searchWindow.height < track.appearance.rows) {
+        track.missedFrames++;
+        continue;
+      }
+
+      cv::matchTemplate(trackingFrame(searchWindow), track.appearance, matchScores, CV_TM_CCOEFF_NORMED);
+      cv::minMaxLoc(matchScores, NULL, &maxScore, NULL, &maxLocation);
+      if (maxScore < minimumScore) {
+        track.missedFrames++;
+        continue;
+      }
+
+      track.missedFrames = 0;
+      track.rect.x = (searchWindow.x + maxLocation.x) * trackingDownscale;
+      track.rect.y = (searchWindow.y + maxLocation.y) * trackingDownscale;
+    }
+
+    removeLostTracks();
+  }
+
+  // Correct the tracks with a finished detection and start tracks for new faces, the track ID of each detection is returned
+  void correct(const std::vector<cv::Rect> &detectedFaces, std::vector<int> &trackIds) {
+    std::vector<bool> detectionMatched(detectedFaces.size(), false);
+    std::vector<bool> trackMatched(trackList.size(), false);
+    double bestOverlap, overlap;
+    int bestDetection;
+
+    trackIds.assign(detectedFaces.size(), 0);
+
+    // Greedily pair each track with the detection it overlaps most
+    for (size_t i = 0; i < trackList.size(); i++) {
+      bestOverlap = 0.3;
+      bestDetection = -1;
+      for (size_t j = 0; j < detectedFaces.size(); j++) {
+        overlap = intersectionOverUnion(trackList[i].rect, detectedFaces[j]);
+        if (!detectionMatched[j] && overlap > bestOverlap) {
+          bestOverlap = overlap;
+          bestDetection = (int)j;
+        }
+      }
+      if (bestDetection >= 0) {
+        // Keep the tracked centre, the detection is a few frames old, but take its size
+        const cv::Rect &detection = detectedFaces[bestDetection];
+        FaceTrack &track = trackList[i];
+        cv::Point center(track.rect.x + track.rect.width / 2, track.rect.y + track.rect.height / 2);
+        track.rect = cv::Rect(center.x - detection.width / 2, center.y - detection.height / 2, detection.width, detection.height);
+        track.unconfirmedDetections = 0;
+        track.missedFrames = 0;
+        refreshAppearance(track);
+        detectionMatched[bestDetection] = true;
+        trackMatched[i] = true;
+        trackIds[bestDetection] = track.id;
+      }
+    }
+
+    // Tracks that repeated detections do not confirm are dropped
+    for (size_t i = 0; i < trackList.size(); i++) {
+      if (!trackMatched[i]) {
+        trackList[i].unconfirmedDetections++;
+      }
+    }
+
+    // Start a track for every new face
+    for (size_t j = 0; j < detectedFaces.size(); j++) {
+      if (!detectionMatched[j]) {
+        FaceTrack track;
+        track.id = nextTrackId++;
+        trackIds[j] = track.id;
+        track.rect = detectedFaces[j];
+        refreshAppearance(track);
+        trackList.push_back(track);
+      }
+    }
+
+    removeLostTracks();
+  }
+
+  // True when the detection interval has passed or a track has been lost (or on the first frame)
+  bool detectionNeeded(size_t frameNumber) const {
+    return trackLost || frameNumber >= lastDetectionFrameNumber + detectionInterval;
+  }
+
+  // Change the number of frames between detections, the next detection is due that many frames after the last one
+  void setDetectionInterval(int interval) {
+    detectionInterval = std::max(interval, 1);
+  }
+
+  // Record that a detection was started on the given frame
+  void startDetection(size_t frameNumber) {
+    lastDetectionFrameNumber = frameNumber;
+    trackLost = false;
+  }
+
+  const std::vector<FaceTrack> &tracks() const {
+    return trackList;
+  }
+
+private:
+  cv::Rect toTrackingRect(const cv::Rect &rect) const {
+    return cv::Rect(rect.x / trackingDownscale, rect.y / trackingDownscale, rect.width / trackingDownscale, rect.height / trackingDownscale);
+  }
+
+  void refreshAppearance(FaceTrack &track) {
+    cv::Rect smallRect = toTrackingRect(track.rect) & cv::Rect(0, 0, trackingFrame.cols, trackingFrame.rows);
+    if (smallRect.width >= 4 && smallRect.height >= 4) {
+      track.appearance = trackingFrame(smallRect).clone();
+    }
+  }
+
+  void removeLostTracks() {
+    for (size_t i = 0; i < trackList.size();) {
+      if (trackList[i].missedFrames > maximumMissedFrames || trackList[i].unconfirmedDetections > maximumUnconfirmedDetections) {
+        trackList.erase(trackList.begin() + i);
+        trackLost = true;
+      }
+      else {
+        i++;
+      }
+    }
+  }
+
+  static double intersectionOverUnion(const cv::Rect &a, const cv::Rect &b) {
+    double intersection = (a & b).area();
+    double unionArea = a.area() + b.area() - intersection;
+    return unionArea > 0 ? intersection / unionArea : 0.0;
+  }
+
+  int detectionInterval;
+  int trackingDownscale;
+  double minimumScore;
+  int maximumMissedFrames;
+  int maximumUnconfirmedDetections;
+  int nextTrackId;
+  size_t lastDetectionFrameNumber;
+  bool trackLost;
+  std::vector<FaceTrack> trackList;
+  cv::Mat trackingFrameColour;
+  cv::Mat trackingFrame;
+  cv::Mat matchScores;
+};
+
+#endif
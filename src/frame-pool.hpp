@@ -0,0 +1,70 @@
+#ifndef FRAME_POOL_HPP
+#define FRAME_POOL_HPP
+
+#include <opencv2/core/core.hpp>
+#include <atomic>
+#include <vector>
+
+// ##### Define the frame pool
+// A ring of frame buffers allocated up front. A buffer is handed out as an
+// ordinary cv::Mat that shares the pool's data, so it passes from capture to
+// the detector threads and the output threads without being copied, and it
+// is free again once every one of those cv::Mat references has been released
+// (the pool's own reference is the only one left). If every buffer is still in
+// use the pool grows by one and counts a miss, so a pool that is too small
+// settles at the size it needs.
+class FramePool {
+public:
+  FramePool(size_t bufferCount, int rows, int cols, int type)
+    : rows(rows), cols(cols), type(type), nextBuffer(0), poolMisses(0) {
+    buffers.resize(bufferCount);
+    for (size_t i = 0; i < buffers.size(); i++) {
+      buffers[i].create(rows, cols, type);
+    }
+  }
+
+  // Get a buffer no one else is using, it is only to be used by the capture loop thread
+  void acquire(cv::Mat &buffer) {
+    for (size_t i = 0; i < buffers.size(); i++) {
+      size_t index = (nextBuffer + i) % buffers.size();
+      if (!inUse(buffers[index])) {
+        nextBuffer = index + 1;
+        buffer = buffers[index];
+        return;
+      }
+    }
+
+    // Every buffer is still referenced, grow the pool
+    poolMisses++;
+    buffers.push_back(cv::Mat(rows, cols, type));
+    nextBuffer = 0;
+    buffer = buffers.back();
+  }
+
+  size_t size() const {
+    return buffers.size();
+  }
+
+  size_t misses() const {
+    return poolMisses.load();
+  }
+
+private:
+  // Check if anything other than the pool holds a reference to a buffer
+  static bool inUse(cv::Mat &buffer) {
+#if CV_MAJOR_VERSION >= 3
+    return buffer.u != NULL && CV_XADD(&buffer.u->refcount, 0) > 1;
+#else
+    return buffer.refcount != NULL && CV_XADD(buffer.refcount, 0) > 1;
+#endif
+  }
+
+  int rows;
+  int cols;
+  int type;
+  std::vector<cv::Mat> buffers;
+  size_t nextBuffer;
+  std::atomic<size_t> poolMisses;
+};
+
+#endif
@@ -0,0 +1,269 @@
+#ifndef FRAME_PREPROCESS_HPP
+#define FRAME_PREPROCESS_HPP
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <cstring>
+#include <ostream>
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+// Fixed point weights of cv::cvtColor(COLOR_BGR2GRAY) applied to the swapped
+// frame, i.e. to the captured channels in reverse order. OpenCV 4 moved from
+// 14 to 15 fractional bits.
+#if CV_MAJOR_VERSION >= 4
+const unsigned int preprocessGreyWeight0 = 9798;   // Captured channel 0
+const unsigned int preprocessGreyWeight1 = 19235;  // Captured channel 1
+const unsigned int preprocessGreyWeight2 = 3735;   // Captured channel 2
+const unsigned int preprocessGreyShift = 15;
+#else
+const unsigned int preprocessGreyWeight0 = 4899;   // Captured channel 0
+const unsigned int preprocessGreyWeight1 = 9617;   // Captured channel 1
+const unsigned int preprocessGreyWeight2 = 1868;   // Captured channel 2
+const unsigned int preprocessGreyShift = 14;
+#endif
+
+// ##### Define the function to pre-process one row of a captured frame
+// Swapping the channels and rotating by 180 degrees together is a byte
+// reversal of the row, so the display row is the captured row reversed. The
+// grey row (optional) is written in display order and counted into the four
+// interleaved histograms, which avoids stalls on repeated grey levels.
+inline void preprocessFrameRow(const uchar *captured, uchar *display, uchar *grey, int width, unsigned int (*histograms)[256]) {
+  int x = 0;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+  for (; x + 16 <= width; x += 16) {
+    uint8x16x3_t pixels = vld3q_u8(captured + x * 3);
+    uint8x16x3_t reversed;
+    int destination = width - 16 - x;
+
+    // Reverse the pixel order and store the planes in reverse channel order
+    for (int c = 0; c < 3; c++) {
+      uint8x16_t plane = vrev64q_u8(pixels.val[2 - c]);
+      reversed.val[c] = vcombine_u8(vget_high_u8(plane), vget_low_u8(plane));
+    }
+    vst3q_u8(display + destination * 3, reversed);
+
+    if (grey != NULL) {
+      uint16x8_t channel0 = vmovl_u8(vget_low_u8(pixels.val[0]));
+      uint16x8_t channel1 = vmovl_u8(vget_low_u8(pixels.val[1]));
+      uint16x8_t channel2 = vmovl_u8(vget_low_u8(pixels.val[2]));
+      uint32x4_t sum0 = vmull_n_u16(vget_low_u16(channel0), preprocessGreyWeight0);
+      uint32x4_t sum1 = vmull_n_u16(vget_high_u16(channel0), preprocessGreyWeight0);
+      sum0 = vmlal_n_u16(sum0, vget_low_u16(channel1), preprocessGreyWeight1);
+      sum1 = vmlal_n_u16(sum1, vget_high_u16(channel1), preprocessGreyWeight1);
+      sum0 = vmlal_n_u16(sum0, vget_low_u16(channel2), preprocessGreyWeight2);
+      sum1 = vmlal_n_u16(sum1, vget_high_u16(channel2), preprocessGreyWeight2);
+      uint8x8_t greyLow = vmovn_u16(vcombine_u16(vrshrn_n_u32(sum0, preprocessGreyShift), vrshrn_n_u32(sum1, preprocessGreyShift)));
+
+      channel0 = vmovl_u8(vget_high_u8(pixels.val[0]));
+      channel1 = vmovl_u8(vget_high_u8(pixels.val[1]));
+      channel2 = vmovl_u8(vget_high_u8(pixels.val[2]));
+      sum0 = vmull_n_u16(vget_low_u16(channel0), preprocessGreyWeight0);
+      sum1 = vmull_n_u16(vget_high_u16(channel0), preprocessGreyWeight0);
+      sum0 = vmlal_n_u16(sum0, vget_low_u16(channel1), preprocessGreyWeight1);
+      sum1 = vmlal_n_u16(sum1, vget_high_u16(channel1), preprocessGreyWeight1);
+      sum0 = vmlal_n_u16(sum0, vget_low_u16(channel2), preprocessGreyWeight2);
+      sum1 = vmlal_n_u16(sum1, vget_high_u16(channel2), preprocessGreyWeight2);
+      uint8x8_t greyHigh = vmovn_u16(vcombine_u16(vrshrn_n_u32(sum0, preprocessGreyShift), vrshrn_n_u32(sum1, preprocessGreyShift)));
+
+      // Reverse the 16 grey pixels into display order
+      vst1q_u8(grey + destination, vcombine_u8(vrev64_u8(greyHigh), vrev64_u8(greyLow)));
+    }
+  }
+#elif defined(__SSSE3__)
+  const __m128i reverseBytes = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+  const __m128i channel0From0 = _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i channel0From1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1);
+  const __m128i channel0From2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13);
+  const __m128i channel1From0 = _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i channel1From1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1);
+  const __m128i channel1From2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14);
+  const __m128i channel2From0 = _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i channel2From1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1);
+  const __m128i channel2From2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15);
+  const __m128i weights01 = _mm_setr_epi16(preprocessGreyWeight0, preprocessGreyWeight1, preprocessGreyWeight0, preprocessGreyWeight1,
+                                           preprocessGreyWeight0, preprocessGreyWeight1, preprocessGreyWeight0, preprocessGreyWeight1);
+  const __m128i weights2Round = _mm_setr_epi16(preprocessGreyWeight2, 1, preprocessGreyWeight2, 1, preprocessGreyWeight2, 1, preprocessGreyWeight2, 1);
+  const __m128i rounding = _mm_set1_epi16(1 << (preprocessGreyShift - 1));
+  const __m128i zero = _mm_setzero_si128();
+
+  for (; x + 16 <= width; x += 16) {
+    __m128i block0 = _mm_loadu_si128((const __m128i *)(captured + x * 3));
+    __m128i block1 = _mm_loadu_si128((const __m128i *)(captured + x * 3 + 16));
+    __m128i block2 = _mm_loadu_si128((const __m128i *)(captured + x * 3 + 32));
+    int destination = width - 16 - x;
+
+    // The 48 display bytes are the 48 captured bytes reversed
+    _mm_storeu_si128((__m128i *)(display + destination * 3), _mm_shuffle_epi8(block2, reverseBytes));
+    _mm_storeu_si128((__m128i *)(display + destination * 3 + 16), _mm_shuffle_epi8(block1, reverseBytes));
+    _mm_storeu_si128((__m128i *)(display + destination * 3 + 32), _mm_shuffle_epi8(block0, reverseBytes));
+
+    if (grey != NULL) {
+      // Gather each channel of the 16 pixels into its own register
+      __m128i channel0 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(block0, channel0From0), _mm_shuffle_epi8(block1, channel0From1)), _mm_shuffle_epi8(block2, channel0From2));
+      __m128i channel1 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(block0, channel1From0), _mm_shuffle_epi8(block1, channel1From1)), _mm_shuffle_epi8(block2, channel1From2));
+      __m128i channel2 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(block0, channel2From0), _mm_shuffle_epi8(block1, channel2From1)), _mm_shuffle_epi8(block2, channel2From2));
+      __m128i greyHalves[2];
+
+      for (int half = 0; half < 2; half++) {
+        __m128i channel0Words = half == 0 ? _mm_unpacklo_epi8(channel0, zero) : _mm_unpackhi_epi8(channel0, zero);
+        __m128i channel1Words = half == 0 ? _mm_unpacklo_epi8(channel1, zero) : _mm_unpackhi_epi8(channel1, zero);
+        __m128i channel2Words = half == 0 ? _mm_unpacklo_epi8(channel2, zero) : _mm_unpackhi_epi8(channel2, zero);
+
+        // Multiply and add channel 0 with 1, and channel 2 with the rounding term
+        __m128i sumLow = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(channel0Words, channel1Words), weights01),
+                                       _mm_madd_epi16(_mm_unpacklo_epi16(channel2Words, rounding), weights2Round));
+        __m128i sumHigh = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(channel0Words, channel1Words), weights01),
+                                        _mm_madd_epi16(_mm_unpackhi_epi16(channel2Words, rounding), weights2Round));
+        greyHalves[half] = _mm_packs_epi32(_mm_srli_epi32(sumLow, preprocessGreyShift), _mm_srli_epi32(sumHigh, preprocessGreyShift));
+      }
+
+      // Reverse the 16 grey pixels into display order
+      _mm_storeu_si128((__m128i *)(grey + destination), _mm_shuffle_epi8(_mm_packus_epi16(greyHalves[0], greyHalves[1]), reverseBytes));
+    }
+  }
+#endif
+
+  // Scalar fallback, also handles the pixels left over by the vector loops
+  for (; x < width; x++) {
+    const uchar *pixel = captured + x * 3;
+    uchar *displayPixel = display + (width - 1 - x) * 3;
+    displayPixel[0] = pixel[2];
+    displayPixel[1] = pixel[1];
+    displayPixel[2] = pixel[0];
+    if (grey != NULL) {
+      grey[width - 1 - x] = (uchar)((pixel[0] * preprocessGreyWeight0 + pixel[1] * preprocessGreyWeight1 + pixel[2] * preprocessGreyWeight2 + (1 << (preprocessGreyShift - 1))) >> preprocessGreyShift);
+    }
+  }
+
+  // Count the grey row while it is still in the cache
+  if (grey != NULL) {
+    for (x = 0; x + 4 <= width; x += 4) {
+      histograms[0][grey[x]]++;
+      histograms[1][grey[x + 1]]++;
+      histograms[2][grey[x + 2]]++;
+      histograms[3][grey[x + 3]]++;
+    }
+    for (; x < width; x++) {
+      histograms[0][grey[x]]++;
+    }
+  }
+}
+
+// ##### Define the function to name the vector path the pre-processor was built with
+// Without NEON or SSSE3 (e.g. x86 built without -mssse3) the rows are done one pixel at a time.
+inline const char *preprocessVectorPath() {
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+  return "NEON";
+#elif defined(__SSSE3__)
+  return "SSSE3";
+#else
+  return "scalar";
+#endif
+}
+
+// ##### Define the frame pre-processor
+// Replaces cvtColor(COLOR_BGR2RGB), flip(-1), cvtColor(COLOR_BGR2GRAY) and
+// equalizeHist with one pass over the captured frame that writes the display
+// frame, the grey frame and its histogram. Only the equalization lookup is a
+// second pass, over the single channel grey frame, and it is only needed on
+// frames handed to the detectors.
+class FramePreprocessor {
+public:
+  FramePreprocessor() : greyPixels(0) {
+    memset(histogram, 0, sizeof(histogram));
+  }
+
+  // Swap and flip the captured frame into the display frame, and build the grey frame if it is not NULL
+  void process(const cv::Mat &capturedFrame, cv::Mat &displayFrame, cv::Mat *greyFrame) {
+    CV_Assert(capturedFrame.type() == CV_8UC3 && capturedFrame.data != displayFrame.data);
+    unsigned int histograms[4][256];
+    int rows = capturedFrame.rows;
+    int cols = capturedFrame.cols;
+
+    displayFrame.create(rows, cols, CV_8UC3);
+    if (greyFrame != NULL) {
+      greyFrame->create(rows, cols, CV_8UC1);
+      memset(histograms, 0, sizeof(histograms));
+    }
+
+    for (int y = 0; y < rows; y++) {
+      preprocessFrameRow(capturedFrame.ptr(rows - 1 - y), displayFrame.ptr(y), greyFrame != NULL ? greyFrame->ptr(y) : NULL, cols, histograms);
+    }
+
+    if (greyFrame != NULL) {
+      for (int i = 0; i < 256; i++) {
+        histogram[i] = histograms[0][i] + histograms[1][i] + histograms[2][i] + histograms[3][i];
+      }
+      greyPixels = (size_t)rows * cols;
+    }
+  }
+
+  // Equalize the grey frame of the last process call into the equalized frame, as cv::equalizeHist does
+  void equalize(const cv::Mat &greyFrame, cv::Mat &equalizedFrame) const {
+    uchar lut[256];
+    int i = 0, sum = 0;
+
+    equalizedFrame.create(greyFrame.rows, greyFrame.cols, CV_8UC1);
+    if (greyPixels == 0) {
+      return;
+    }
+
+    // Build the lookup table from the cumulative histogram
+    while (histogram[i] == 0) {
+      i++;
+    }
+    if (histogram[i] == greyPixels) {
+      equalizedFrame.setTo(cv::Scalar(i));
+      return;
+    }
+    float scale = 255.f / (float)(greyPixels - histogram[i]);
+    memset(lut, 0, sizeof(lut));
+    for (i++; i < 256; i++) {
+      sum += histogram[i];
+      lut[i] = cv::saturate_cast<uchar>(sum * scale);
+    }
+
+    for (int y = 0; y < greyFrame.rows; y++) {
+      const uchar *source = greyFrame.ptr(y);
+      uchar *destination = equalizedFrame.ptr(y);
+      for (int x = 0; x < greyFrame.cols; x++) {
+        destination[x] = lut[source[x]];
+      }
+    }
+  }
+
+private:
+  unsigned int histogram[256];
+  size_t greyPixels;
+};
+
+// ##### Define the function to check the pre-processor against the OpenCV chain, returns false if any pixel differs
+inline bool checkFramePreprocessor(const cv::Mat &capturedFrame, std::ostream &output) {
+  FramePreprocessor preprocessor;
+  cv::Mat displayFrame, greyFrame, equalizedFrame;
+  cv::Mat expectedDisplayFrame, expectedGreyFrame;
+  int displayDifferences, greyDifferences;
+
+  preprocessor.process(capturedFrame, displayFrame, &greyFrame);
+  preprocessor.equalize(greyFrame, equalizedFrame);
+
+  cv::cvtColor(capturedFrame, expectedDisplayFrame, cv::COLOR_BGR2RGB);
+  cv::flip(expectedDisplayFrame, expectedDisplayFrame, -1);
+  cv::cvtColor(expectedDisplayFrame, expectedGreyFrame, cv::COLOR_BGR2GRAY);
+  cv::equalizeHist(expectedGreyFrame, expectedGreyFrame);
+
+  cv::Mat displayMismatch = displayFrame != expectedDisplayFrame;
+  cv::Mat greyMismatch = equalizedFrame != expectedGreyFrame;
+  displayDifferences = cv::countNonZero(displayMismatch.reshape(1));
+  greyDifferences = cv::countNonZero(greyMismatch);
+  output << "Pre-processing check..." << (displayDifferences == 0 && greyDifferences == 0 ? "OK" : "FAILED")
+         << " (" << preprocessVectorPath() << ", " << displayDifferences << " display and " << greyDifferences << " grey values differ)" << std::endl;
+  return displayDifferences == 0 && greyDifferences == 0;
+}
+
+#endif
@@ -0,0 +1,346 @@
+#ifndef FRAME_SOURCE_HPP
+#define FRAME_SOURCE_HPP
+
+// The camera source is only built with raspicam, which is found automatically
+// where the compiler supports __has_include, or build with -DHAVE_RASPICAM.
+// Without it the video, image directory and synthetic sources still work.
+#ifndef HAVE_RASPICAM
+#if defined(__has_include)
+#if __has_include(<raspicam/raspicam_cv.h>)
+#define HAVE_RASPICAM
+#endif
+#endif
+#endif
+
+#ifdef HAVE_RASPICAM
+#include <raspicam/raspicam_cv.h>
+#endif
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <dirent.h>
+
+// Frame sources deliver frames the way the Raspberry Pi camera does: in the
+// camera's native RGB channel order and rotated 180 degrees (the camera is
+// mounted upside down). The capture loop then converts and flips every frame
+// identically, whatever the source.
+
+// ##### Define the function to convert an upright BGR image to the camera's native layout
+inline void convertToCameraNative(cv::Mat &frame, int width, int height) {
+  if (frame.channels() == 1) {
+    cv::cvtColor(frame, frame, cv::COLOR_GRAY2BGR);
+  }
+  if (frame.cols != width || frame.rows != height) {
+    cv::resize(frame, frame, cv::Size(width, height));
+  }
+  cv::cvtColor(frame, frame, cv::COLOR_BGR2RGB);
+  cv::flip(frame, frame, -1);
+}
+
+// ##### Define the frame source interface
+class FrameSource {
+public:
+  virtual ~FrameSource() {}
+
+  // Open the source, returns false on failure
+  virtual bool open() = 0;
+
+  // Read the next frame, returns false once the source is exhausted
+  virtual bool read(cv::Mat &frame) = 0;
+
+  // Release the underlying device or file
+  virtual void release() = 0;
+
+  // Name of the source for log output
+  virtual std::string name() const = 0;
+};
+
+#ifdef HAVE_RASPICAM
+// ##### Define the Raspberry Pi camera frame source
+class CameraFrameSource : public FrameSource {
+public:
+  CameraFrameSource(int width, int height) : width(width), height(height) {}
+
+  bool open() {
+    // Set camera params
+    camera.set(CV_CAP_PROP_FRAME_WIDTH, width);
+    camera.set(CV_CAP_PROP_FRAME_HEIGHT, height);
+    camera.set(CV_CAP_PROP_FORMAT, CV_8UC3); // For color
+    //camera.set(CV_CAP_PROP_FPS, 10);
+    //camera.set(CV_CAP_PROP_BRIGHTNESS, 75); // 0 - 100
+    //camera.set(CV_CAP_PROP_CONTRAST, 60); // 0 - 100
+
+    return camera.open();
+  }
+
+  bool read(cv::Mat &frame) {
+    if (!camera.grab()) {
+      return false;
+    }
+    camera.retrieve(frame);
+    return true;
+  }
+
+  void release() {
+    camera.release();
+  }
+
+  std::string name() const {
+    return "camera";
+  }
+
+private:
+  raspicam::RaspiCam_Cv camera;
+  int width;
+  int height;
+};
+#endif
+
+// ##### Define the video file frame source
+class VideoFileFrameSource : public FrameSource {
+public:
+  VideoFileFrameSource(const std::string &path, int width, int height, bool loop)
+    : path(path), width(width), height(height), loop(loop) {}
+
+  bool open() {
+    return capture.open(path);
+  }
+
+  bool read(cv::Mat &frame) {
+    if (!capture.read(frame)) {
+      // Rewind to the start of the file if looping
+      if (!loop || !capture.open(path) || !capture.read(frame)) {
+        return false;
+      }
+    }
+    convertToCameraNative(frame, width, height);
+    return true;
+  }
+
+  void release() {
+    capture.release();
+  }
+
+  std::string name() const {
+    return "video:" + path;
+  }
+
+private:
+  cv::VideoCapture capture;
+  std::string path;
+  int width;
+  int height;
+  bool loop;
+};
+
+// ##### Define the image directory frame source (frames are replayed in filename order)
+class ImageDirectoryFrameSource : public FrameSource {
+public:
+  ImageDirectoryFrameSource(const std::string &path, int width, int height, bool loop)
+    : path(path), width(width), height(height), loop(loop), index(0) {}
+
+  bool open() {
+    DIR* dir;
+    dirent* pdir;
+    std::string filename, extension;
+
+    if (!path.empty() && path[path.size() - 1] != '/') {
+      path += "/";
+    }
+
+    dir = opendir(path.c_str());
+    if (dir == NULL) {
+      return false;
+    }
+    while ((pdir = readdir(dir))) {
+      filename = pdir->d_name;
+      if (filename.size() > 4) {
+        extension = filename.substr(filename.size() - 4, 4);
+        if (extension == ".jpg" || extension == ".png" || extension == ".bmp") {
+          filenames.push_back(filename);
+        }
+      }
+    }
+    closedir(dir);
+
+    std::sort(filenames.begin(), filenames.end());
+    index = 0;
+    return !filenames.empty();
+  }
+
+  bool read(cv::Mat &frame) {
+    if (index >= filenames.size()) {
+      if (!loop || filenames.empty()) {
+        return false;
+      }
+      index = 0;
+    }
+    frame = cv::imread(path + filenames[index++], CV_LOAD_IMAGE_COLOR);
+    if (frame.empty()) {
+      return false;
+    }
+    convertToCameraNative(frame, width, height);
+    return true;
+  }
+
+  void release() {
+    filenames.clear();
+  }
+
+  std::string name() const {
+    return "images:" + path;
+  }
+
+private:
+  std::string path;
+  std::vector<std::string> filenames;
+  int width;
+  int height;
+  bool loop;
+  size_t index;
+};
+
+// ##### Define the synthetic frame source (deterministic moving face-like pattern)
+class SyntheticFrameSource : public FrameSource {
+public:
+  SyntheticFrameSource(int width, int height, size_t frameLimit)
+    : width(width), height(height), frameLimit(frameLimit), frameNumber(0) {}
+
+  bool open() {
+    if (width <= 0 || height <= 0) {
+      std::cerr << "Invalid synthetic frame size!..." << width << "x" << height << std::endl;
+      return false;
+    }
+    frameNumber = 0;
+    background.create(height, width, CV_8UC3);
+    for (int y = 0; y < height; y++) {
+      uchar *row = background.ptr<uchar>(y);
+      for (int x = 0; x < width; x++) {
+        row[x * 3 + 0] = (uchar)(64 + (x * 64) / width);
+        row[x * 3 + 1] = (uchar)(64 + (y * 64) / height);
+        row[x * 3 + 2] = (uchar)(96 + ((x + y) * 32) / (width + height));
+      }
+    }
+    return true;
+  }
+
+  bool read(cv::Mat &frame) {
+    if (frameLimit > 0 && frameNumber >= frameLimit) {
+      return false;
+    }
+
+    // Move a head shape across the frame, one pixel per frame, bouncing at the edges. A frame too narrow for the head to move still moves it by a pixel.
+    int faceSize = height / 3;
+    int travel = std::max(width - faceSize, 1);
+    int offset = (int)(frameNumber % (size_t)(travel * 2));
+    int x = offset < travel ? offset : travel * 2 - offset;
+    int y = (height - faceSize) / 2;
+    cv::Point center(x + faceSize / 2, y + faceSize / 2);
+    cv::Size eyeSize(faceSize / 10, faceSize / 14);
+
+    background.copyTo(frame);
+    cv::ellipse(frame, center, cv::Size(faceSize * 2 / 5, faceSize / 2), 0, 0, 360, cv::Scalar(150, 180, 220), -1, 8, 0);
+    cv::ellipse(frame, center + cv::Point(-faceSize / 6, -faceSize / 8), eyeSize, 0, 0, 360, cv::Scalar(40, 40, 40), -1, 8, 0);
+    cv::ellipse(frame, center + cv::Point(faceSize / 6, -faceSize / 8), eyeSize, 0, 0, 360, cv::Scalar(40, 40, 40), -1, 8, 0);
+    cv::rectangle(frame, center + cv::Point(-faceSize / 20, -faceSize / 20), center + cv::Point(faceSize / 20, faceSize / 10), cv::Scalar(110, 140, 180), -1, 8, 0);
+    cv::ellipse(frame, center + cv::Point(0, faceSize / 4), cv::Size(faceSize / 6, faceSize / 20), 0, 0, 360, cv::Scalar(60, 60, 140), -1, 8, 0);
+
+    frameNumber++;
+    convertToCameraNative(frame, width, height);
+    return true;
+  }
+
+  void release() {
+    background.release();
+  }
+
+  std::string name() const {
+    return "synthetic";
+  }
+
+private:
+  cv::Mat background;
+  int width;
+  int height;
+  size_t frameLimit;
+  size_t frameNumber;
+};
+
+// ##### Define the in-memory frame source (replays a preloaded clip, used by the benchmark)
+class MemoryFrameSource : public FrameSource {
+public:
+  MemoryFrameSource(const std::vector<cv::Mat> &frames, size_t frameLimit)
+    : frames(frames), frameLimit(frameLimit), frameNumber(0) {}
+
+  bool open() {
+    frameNumber = 0;
+    return !frames.empty();
+  }
+
+  bool read(cv::Mat &frame) {
+    if (frameNumber >= frameLimit) {
+      return false;
+    }
+    // Copy so that drawing on the frame never modifies the clip
+    frames[frameNumber++ % frames.size()].copyTo(frame);
+    return true;
+  }
+
+  void release() {
+  }
+
+  std::string name() const {
+    return "memory";
+  }
+
+private:
+  std::vector<cv::Mat> frames;
+  size_t frameLimit;
+  size_t frameNumber;
+};
+
+// ##### Define the function to create a frame source from a specification string
+// camera | video:<file> | images:<directory> | synthetic[:<frames>]
+inline std::unique_ptr<FrameSource> createFrameSource(const std::string &specification, int width, int height, bool loop) {
+  size_t colonPosition = specification.find(':');
+  std::string type = specification.substr(0, colonPosition);
+  std::string argument = colonPosition == std::string::npos ? "" : specification.substr(colonPosition + 1);
+
+  if (type == "camera") {
+#ifdef HAVE_RASPICAM
+    return std::unique_ptr<FrameSource>(new CameraFrameSource(width, height));
+#else
+    std::cerr << "Camera frame source not available, built without raspicam!..." << specification << std::endl;
+    return std::unique_ptr<FrameSource>();
+#endif
+  }
+  if (type == "video" && !argument.empty()) {
+    return std::unique_ptr<FrameSource>(new VideoFileFrameSource(argument, width, height, loop));
+  }
+  if (type == "images" && !argument.empty()) {
+    return std::unique_ptr<FrameSource>(new ImageDirectoryFrameSource(argument, width, height, loop));
+  }
+  if (type == "synthetic") {
+    // The frame count must be a whole number, 0 or none for no limit
+    char *end = NULL;
+    errno = 0;
+    unsigned long frameLimit = argument.empty() ? 0 : strtoul(argument.c_str(), &end, 10);
+    if (!argument.empty() && (errno != 0 || *end != '\0' || argument[0] == '-')) {
+      std::cerr << "Error in synthetic frame count!...usage synthetic[:<frames>] " << specification << std::endl;
+      return std::unique_ptr<FrameSource>();
+    }
+    return std::unique_ptr<FrameSource>(new SyntheticFrameSource(width, height, (size_t)frameLimit));
+  }
+
+  std::cerr << "Unknown frame source..." << specification << std::endl;
+  return std::unique_ptr<FrameSource>();
+}
+
+#endif
@@ -0,0 +1,183 @@
+#ifndef GPIO_HPP
+#define GPIO_HPP
+
+// The wiringPi GPIO is only built with wiringPi, which is found automatically
+// where the compiler supports __has_include, or build with -DHAVE_WIRINGPI.
+// Without it the simulated GPIO still works.
+#ifndef HAVE_WIRINGPI
+#if defined(__has_include)
+#if __has_include(<wiringPi.h>)
+#define HAVE_WIRINGPI
+#endif
+#endif
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#ifdef HAVE_WIRINGPI
+#include <wiringPi.h>
+#endif
+
+// ##### Define the GPIO interface (BCM pin numbers)
+class Gpio {
+public:
+  virtual ~Gpio() {}
+
+  virtual bool setup() = 0;
+  virtual void setOutput(int pin) = 0;
+  virtual void setInput(int pin) = 0;
+  virtual void write(int pin, bool high) = 0;
+  virtual bool read(int pin) = 0;
+
+  // Microseconds on a monotonic clock
+  virtual uint64_t microseconds() = 0;
+  virtual void sleepMicroseconds(unsigned int duration) = 0;
+};
+
+#ifdef HAVE_WIRINGPI
+// ##### Define the wiringPi GPIO
+class WiringPiGpio : public Gpio {
+public:
+  bool setup() {
+    return wiringPiSetupGpio() == 0;
+  }
+
+  void setOutput(int pin) {
+    pinMode(pin, OUTPUT);
+  }
+
+  void setInput(int pin) {
+    pinMode(pin, INPUT);
+  }
+
+  void write(int pin, bool high) {
+    digitalWrite(pin, high ? HIGH : LOW);
+  }
+
+  bool read(int pin) {
+    return digitalRead(pin) == HIGH;
+  }
+
+  uint64_t microseconds() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  void sleepMicroseconds(unsigned int duration) {
+    delayMicroseconds(duration);
+  }
+};
+#endif
+
+// ##### Define the simulated GPIO
+// Behaves like an HC-SR04 wired to the trigger and echo pins: a trigger pulse
+// of at least 10 microseconds raises the echo pin after a short delay and
+// holds it high for the round trip time of the simulated distance. A
+// simulated distance of zero or less means no echo comes back, and a longer
+// echo delay simulates an echo that comes back late. Time is simulated too: it
+// only moves on by a microsecond each time the pins are read and by the length
+// of each sleep, so a measurement times the echo exactly however the thread is
+// scheduled.
+class SimulatedGpio : public Gpio {
+public:
+  SimulatedGpio(int triggerGpioPin, int echoGpioPin, double distanceCentimetres)
+    : triggerGpioPin(triggerGpioPin), echoGpioPin(echoGpioPin), distance(distanceCentimetres),
+      echoDelay(450), simulatedTime(1000000), triggerHigh(false), triggerRaisedAt(0), echoStart(0), echoEnd(0) {}
+
+  // Set the simulated distance, safe to call from any thread
+  void setDistance(double distanceCentimetres) {
+    distance = distanceCentimetres;
+  }
+
+  // Set the time from the end of the trigger pulse to the start of the echo, safe to call from any thread
+  void setEchoDelay(uint64_t microseconds) {
+    echoDelay = microseconds;
+  }
+
+  bool setup() {
+    return true;
+  }
+
+  void setOutput(int) {
+  }
+
+  void setInput(int) {
+  }
+
+  void write(int pin, bool high) {
+    std::lock_guard<std::mutex> lock(mutex);
+    uint64_t now = microseconds();
+
+    if (pin != triggerGpioPin) {
+      return;
+    }
+    if (high && !triggerHigh) {
+      triggerRaisedAt = now;
+    }
+    // The burst goes out on the falling edge of a long enough trigger pulse
+    if (!high && triggerHigh && now - triggerRaisedAt >= 10) {
+      double centimetres = distance.load();
+      if (centimetres > 0) {
+        echoStart = now + echoDelay;
+        echoEnd = echoStart + (uint64_t)(centimetres * 2.0 / speedOfSoundCentimetresPerMicrosecond);
+      }
+      else {
+        echoStart = echoEnd = 0;
+      }
+    }
+    triggerHigh = high;
+  }
+
+  bool read(int pin) {
+    std::lock_guard<std::mutex> lock(mutex);
+    uint64_t now = ++simulatedTime;
+    return pin == echoGpioPin && echoStart != 0 && now >= echoStart && now < echoEnd;
+  }
+
+  uint64_t microseconds() {
+    return simulatedTime.load();
+  }
+
+  void sleepMicroseconds(unsigned int duration) {
+    simulatedTime += duration;
+  }
+
+private:
+  static constexpr double speedOfSoundCentimetresPerMicrosecond = 0.034029;
+
+  int triggerGpioPin;
+  int echoGpioPin;
+  std::atomic<double> distance;
+  std::atomic<uint64_t> echoDelay;   // Microseconds, the sensor takes about 450 to send the burst
+  std::atomic<uint64_t> simulatedTime;   // Microseconds
+  std::mutex mutex;
+  bool triggerHigh;
+  uint64_t triggerRaisedAt;
+  uint64_t echoStart;
+  uint64_t echoEnd;
+};
+
+// ##### Define the function to create a GPIO from its type
+// gpio | sim, the simulated distance is only used by sim
+inline std::unique_ptr<Gpio> createGpio(const std::string &type, int triggerGpioPin, int echoGpioPin, double simulatedDistanceCentimetres) {
+  if (type == "sim") {
+    return std::unique_ptr<Gpio>(new SimulatedGpio(triggerGpioPin, echoGpioPin, simulatedDistanceCentimetres));
+  }
+  if (type == "gpio") {
+#ifdef HAVE_WIRINGPI
+    return std::unique_ptr<Gpio>(new WiringPiGpio());
+#else
+    std::cerr << "GPIO not available, built without wiringPi!..." << type << std::endl;
+    return std::unique_ptr<Gpio>();
+#endif
+  }
+
+  std::cerr << "Unknown ultrasonic sensor..." << type << std::endl;
+  return std::unique_ptr<Gpio>();
+}
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef HASH_HPP
+#define HASH_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// ##### Define the function to add bytes to a 64-bit FNV-1a hash
+inline uint64_t hashBytes(uint64_t hash, const char *bytes, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (unsigned char)bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// ##### Define the function to format a hash as hexadecimal (FileStorage cannot hold 64-bit integers)
+inline std::string formatHash(uint64_t hash) {
+  char formatted[17];
+  snprintf(formatted, sizeof(formatted), "%016llx", (unsigned long long)hash);
+  return formatted;
+}
+
+#endif
@@ -0,0 +1,150 @@
+#ifndef LOAD_GOVERNOR_HPP
+#define LOAD_GOVERNOR_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// ##### Define the governor level (the detection work done at one level of load)
+struct GovernorLevel {
+  int detectionInterval;
+  double faceDownscale;
+  bool featureStages;     // Search for the eyes and nose, without them every face found is used
+};
+
+// ##### Define the load governor
+// Holds the capture loop within a frame time budget by scaling the detection
+// work. Every evaluation period the p95 frame time, not counting the wait for
+// the camera, and the p95 detection time are compared with the budget; a
+// detection is over budget when it takes longer than the frames between
+// detections. Over budget the governor steps down one level, each doing less
+// detection work than the last: a longer detection interval, then a larger
+// downscale, then no eye and nose search. It only steps back up after a few
+// periods in a row comfortably within the budget of the level above, so it
+// does not swing between two levels. The name, if any, is the stream the
+// decisions logged are for.
+class LoadGovernor {
+public:
+  LoadGovernor(double frameBudgetMilliseconds, int detectionInterval, double faceDownscale, const std::string &name = "", double evaluationSeconds = 1.0)
+    : name(name), frameBudget(frameBudgetMilliseconds), evaluationPeriod(evaluationSeconds), currentLevel(0), calmPeriods(0),
+      restoreFraction(0.7), restorePeriods(3), framePercentile(0.0), detectionPercentile(0.0), evaluationStart(std::chrono::steady_clock::now()) {
+    int interval = std::max(detectionInterval, 1);
+    double downscale = std::max(faceDownscale, 1.0);
+    GovernorLevel ladder[] = {
+      { interval, downscale, true },
+      { interval * 2, downscale, true },
+      { interval * 2, downscale + 1.0, true },
+      { interval * 4, downscale + 1.0, true },
+      { interval * 4, downscale + 1.0, false },
+      { interval * 8, downscale + 2.0, false }
+    };
+    levels.assign(ladder, ladder + sizeof(ladder) / sizeof(ladder[0]));
+    frameTimes.reserve(512);
+    detectionTimes.reserve(128);
+  }
+
+  void recordFrame(std::chrono::steady_clock::duration duration) {
+    frameTimes.push_back(std::chrono::duration<double, std::milli>(duration).count());
+  }
+
+  void recordDetection(std::chrono::steady_clock::duration duration) {
+    detectionTimes.push_back(std::chrono::duration<double, std::milli>(duration).count());
+  }
+
+  // Evaluate the last period once it is over, returns true when the level has changed
+  bool update(std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now()) {
+    if (now - evaluationStart < std::chrono::duration<double>(evaluationPeriod) || frameTimes.empty()) {
+      return false;
+    }
+    evaluationStart = now;
+    framePercentile = percentile(frameTimes, 95);
+    detectionPercentile = percentile(detectionTimes, 95);
+    frameTimes.clear();
+    detectionTimes.clear();
+
+    // Step down as soon as a period is over budget
+    if (framePercentile > frameBudget || detectionPercentile > detectionBudget(currentLevel)) {
+      calmPeriods = 0;
+      if (currentLevel + 1 < (int)levels.size()) {
+        currentLevel++;
+        log("over budget");
+        return true;
+      }
+      return false;
+    }
+
+    // Step up after enough periods with headroom at the level above
+    if (currentLevel > 0 && framePercentile < frameBudget * restoreFraction && detectionPercentile < detectionBudget(currentLevel - 1) * restoreFraction) {
+      if (++calmPeriods >= restorePeriods) {
+        calmPeriods = 0;
+        currentLevel--;
+        log("headroom");
+        return true;
+      }
+    }
+    else {
+      calmPeriods = 0;
+    }
+    return false;
+  }
+
+  const GovernorLevel &current() const {
+    return levels[currentLevel];
+  }
+
+  int level() const {
+    return currentLevel;
+  }
+
+  // Describe the current level for the statistics
+  std::string describe() const {
+    char text[128];
+    snprintf(text, sizeof(text), "%d interval=%d downscale=%.1f features=%s",
+             currentLevel, levels[currentLevel].detectionInterval, levels[currentLevel].faceDownscale, levels[currentLevel].featureStages ? "on" : "off");
+    return text;
+  }
+
+private:
+  // A detection has the frames until the next detection is due to finish in
+  double detectionBudget(int level) const {
+    return frameBudget * levels[level].detectionInterval;
+  }
+
+  void log(const char *reason) const {
+    const GovernorLevel &settings = levels[currentLevel];
+    char text[256];
+    snprintf(text, sizeof(text), "Load governor...%s%slevel %d of %d (%s, frame p95 %.1fms, detection p95 %.1fms, budget %.1fms): detection interval %d, downscale %.1f, eyes and nose %s",
+             name.c_str(), name.empty() ? "" : " ", currentLevel, (int)levels.size() - 1, reason, framePercentile, detectionPercentile, frameBudget,
+             settings.detectionInterval, settings.faceDownscale, settings.featureStages ? "on" : "off");
+    std::cout << text << std::endl;
+  }
+
+  // Nearest-rank percentile, sorts the samples in place
+  static double percentile(std::vector<double> &samples, double percent) {
+    if (samples.empty()) {
+      return 0.0;
+    }
+    size_t rank = std::min(std::max((size_t)(percent / 100.0 * samples.size() + 0.5), (size_t)1), samples.size());
+    std::nth_element(samples.begin(), samples.begin() + (rank - 1), samples.end());
+    return samples[rank - 1];
+  }
+
+  std::string name;
+  double frameBudget;
+  double evaluationPeriod;
+  int currentLevel;
+  int calmPeriods;
+  double restoreFraction;
+  int restorePeriods;
+  double framePercentile;
+  double detectionPercentile;
+  std::chrono::steady_clock::time_point evaluationStart;
+  std::vector<GovernorLevel> levels;
+  std::vector<double> frameTimes;
+  std::vector<double> detectionTimes;
+};
+
+#endif
@@ -0,0 +1,308 @@
+#ifndef MJPEG_SERVER_HPP
+#define MJPEG_SERVER_HPP
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "pipeline-stats.hpp"
+
+// ##### Define the MJPEG streaming server
+// Serves the frames as a multipart/x-mixed-replace JPEG stream over HTTP, the
+// format browsers and MJPG-streamer clients understand. The capture loop only
+// copies the frame into a slot, an encoder thread compresses it once and every
+// client thread sends that same buffer. A client that is still sending when
+// newer frames arrive simply skips to the latest one, so slow clients drop
+// frames instead of holding up capture. Nothing is encoded while nobody is
+// connected. Each client has its own thread, so only a few are served at
+// once and any more are answered with 503 Service Unavailable.
+class MjpegServer {
+public:
+  // The encoding times are recorded in the statistics if given
+  explicit MjpegServer(PipelineStats *pipelineStats = NULL, size_t maximumClients = 8)
+    : pipelineStats(pipelineStats), maximumClients(std::max(maximumClients, (size_t)1)), listenSocket(-1), stopping(false), framePending(false), frameSequence(0),
+      clientCount(0), jpegQuality(80), framesReplaced(0), clientsRejected(0) {}
+
+  ~MjpegServer() {
+    stop();
+  }
+
+  // Start listening on the port, returns false if the socket cannot be bound
+  bool start(int port, int quality) {
+    sockaddr_in address;
+    int reuse = 1;
+
+    jpegQuality = quality;
+    listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenSocket < 0) {
+      return false;
+    }
+    setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons((uint16_t)port);
+    if (bind(listenSocket, (sockaddr *)&address, sizeof(address)) < 0 || listen(listenSocket, 8) < 0) {
+      close(listenSocket);
+      listenSocket = -1;
+      return false;
+    }
+
+    stopping = false;
+    acceptThread = std::thread(&MjpegServer::acceptClients, this);
+    encoderThread = std::thread(&MjpegServer::encodeFrames, this);
+    return true;
+  }
+
+  // Stop the server and disconnect every client
+  void stop() {
+    if (listenSocket < 0) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    frameCondition.notify_all();
+    shutdown(listenSocket, SHUT_RDWR);
+    acceptThread.join();
+    encoderThread.join();
+    close(listenSocket);
+    listenSocket = -1;
+
+    for (std::list<Client>::iterator client = clients.begin(); client != clients.end(); ++client) {
+      shutdown(client->socket, SHUT_RDWR);
+      client->thread.join();
+      close(client->socket);
+    }
+    clients.clear();
+  }
+
+  // Hand a frame to the encoder thread, a frame that has not been encoded yet is replaced
+  // The frame is shared, not copied, so the caller must not draw on it again
+  void publish(const cv::Mat &frame) {
+    if (clientCount.load() == 0) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (framePending) {
+        framesReplaced++;
+      }
+      pendingFrame = frame;
+      framePending = true;
+    }
+    frameCondition.notify_all();
+  }
+
+  int clientsConnected() const {
+    return clientCount.load();
+  }
+
+  // Number of frames replaced before the encoder got to them
+  size_t replaced() const {
+    return framesReplaced.load();
+  }
+
+  // Number of clients turned away because the server was full
+  size_t rejected() const {
+    return clientsRejected.load();
+  }
+
+private:
+  struct Client {
+    Client() : socket(-1), finished(false) {}
+
+    int socket;
+    std::thread thread;
+    std::atomic<bool> finished;
+  };
+
+  // ##### Define the thread to accept client connections
+  void acceptClients() {
+    int clientSocket;
+    int errorDelay = 0;   // Milliseconds
+
+    for (;;) {
+      clientSocket = accept(listenSocket, NULL, NULL);
+      if (clientSocket < 0) {
+        if (stopping) {
+          return;
+        }
+        // Back off on errors that persist, such as running out of file descriptors, instead of spinning
+        if (errno != EINTR && errno != ECONNABORTED) {
+          errorDelay = std::min(std::max(errorDelay * 2, 10), 1000);
+          std::this_thread::sleep_for(std::chrono::milliseconds(errorDelay));
+        }
+        continue;
+      }
+      errorDelay = 0;
+
+      // Clean up the clients that have disconnected
+      for (std::list<Client>::iterator client = clients.begin(); client != clients.end();) {
+        if (client->finished) {
+          client->thread.join();
+          close(client->socket);
+          client = clients.erase(client);
+        }
+        else {
+          ++client;
+        }
+      }
+
+      // Turn the client away when every slot is taken, the reply fits the socket buffer so this never blocks
+      if (clients.size() >= maximumClients) {
+        rejectClient(clientSocket);
+        continue;
+      }
+
+      clients.emplace_back();
+      clients.back().socket = clientSocket;
+      clients.back().thread = std::thread(&MjpegServer::serveClient, this, &clients.back());
+    }
+  }
+
+  // ##### Define the encoder thread
+  void encodeFrames() {
+    cv::Mat encodeFrame;
+    std::vector<int> encodeParameters;
+    encodeParameters.push_back(CV_IMWRITE_JPEG_QUALITY);
+    encodeParameters.push_back(jpegQuality);
+
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        frameCondition.wait(lock, [&] { return stopping || framePending; });
+        if (stopping) {
+          return;
+        }
+        // Swap rather than copy, the next publish reuses the other buffer
+        cv::swap(pendingFrame, encodeFrame);
+        framePending = false;
+      }
+
+      std::shared_ptr<std::vector<uchar> > jpeg(new std::vector<uchar>());
+      std::chrono::steady_clock::time_point encodeStart = std::chrono::steady_clock::now();
+      cv::imencode(".jpg", encodeFrame, *jpeg, encodeParameters);
+      if (pipelineStats != NULL) {
+        pipelineStats->record(stageEncode, encodeStart);
+      }
+      encodeFrame.release();
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        latestJpeg = jpeg;
+        frameSequence++;
+      }
+      frameCondition.notify_all();
+    }
+  }
+
+  // ##### Define the client thread
+  void serveClient(Client *client) {
+    char request[1024];
+    std::string header;
+    std::shared_ptr<std::vector<uchar> > jpeg;
+    size_t sentSequence = 0;
+    timeval timeout = { 5, 0 };
+
+    clientCount++;
+
+    // Read and ignore the request, every path gets the stream, a client that sends nothing is dropped after a few seconds
+    setsockopt(client->socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    header = "HTTP/1.0 200 OK\r\n"
+             "Cache-Control: no-cache\r\n"
+             "Pragma: no-cache\r\n"
+             "Connection: close\r\n"
+             "Content-Type: multipart/x-mixed-replace; boundary=frame\r\n\r\n";
+    bool connected = recv(client->socket, request, sizeof(request), 0) > 0
+                  && sendAll(client->socket, header.data(), header.size());
+
+    while (connected) {
+      // Wait for a frame newer than the last one sent, frames in between are skipped
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        frameCondition.wait(lock, [&] { return stopping || frameSequence != sentSequence; });
+        if (stopping) {
+          break;
+        }
+        jpeg = latestJpeg;
+        sentSequence = frameSequence;
+      }
+
+      header = "--frame\r\nContent-Type: image/jpeg\r\nContent-Length: " + std::to_string(jpeg->size()) + "\r\n\r\n";
+      connected = sendAll(client->socket, header.data(), header.size())
+               && sendAll(client->socket, (const char *)&(*jpeg)[0], jpeg->size())
+               && sendAll(client->socket, "\r\n", 2);
+    }
+
+    clientCount--;
+    client->finished = true;
+  }
+
+  // ##### Define the function to answer a client with 503 and close it
+  void rejectClient(int clientSocket) {
+    static const char response[] = "HTTP/1.0 503 Service Unavailable\r\n"
+                                   "Connection: close\r\n"
+                                   "Content-Type: text/plain\r\n\r\n"
+                                   "Too many clients\r\n";
+    char request[1024];
+
+    send(clientSocket, response, sizeof(response) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+    // Drain what the client has sent already, closing with unread data would reset the connection before it reads the reply
+    while (recv(clientSocket, request, sizeof(request), MSG_DONTWAIT) > 0) {
+    }
+    shutdown(clientSocket, SHUT_WR);
+    close(clientSocket);
+    clientsRejected++;
+  }
+
+  static bool sendAll(int socket, const char *data, size_t length) {
+    ssize_t sent;
+    while (length > 0) {
+      sent = send(socket, data, length, MSG_NOSIGNAL);
+      if (sent <= 0) {
+        return false;
+      }
+      data += sent;
+      length -= (size_t)sent;
+    }
+    return true;
+  }
+
+  PipelineStats *pipelineStats;
+  size_t maximumClients;
+  int listenSocket;
+  std::thread acceptThread;
+  std::thread encoderThread;
+  std::list<Client> clients;
+  std::mutex mutex;
+  std::condition_variable frameCondition;
+  std::atomic<bool> stopping;
+  bool framePending;
+  size_t frameSequence;
+  std::atomic<int> clientCount;
+  int jpegQuality;
+  std::atomic<size_t> framesReplaced;
+  std::atomic<size_t> clientsRejected;
+  cv::Mat pendingFrame;
+  std::shared_ptr<std::vector<uchar> > latestJpeg;
+};
+
+#endif
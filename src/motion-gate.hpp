@@ -0,0 +1,155 @@
+#ifndef MOTION_GATE_HPP
+#define MOTION_GATE_HPP
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include "face-detection.hpp"
+
+// ##### Define the motion gate
+// Compares a heavily downscaled greyscale frame with a running background, so
+// face detection only starts when something in the view moves and only
+// searches the parts that changed. The background is kept in 8.8 fixed point
+// and follows the frame at 1/32 per frame, a change that stays put fades into
+// it within a few seconds. The changed pixels are grouped into up to
+// maxSearchRegions column bands, each mapped back to full resolution with a
+// margin, and the gate stays open for the cool-down after the last motion.
+class MotionGate {
+public:
+  MotionGate(int downscale, int threshold, double minimumArea, double coolDownSeconds, int margin)
+    : downscale(std::max(downscale, 1)), threshold(std::max(threshold, 1)), minimumArea(minimumArea), coolDown(coolDownSeconds),
+      margin(std::max(margin, 0)), changedPixels(0), regionCount(0), initialised(false) {}
+
+  // Compare the frame with the background, returns true while the gate is open
+  bool update(const cv::Mat &frameGrey) {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    cv::Size smallSize(std::max(frameGrey.cols / downscale, 1), std::max(frameGrey.rows / downscale, 1));
+
+    cv::resize(frameGrey, frameSmall, smallSize, 0, 0, cv::INTER_AREA);
+    frameSize = frameGrey.size();
+
+    // Start from the first frame, searching all of it for the cool-down
+    if (!initialised || background.size() != smallSize) {
+      frameSmall.convertTo(background, CV_16UC1, 256.0);
+      columnTop.assign(smallSize.width, 0);
+      columnBottom.assign(smallSize.width, -1);
+      initialised = true;
+      lastMotionTime = now;
+      regionCount = 1;
+      regions[0] = cv::Rect(0, 0, frameGrey.cols, frameGrey.rows);
+      return true;
+    }
+
+    // Difference, threshold and update the background in one pass, keeping the top and bottom changed row of each column
+    std::fill(columnBottom.begin(), columnBottom.end(), -1);
+    changedPixels = 0;
+    for (int y = 0; y < frameSmall.rows; y++) {
+      const uchar *pixel = frameSmall.ptr(y);
+      uint16_t *backgroundPixel = background.ptr<uint16_t>(y);
+      for (int x = 0; x < frameSmall.cols; x++) {
+        int value = pixel[x] << 8;
+        int difference = value - backgroundPixel[x];
+        if (std::abs(difference) >= threshold << 8) {
+          if (columnBottom[x] < 0) {
+            columnTop[x] = y;
+          }
+          columnBottom[x] = y;
+          changedPixels++;
+        }
+        backgroundPixel[x] = (uint16_t)(backgroundPixel[x] + (difference >> 5));
+      }
+    }
+
+    if (changedPixels >= std::max((int)(minimumArea * frameSmall.total()), 1)) {
+      lastMotionTime = now;
+      findRegions();
+    }
+    return open(now);
+  }
+
+  // True while there has been motion within the cool-down
+  bool open(std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now()) const {
+    return initialised && std::chrono::duration<double>(now - lastMotionTime).count() <= coolDown;
+  }
+
+  // The full resolution regions that changed at the last motion, with the margin added
+  int regionsFound() const {
+    return regionCount;
+  }
+
+  const cv::Rect &region(int i) const {
+    return regions[i];
+  }
+
+  // Changed pixels of the downscaled frame at the last update
+  int changed() const {
+    return changedPixels;
+  }
+
+private:
+  // Group the changed columns into bands, splitting where there is a gap wider than the margin
+  void findRegions() {
+    int gap = std::max(margin / downscale, 1);
+    int start = -1, end = -1;
+
+    regionCount = 0;
+    for (int x = 0; x < (int)columnBottom.size(); x++) {
+      if (columnBottom[x] < 0) {
+        continue;
+      }
+      if (start >= 0 && x - end > gap) {
+        addRegion(start, end);
+        start = -1;
+      }
+      if (start < 0) {
+        start = x;
+      }
+      end = x;
+    }
+    if (start >= 0) {
+      addRegion(start, end);
+    }
+  }
+
+  // Add a band with the rows that changed in it, the last region takes in any bands beyond the limit
+  void addRegion(int start, int end) {
+    int top = frameSmall.rows, bottom = -1;
+    for (int x = start; x <= end; x++) {
+      if (columnBottom[x] >= 0) {
+        top = std::min(top, columnTop[x]);
+        bottom = std::max(bottom, columnBottom[x]);
+      }
+    }
+
+    cv::Rect region(start * downscale - margin, top * downscale - margin, (end - start + 1) * downscale + margin * 2, (bottom - top + 1) * downscale + margin * 2);
+    region &= cv::Rect(0, 0, frameSize.width, frameSize.height);
+    if (regionCount < maxSearchRegions) {
+      regions[regionCount++] = region;
+    }
+    else {
+      regions[maxSearchRegions - 1] |= region;
+    }
+  }
+
+  int downscale;
+  int threshold;
+  double minimumArea;
+  double coolDown;
+  int margin;
+  int changedPixels;
+  int regionCount;
+  bool initialised;
+  cv::Size frameSize;
+  cv::Rect regions[maxSearchRegions];
+  std::chrono::steady_clock::time_point lastMotionTime;
+  std::vector<int> columnTop;
+  std::vector<int> columnBottom;
+  cv::Mat frameSmall;
+  cv::Mat background;
+};
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef OVERLAY_RENDERER_HPP
+#define OVERLAY_RENDERER_HPP
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <algorithm>
+#include <string>
+#include <vector>
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// ##### Define the function to blend one row of a sprite onto a frame
+// Each byte becomes (colour * alpha + frame * (255 - alpha)) / 255, rounded.
+// The sprite alpha and colour are already expanded to one byte per channel,
+// so a row is a plain run of bytes.
+inline void blendOverlayRow(uchar *frame, const uchar *alpha, const uchar *colour, int length) {
+  int i = 0;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+  for (; i + 16 <= length; i += 16) {
+    uint8x16_t a = vld1q_u8(alpha + i);
+    uint8x16_t c = vld1q_u8(colour + i);
+    uint8x16_t f = vld1q_u8(frame + i);
+    uint8x16_t inverse = vmvnq_u8(a);
+    uint16x8_t low = vmlal_u8(vmull_u8(vget_low_u8(a), vget_low_u8(c)), vget_low_u8(inverse), vget_low_u8(f));
+    uint16x8_t high = vmlal_u8(vmull_u8(vget_high_u8(a), vget_high_u8(c)), vget_high_u8(inverse), vget_high_u8(f));
+
+    // Divide by 255 with rounding
+    vst1q_u8(frame + i, vcombine_u8(vraddhn_u16(low, vrshrq_n_u16(low, 8)), vraddhn_u16(high, vrshrq_n_u16(high, 8))));
+  }
+#elif defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i full = _mm_set1_epi16(255);
+  const __m128i rounding = _mm_set1_epi16(128);
+
+  for (; i + 16 <= length; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(alpha + i));
+    __m128i c = _mm_loadu_si128((const __m128i *)(colour + i));
+    __m128i f = _mm_loadu_si128((const __m128i *)(frame + i));
+    __m128i halves[2];
+
+    for (int half = 0; half < 2; half++) {
+      __m128i aWords = half == 0 ? _mm_unpacklo_epi8(a, zero) : _mm_unpackhi_epi8(a, zero);
+      __m128i cWords = half == 0 ? _mm_unpacklo_epi8(c, zero) : _mm_unpackhi_epi8(c, zero);
+      __m128i fWords = half == 0 ? _mm_unpacklo_epi8(f, zero) : _mm_unpackhi_epi8(f, zero);
+      __m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(aWords, cWords), _mm_mullo_epi16(_mm_sub_epi16(full, aWords), fWords)), rounding);
+
+      // Divide by 255 with rounding
+      halves[half] = _mm_srli_epi16(_mm_add_epi16(sum, _mm_srli_epi16(sum, 8)), 8);
+    }
+    _mm_storeu_si128((__m128i *)(frame + i), _mm_packus_epi16(halves[0], halves[1]));
+  }
+#endif
+
+  // Scalar fallback, also handles the bytes left over by the vector loops
+  for (; i < length; i++) {
+    unsigned int sum = alpha[i] * colour[i] + (255 - alpha[i]) * frame[i] + 128;
+    frame[i] = (uchar)((sum + (sum >> 8)) >> 8);
+  }
+}
+
+// ##### Define the overlay sprite (a text field rendered once)
+struct OverlaySprite {
+  OverlaySprite() : fontScale(0.0), baseline(0) {}
+
+  std::string text;
+  double fontScale;
+  cv::Size textSize;    // As returned by cv::getTextSize
+  int baseline;
+  cv::Mat alpha;        // Coverage, expanded to three channels
+  cv::Mat colour;       // Text colour, expanded to the sprite size
+};
+
+// ##### Define the overlay renderer
+// Keeps one sprite per text field. A field is only rasterized again when its
+// text or size changes, which for most fields is at most once a second, and
+// every frame the sprites are alpha blended onto the frame.
+class OverlayRenderer {
+public:
+  OverlayRenderer(int font, const cv::Scalar &colour, int lineThickness, int lineType)
+    : font(font), colour(colour), lineThickness(lineThickness), lineType(lineType), padding(lineThickness + 1) {}
+
+  // Set the text of a field and return its size, the same as cv::getTextSize
+  const cv::Size &prepare(size_t field, const std::string &text, double fontScale) {
+    if (field >= sprites.size()) {
+      sprites.resize(field + 1);
+    }
+    OverlaySprite &sprite = sprites[field];
+    if (sprite.alpha.empty() || sprite.text != text || sprite.fontScale != fontScale) {
+      render(sprite, text, fontScale);
+    }
+    return sprite.textSize;
+  }
+
+  // Blend a prepared field onto the frame, the origin is the bottom left of the text as for cv::putText
+  void draw(cv::Mat &frame, size_t field, cv::Point origin) const {
+    if (field >= sprites.size() || sprites[field].alpha.empty()) {
+      return;
+    }
+    const OverlaySprite &sprite = sprites[field];
+    cv::Rect spriteRect(origin.x - padding, origin.y - sprite.textSize.height - padding, sprite.alpha.cols / 3, sprite.alpha.rows);
+    cv::Rect visibleRect = spriteRect & cv::Rect(0, 0, frame.cols, frame.rows);
+    if (visibleRect.area() == 0) {
+      return;
+    }
+
+    // Blend the part of the sprite inside the frame
+    int spriteX = (visibleRect.x - spriteRect.x) * 3;
+    for (int y = 0; y < visibleRect.height; y++) {
+      int spriteY = visibleRect.y - spriteRect.y + y;
+      blendOverlayRow(frame.ptr(visibleRect.y + y) + visibleRect.x * 3, sprite.alpha.ptr(spriteY) + spriteX, sprite.colour.ptr(spriteY) + spriteX, visibleRect.width * 3);
+    }
+  }
+
+  // Prepare and draw a field in one call
+  void drawText(cv::Mat &frame, size_t field, const std::string &text, double fontScale, cv::Point origin) {
+    prepare(field, text, fontScale);
+    draw(frame, field, origin);
+  }
+
+private:
+  // ##### Define the function to rasterize a field into its sprite
+  void render(OverlaySprite &sprite, const std::string &text, double fontScale) {
+    cv::Mat planes[3];
+
+    sprite.text = text;
+    sprite.fontScale = fontScale;
+    sprite.baseline = 0;
+    sprite.textSize = cv::getTextSize(text, font, fontScale, lineThickness, &sprite.baseline);
+
+    // Draw the text in white on black to get its antialiased coverage
+    coverage.create(sprite.textSize.height + sprite.baseline + padding * 2, sprite.textSize.width + padding * 2, CV_8UC1);
+    coverage.setTo(cv::Scalar(0));
+    cv::putText(coverage, text, cv::Point(padding, padding + sprite.textSize.height), font, fontScale, cv::Scalar(255), lineThickness, lineType);
+
+    planes[0] = planes[1] = planes[2] = coverage;
+    cv::merge(planes, 3, sprite.alpha);
+    sprite.colour.create(coverage.rows, coverage.cols, CV_8UC3);
+    sprite.colour.setTo(colour);
+  }
+
+  int font;
+  cv::Scalar colour;
+  int lineThickness;
+  int lineType;
+  int padding;
+  std::vector<OverlaySprite> sprites;
+  cv::Mat coverage;
+};
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef PIPELINE_BENCHMARK_HPP
+#define PIPELINE_BENCHMARK_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+// ##### Define the pipeline benchmark (records the latency of every frame pushed through the capture loop)
+class PipelineBenchmark {
+public:
+  void reserve(size_t frames) {
+    frameLatencies.reserve(frames);
+  }
+
+  void clear() {
+    frameLatencies.clear();
+  }
+
+  void start() {
+    runStart = std::chrono::steady_clock::now();
+  }
+
+  void startFrame() {
+    frameStart = std::chrono::steady_clock::now();
+  }
+
+  void endFrame() {
+    frameLatencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count());
+  }
+
+  void stop() {
+    runEnd = std::chrono::steady_clock::now();
+  }
+
+  // Output the report, the final BENCHMARK line is kept on one line so runs can be compared with grep
+  void report(std::ostream &out) const {
+    std::vector<double> sorted(frameLatencies);
+    double totalSeconds = std::chrono::duration<double>(runEnd - runStart).count();
+    double mean = 0.0;
+
+    std::sort(sorted.begin(), sorted.end());
+    for (size_t i = 0; i < sorted.size(); i++) {
+      mean += sorted[i];
+    }
+    if (!sorted.empty()) {
+      mean /= sorted.size();
+    }
+
+    out << std::fixed << std::setprecision(2);
+    out << "Benchmark frames..." << sorted.size() << std::endl;
+    out << "Benchmark seconds..." << totalSeconds << std::endl;
+    out << "Benchmark frames per second..." << (totalSeconds > 0 ? sorted.size() / totalSeconds : 0.0) << std::endl;
+    out << "Benchmark frame latency (ms)...mean " << mean
+        << " p50 " << percentile(sorted, 50) << " p90 " << percentile(sorted, 90)
+        << " p95 " << percentile(sorted, 95) << " p99 " << percentile(sorted, 99)
+        << " max " << percentile(sorted, 100) << std::endl;
+    out << "BENCHMARK frames=" << sorted.size()
+        << " fps=" << (totalSeconds > 0 ? sorted.size() / totalSeconds : 0.0)
+        << " mean_ms=" << mean
+        << " p50_ms=" << percentile(sorted, 50)
+        << " p95_ms=" << percentile(sorted, 95)
+        << " p99_ms=" << percentile(sorted, 99) << std::endl;
+  }
+
+  // Mean and percentile of the frame latencies in milliseconds
+  double meanLatency() const {
+    double mean = 0.0;
+    for (size_t i = 0; i < frameLatencies.size(); i++) {
+      mean += frameLatencies[i];
+    }
+    return frameLatencies.empty() ? 0.0 : mean / frameLatencies.size();
+  }
+
+  double latencyPercentile(double percent) const {
+    std::vector<double> sorted(frameLatencies);
+    std::sort(sorted.begin(), sorted.end());
+    return percentile(sorted, percent);
+  }
+
+private:
+  // Nearest-rank percentile of a sorted array
+  static double percentile(const std::vector<double> &sorted, double percent) {
+    if (sorted.empty()) {
+      return 0.0;
+    }
+    size_t rank = (size_t)(percent / 100.0 * sorted.size() + 0.5);
+    rank = std::min(std::max(rank, (size_t)1), sorted.size());
+    return sorted[rank - 1];
+  }
+
+  std::vector<double> frameLatencies;
+  std::chrono::steady_clock::time_point runStart, runEnd, frameStart;
+};
+
+#endif
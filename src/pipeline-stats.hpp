@@ -0,0 +1,141 @@
+#ifndef PIPELINE_STATS_HPP
+#define PIPELINE_STATS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// ##### Define the pipeline stages that are timed
+enum PipelineStage {
+  stageCapture,       // Reading the frame from the source
+  stageConvert,       // Swap, flip, greyscale and equalization
+  stageTrack,         // Following the tracked faces
+  stageMotion,        // Checking the motion gate
+  stageDetectFace,    // Face cascade, per detection
+  stageDetectEyes,    // Eye cascade, per detection
+  stageDetectNose,    // Nose cascade, per detection
+  stagePredict,       // Face recognizer, per face
+  stageOverlay,       // Drawing the overlay
+  stageEncode,        // JPEG encoding, on the output threads
+  stageOutput,        // Handing the frame to the output
+  stageFrame,         // The whole capture loop iteration
+  pipelineStageCount
+};
+
+inline const char *pipelineStageName(int stage) {
+  static const char *names[pipelineStageCount] = {
+    "capture", "convert", "track", "motion", "detect_face", "detect_eyes", "detect_nose", "predict", "overlay", "encode", "output", "frame"
+  };
+  return names[stage];
+}
+
+// ##### Define the latency histogram
+// Counts durations in microseconds in log-linear buckets: exact below 8us,
+// then eight buckets per power of two, so any percentile is within 12.5%.
+// Recording is one relaxed atomic increment, so any thread can record
+// without a lock and without slowing the capture loop.
+class LatencyHistogram {
+public:
+  static const size_t bucketCount = 8 + 8 * 34;   // Up to about 2^37us (38 hours)
+
+  LatencyHistogram() {
+    for (size_t i = 0; i < bucketCount; i++) {
+      buckets[i] = 0;
+    }
+    maximum = 0;
+  }
+
+  void record(uint64_t microseconds) {
+    buckets[bucketIndex(microseconds)].fetch_add(1, std::memory_order_relaxed);
+    uint64_t currentMaximum = maximum.load(std::memory_order_relaxed);
+    while (microseconds > currentMaximum && !maximum.compare_exchange_weak(currentMaximum, microseconds, std::memory_order_relaxed)) {
+    }
+  }
+
+  // Move the counts recorded so far into the array and start again, returns the maximum
+  uint64_t drain(uint64_t *counts) {
+    for (size_t i = 0; i < bucketCount; i++) {
+      counts[i] = buckets[i].exchange(0, std::memory_order_relaxed);
+    }
+    return maximum.exchange(0, std::memory_order_relaxed);
+  }
+
+  static size_t bucketIndex(uint64_t microseconds) {
+    if (microseconds < 8) {
+      return (size_t)microseconds;
+    }
+    int exponent = 63 - __builtin_clzll(microseconds);
+    size_t index = 8 + (size_t)(exponent - 3) * 8 + (size_t)((microseconds >> (exponent - 3)) & 7);
+    return index < bucketCount ? index : bucketCount - 1;
+  }
+
+  // Middle of the range of durations counted in a bucket
+  static double bucketValue(size_t index) {
+    if (index < 8) {
+      return (double)index;
+    }
+    int exponent = (int)(index - 8) / 8 + 3;
+    double width = (double)(1ULL << (exponent - 3));
+    return (double)(1ULL << exponent) + ((index - 8) % 8) * width + width / 2;
+  }
+
+private:
+  std::atomic<uint64_t> buckets[bucketCount];
+  std::atomic<uint64_t> maximum;
+};
+
+// ##### Define the pipeline statistics (a latency histogram per stage)
+class PipelineStats {
+public:
+  void record(PipelineStage stage, std::chrono::steady_clock::duration duration) {
+    histograms[stage].record((uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(duration).count());
+  }
+
+  // Record the time since the stage started
+  void record(PipelineStage stage, std::chrono::steady_clock::time_point start) {
+    record(stage, std::chrono::steady_clock::now() - start);
+  }
+
+  // Append one line per stage with the count and the p50/p95/p99/max in milliseconds since the last report
+  void report(std::string &text) {
+    uint64_t counts[LatencyHistogram::bucketCount];
+    char line[160];
+
+    for (int stage = 0; stage < pipelineStageCount; stage++) {
+      uint64_t maximum = histograms[stage].drain(counts);
+      uint64_t total = 0;
+      for (size_t i = 0; i < LatencyHistogram::bucketCount; i++) {
+        total += counts[i];
+      }
+      snprintf(line, sizeof(line), "latency_%s count=%llu p50_ms=%.3f p95_ms=%.3f p99_ms=%.3f max_ms=%.3f\n",
+               pipelineStageName(stage), (unsigned long long)total,
+               percentile(counts, total, 50) / 1000.0, percentile(counts, total, 95) / 1000.0, percentile(counts, total, 99) / 1000.0, maximum / 1000.0);
+      text += line;
+    }
+  }
+
+private:
+  // Nearest-rank percentile in microseconds
+  static double percentile(const uint64_t *counts, uint64_t total, double percent) {
+    uint64_t rank, seen = 0;
+
+    if (total == 0) {
+      return 0.0;
+    }
+    rank = (uint64_t)(percent / 100.0 * total + 0.5);
+    rank = rank < 1 ? 1 : rank;
+    for (size_t i = 0; i < LatencyHistogram::bucketCount; i++) {
+      seen += counts[i];
+      if (seen >= rank) {
+        return LatencyHistogram::bucketValue(i);
+      }
+    }
+    return LatencyHistogram::bucketValue(LatencyHistogram::bucketCount - 1);
+  }
+
+  LatencyHistogram histograms[pipelineStageCount];
+};
+
+#endif
@@ -0,0 +1,292 @@
+#ifndef RECOGNITION_WORKER_HPP
+#define RECOGNITION_WORKER_HPP
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/contrib/contrib.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "face-tracker.hpp"
+#include "pipeline-stats.hpp"
+
+// ##### Define the recognition request (a resized face ROI image of a tracked face)
+struct RecognitionRequest {
+  RecognitionRequest() : trackId(0) {}
+
+  int trackId;
+  cv::Mat faceImage;
+};
+
+// ##### Define the recognition result
+struct RecognitionResult {
+  RecognitionResult() : trackId(0), predicted(false), label(0), confidence(0.0) {}
+
+  int trackId;
+  bool predicted;         // False when there was no model to predict with
+  int label;
+  double confidence;
+};
+
+// ##### Define the function to compute the average hash of a face image
+// One bit per cell of an 8x8 thumbnail, set where the cell is brighter than the
+// mean. Crops of the same face in the same pose hash to nearly the same value.
+inline uint64_t faceImageHash(const cv::Mat &faceImage) {
+  cv::Mat grey, thumbnail;
+  uint64_t hash = 0;
+  int total = 0;
+
+  if (faceImage.channels() == 3) {
+    cv::cvtColor(faceImage, grey, cv::COLOR_BGR2GRAY);
+  }
+  else {
+    grey = faceImage;
+  }
+  cv::resize(grey, thumbnail, cv::Size(8, 8), 0, 0, cv::INTER_AREA);
+
+  for (int i = 0; i < 64; i++) {
+    total += thumbnail.at<uchar>(i / 8, i % 8);
+  }
+  for (int i = 0; i < 64; i++) {
+    if (thumbnail.at<uchar>(i / 8, i % 8) * 64 > total) {
+      hash |= (uint64_t)1 << i;
+    }
+  }
+  return hash;
+}
+
+// ##### Define the function to count the bits that differ between two hashes
+inline int hashDistance(uint64_t a, uint64_t b) {
+  uint64_t difference = a ^ b;
+  int count = 0;
+  while (difference) {
+    difference &= difference - 1;
+    count++;
+  }
+  return count;
+}
+
+// ##### Define the recognition cache
+// Holds the latest prediction for each track. A new crop is only predicted
+// again when it looks different from the one last predicted or when the
+// prediction is older than the maximum age.
+class RecognitionCache {
+public:
+  RecognitionCache(double maximumAgeSeconds, int changeThreshold)
+    : maximumAge(maximumAgeSeconds), changeThreshold(changeThreshold) {}
+
+  // Check a new crop for a track, returns true if it should be predicted
+  bool needsPrediction(const RecognitionRequest &request) {
+    Entry &entry = entries[request.trackId];
+    uint64_t hash = faceImageHash(request.faceImage);
+    bool changed = !entry.predicted || hashDistance(hash, entry.predictedHash) > changeThreshold;
+    bool stale = entry.predicted && std::chrono::duration<double>(std::chrono::steady_clock::now() - entry.predictedTime).count() > maximumAge;
+
+    if (entry.pending || (!changed && !stale)) {
+      return false;
+    }
+    entry.pending = true;
+    entry.pendingHash = hash;
+    return true;
+  }
+
+  // Store a finished prediction, without a model the track is only no longer pending so it is queued again
+  void store(const RecognitionResult &result) {
+    std::map<int, Entry>::iterator findIterator = entries.find(result.trackId);
+    if (findIterator == entries.end()) {
+      return;
+    }
+    Entry &entry = findIterator->second;
+    entry.pending = false;
+    if (!result.predicted) {
+      return;
+    }
+    entry.predicted = true;
+    entry.predictedHash = entry.pendingHash;
+    entry.predictedTime = std::chrono::steady_clock::now();
+    entry.label = result.label;
+    entry.confidence = result.confidence;
+  }
+
+  // Get the prediction for a track, returns false if there is none yet
+  bool lookup(int trackId, int &label, double &confidence) const {
+    std::map<int, Entry>::const_iterator findIterator = entries.find(trackId);
+    if (findIterator == entries.end() || !findIterator->second.predicted) {
+      return false;
+    }
+    label = findIterator->second.label;
+    confidence = findIterator->second.confidence;
+    return true;
+  }
+
+  // Forget the tracks that no longer exist
+  void retainTracks(const std::vector<FaceTrack> &tracks) {
+    std::map<int, Entry>::iterator entry = entries.begin();
+    while (entry != entries.end()) {
+      bool found = false;
+      for (size_t i = 0; i < tracks.size() && !found; i++) {
+        found = tracks[i].id == entry->first;
+      }
+      if (found) {
+        ++entry;
+      }
+      else {
+        entries.erase(entry++);
+      }
+    }
+  }
+
+  // Forget every prediction, used when the model changes
+  void clear() {
+    entries.clear();
+  }
+
+private:
+  struct Entry {
+    Entry() : predicted(false), pending(false), predictedHash(0), pendingHash(0), label(0), confidence(0.0) {}
+
+    bool predicted;
+    bool pending;
+    uint64_t predictedHash;
+    uint64_t pendingHash;
+    std::chrono::steady_clock::time_point predictedTime;
+    int label;
+    double confidence;
+  };
+
+  double maximumAge;
+  int changeThreshold;
+  std::map<int, Entry> entries;
+};
+
+// ##### Define the recognition worker
+// Predicts batches of face crops on its own thread. Requests for a track that
+// is still waiting are replaced by the newer crop, so the batch never holds
+// more than one crop per face.
+class RecognitionWorker {
+public:
+  // The prediction times are recorded in the statistics if given
+  explicit RecognitionWorker(PipelineStats *pipelineStats = NULL) : pipelineStats(pipelineStats), stopping(false), busy(false) {}
+
+  ~RecognitionWorker() {
+    stop();
+  }
+
+  void start() {
+    stopping = false;
+    worker = std::thread(&RecognitionWorker::run, this);
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    condition.notify_all();
+    if (worker.joinable()) {
+      worker.join();
+    }
+  }
+
+  // Set the model used for the following predictions
+  void setModel(cv::Ptr<cv::FaceRecognizer> model) {
+    std::lock_guard<std::mutex> lock(mutex);
+    faceRecognizerModel = model;
+  }
+
+  // Queue a batch of crops without blocking
+  void submit(const std::vector<RecognitionRequest> &batch) {
+    if (batch.empty()) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (size_t i = 0; i < batch.size(); i++) {
+        pending[batch[i].trackId] = batch[i];
+      }
+    }
+    condition.notify_all();
+  }
+
+  // Take the finished predictions without blocking
+  void collect(std::vector<RecognitionResult> &results) {
+    std::lock_guard<std::mutex> lock(mutex);
+    results.swap(finished);
+    finished.clear();
+  }
+
+  // Block until every queued crop has been predicted
+  void waitIdle() {
+    std::unique_lock<std::mutex> lock(mutex);
+    condition.wait(lock, [&] { return pending.empty() && !busy; });
+  }
+
+private:
+  void run() {
+    std::vector<RecognitionRequest> batch;
+    std::vector<RecognitionResult> batchResults;
+    cv::Ptr<cv::FaceRecognizer> model;
+    cv::Mat faceImageGrey;
+    RecognitionResult result;
+
+    for (;;) {
+      // Take every waiting crop as one batch
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [&] { return stopping || !pending.empty(); });
+        if (stopping) {
+          return;
+        }
+        batch.clear();
+        for (std::map<int, RecognitionRequest>::iterator request = pending.begin(); request != pending.end(); ++request) {
+          batch.push_back(request->second);
+        }
+        pending.clear();
+        model = faceRecognizerModel;
+        busy = true;
+      }
+
+      // Convert each face ROI image to grayscale, normalize the brightness, increase the contrast and predict
+      // Without a model every crop gets a result that is not predicted, so the cache does not wait for it forever
+      batchResults.clear();
+      for (size_t i = 0; i < batch.size(); i++) {
+        std::chrono::steady_clock::time_point predictStart = std::chrono::steady_clock::now();
+        result = RecognitionResult();
+        result.trackId = batch[i].trackId;
+        if (!model.empty()) {
+          cv::cvtColor(batch[i].faceImage, faceImageGrey, cv::COLOR_BGR2GRAY);
+          cv::equalizeHist(faceImageGrey, faceImageGrey);
+          model->predict(faceImageGrey, result.label, result.confidence);
+          result.predicted = true;
+          if (pipelineStats != NULL) {
+            pipelineStats->record(stagePredict, predictStart);
+          }
+        }
+        batchResults.push_back(result);
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished.insert(finished.end(), batchResults.begin(), batchResults.end());
+        busy = false;
+      }
+      condition.notify_all();
+    }
+  }
+
+  PipelineStats *pipelineStats;
+  std::thread worker;
+  std::mutex mutex;
+  std::condition_variable condition;
+  bool stopping;
+  bool busy;
+  cv::Ptr<cv::FaceRecognizer> faceRecognizerModel;
+  std::map<int, RecognitionRequest> pending;
+  std::vector<RecognitionResult> finished;
+};
+
+#endif
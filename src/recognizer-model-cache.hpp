@@ -0,0 +1,128 @@
+#ifndef RECOGNIZER_MODEL_CACHE_HPP
+#define RECOGNIZER_MODEL_CACHE_HPP
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/contrib/contrib.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include "hash.hpp"
+
+// ##### Define the function to list the training image filenames in sorted order
+inline void listTrainingImages(const std::string &openCVFaceRecognizerImagesPath, std::vector<std::string> &faceImageFilenames) {
+  DIR* dir;
+  dirent* pdir;
+  std::string faceImageFilename;
+
+  faceImageFilenames.clear();
+  dir = opendir(openCVFaceRecognizerImagesPath.c_str());
+  if (dir == NULL) {
+    return;
+  }
+  while ((pdir = readdir(dir))) {
+    faceImageFilename = pdir->d_name;
+    if (faceImageFilename.size() > 4 && faceImageFilename.substr(faceImageFilename.size() - 4, 4) == ".jpg") {
+      faceImageFilenames.push_back(faceImageFilename);
+    }
+  }
+  closedir(dir);
+  std::sort(faceImageFilenames.begin(), faceImageFilenames.end());
+}
+
+// ##### Define the function to hash the training image manifest
+// Covers the name and the contents of every training image, so adding,
+// removing, renaming or replacing an image changes the hash.
+inline uint64_t trainingManifestHash(const std::string &openCVFaceRecognizerImagesPath) {
+  std::vector<std::string> faceImageFilenames;
+  std::vector<char> buffer(64 * 1024);
+  uint64_t hash = 14695981039346656037ULL;
+
+  listTrainingImages(openCVFaceRecognizerImagesPath, faceImageFilenames);
+  for (size_t i = 0; i < faceImageFilenames.size(); i++) {
+    // Include the terminating null so that the names cannot run into each other
+    hash = hashBytes(hash, faceImageFilenames[i].c_str(), faceImageFilenames[i].size() + 1);
+
+    std::ifstream faceImageFile((openCVFaceRecognizerImagesPath + faceImageFilenames[i]).c_str(), std::ios::binary);
+    while (faceImageFile.read(&buffer[0], buffer.size()) || faceImageFile.gcount() > 0) {
+      hash = hashBytes(hash, &buffer[0], (size_t)faceImageFile.gcount());
+    }
+  }
+
+  return hash;
+}
+
+// ##### Define the function to hash the training image names only
+// Cheap enough to check on every start however many images there are, but
+// an image replaced under the same name is not noticed (use --retrain).
+inline uint64_t trainingNamesHash(const std::string &openCVFaceRecognizerImagesPath) {
+  std::vector<std::string> faceImageFilenames;
+  uint64_t hash = 14695981039346656037ULL;
+
+  listTrainingImages(openCVFaceRecognizerImagesPath, faceImageFilenames);
+  for (size_t i = 0; i < faceImageFilenames.size(); i++) {
+    hash = hashBytes(hash, faceImageFilenames[i].c_str(), faceImageFilenames[i].size() + 1);
+  }
+
+  return hash;
+}
+
+// ##### Define the function to save the trained face recognizer, its label names and the manifest hash
+inline bool saveFaceRecognizerModel(const std::string &modelFilePath, const cv::Ptr<cv::FaceRecognizer> &faceRecognizerModel, const std::vector<std::string> &faceRecognizerLabelNames, uint64_t manifestHash) {
+  // Write to a temporary file and rename it so a crash never leaves a half written model
+  std::string temporaryFilePath = modelFilePath + ".tmp";
+
+  try {
+    cv::FileStorage modelFile(temporaryFilePath, cv::FileStorage::WRITE);
+    if (!modelFile.isOpened()) {
+      return false;
+    }
+    modelFile << "manifestHash" << formatHash(manifestHash);
+    modelFile << "labelNames" << faceRecognizerLabelNames;
+    faceRecognizerModel->save(modelFile);
+    modelFile.release();
+  }
+  catch (cv::Exception &ex) {
+    std::cerr << "Error saving face recognizer!..." << ex.msg << std::endl;
+    remove(temporaryFilePath.c_str());
+    return false;
+  }
+
+  return rename(temporaryFilePath.c_str(), modelFilePath.c_str()) == 0;
+}
+
+// ##### Define the function to load the saved face recognizer if it was trained on the same images
+inline bool loadFaceRecognizerModel(const std::string &modelFilePath, cv::Ptr<cv::FaceRecognizer> &faceRecognizerModel, std::vector<std::string> &faceRecognizerLabelNames, uint64_t manifestHash) {
+  std::string savedManifestHash;
+
+  try {
+    cv::FileStorage modelFile(modelFilePath, cv::FileStorage::READ);
+    if (!modelFile.isOpened()) {
+      return false;
+    }
+
+    modelFile["manifestHash"] >> savedManifestHash;
+    if (savedManifestHash != formatHash(manifestHash)) {
+      std::cout << "Face recognizer training images have changed..." << std::endl;
+      return false;
+    }
+
+    faceRecognizerLabelNames.clear();
+    modelFile["labelNames"] >> faceRecognizerLabelNames;
+    faceRecognizerModel = cv::createFisherFaceRecognizer();
+    faceRecognizerModel->load(modelFile);
+  }
+  catch (cv::Exception &ex) {
+    std::cerr << "Error loading face recognizer!..." << ex.msg << std::endl;
+    faceRecognizerLabelNames.clear();
+    return false;
+  }
+
+  return true;
+}
+
+#endif
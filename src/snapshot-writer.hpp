@@ -0,0 +1,143 @@
+#ifndef SNAPSHOT_WRITER_HPP
+#define SNAPSHOT_WRITER_HPP
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "pipeline-stats.hpp"
+
+// ##### Define the snapshot writer
+// Keeps the image.jpg file contract without encoding or writing on the
+// capture thread. Frames are shared, without a copy, into the back half of a
+// double buffer, a writer thread swaps it to the front, encodes it and
+// publishes it by writing a temporary file and renaming it over the old one,
+// so readers never see a partly written image. Frames that arrive faster
+// than the maximum rate, or while the writer is still busy, are skipped.
+class SnapshotWriter {
+public:
+  // The encoding times are recorded in the statistics if given
+  explicit SnapshotWriter(PipelineStats *pipelineStats = NULL) : pipelineStats(pipelineStats), stopping(false), framePending(false), framesWritten(0), framesSkipped(0) {}
+
+  ~SnapshotWriter() {
+    stop();
+  }
+
+  void start(const std::string &filePath, double maximumFramesPerSecond, int jpegQuality) {
+    snapshotFilePath = filePath;
+    temporaryFilePath = filePath + ".tmp";
+    minimumInterval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(maximumFramesPerSecond > 0 ? 1.0 / maximumFramesPerSecond : 0.0));
+    encodeParameters.clear();
+    encodeParameters.push_back(CV_IMWRITE_JPEG_QUALITY);
+    encodeParameters.push_back(jpegQuality);
+    lastAccepted = std::chrono::steady_clock::time_point();
+    stopping = false;
+    writerThread = std::thread(&SnapshotWriter::run, this);
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    condition.notify_all();
+    if (writerThread.joinable()) {
+      writerThread.join();
+    }
+  }
+
+  // Offer a frame, returns false if it was skipped
+  // The frame is shared, not copied, so the caller must not draw on it again
+  bool submit(const cv::Mat &frame) {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    if (now - lastAccepted < minimumInterval) {
+      framesSkipped++;
+      return false;
+    }
+    {
+      std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+      if (!lock.owns_lock() || framePending) {
+        // The writer has fallen behind
+        framesSkipped++;
+        return false;
+      }
+      backFrame = frame;
+      framePending = true;
+    }
+    lastAccepted = now;
+    condition.notify_one();
+    return true;
+  }
+
+  size_t written() const {
+    return framesWritten.load();
+  }
+
+  size_t skipped() const {
+    return framesSkipped.load();
+  }
+
+private:
+  // ##### Define the writer thread
+  void run() {
+    std::vector<uchar> jpeg;
+    FILE *snapshotFile;
+
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [&] { return stopping || framePending; });
+        if (stopping) {
+          return;
+        }
+        cv::swap(backFrame, frontFrame);
+        framePending = false;
+      }
+
+      // Encode and publish atomically through a temporary file
+      std::chrono::steady_clock::time_point encodeStart = std::chrono::steady_clock::now();
+      bool encoded = cv::imencode(".jpg", frontFrame, jpeg, encodeParameters);
+      if (pipelineStats != NULL) {
+        pipelineStats->record(stageEncode, encodeStart);
+      }
+      frontFrame.release();
+      if (!encoded) {
+        continue;
+      }
+      snapshotFile = fopen(temporaryFilePath.c_str(), "wb");
+      if (snapshotFile == NULL) {
+        continue;
+      }
+      bool complete = fwrite(&jpeg[0], 1, jpeg.size(), snapshotFile) == jpeg.size();
+      complete = fclose(snapshotFile) == 0 && complete;
+      if (complete && rename(temporaryFilePath.c_str(), snapshotFilePath.c_str()) == 0) {
+        framesWritten++;
+      }
+    }
+  }
+
+  PipelineStats *pipelineStats;
+  std::string snapshotFilePath;
+  std::string temporaryFilePath;
+  std::vector<int> encodeParameters;
+  std::chrono::steady_clock::duration minimumInterval;
+  std::chrono::steady_clock::time_point lastAccepted;
+  std::thread writerThread;
+  std::mutex mutex;
+  std::condition_variable condition;
+  bool stopping;
+  bool framePending;
+  std::atomic<size_t> framesWritten;
+  std::atomic<size_t> framesSkipped;
+  cv::Mat backFrame;
+  cv::Mat frontFrame;
+};
+
+#endif
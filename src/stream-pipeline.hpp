@@ -0,0 +1,483 @@
+#ifndef STREAM_PIPELINE_HPP
+#define STREAM_PIPELINE_HPP
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/contrib/contrib.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "detector-pool.hpp"
+#include "face-tracker.hpp"
+#include "frame-pool.hpp"
+#include "frame-preprocess.hpp"
+#include "frame-source.hpp"
+#include "load-governor.hpp"
+#include "mjpeg-server.hpp"
+#include "motion-gate.hpp"
+#include "overlay-renderer.hpp"
+#include "pipeline-stats.hpp"
+#include "recognition-worker.hpp"
+#include "snapshot-writer.hpp"
+
+// ##### Define the function to apply a finished detection to the face tracks and collect the resized face ROI images
+// The face ROI images are cut from the current frame at the tracked position of each face, before anything is drawn on it
+inline void applyDetectionResult(DetectionResult &detectionResult, FaceTracker &faceTracker, const cv::Mat &frame, bool trainingMode, std::vector<RecognitionRequest> &faceROIImages, cv::Size faceROIImageSize) {
+  std::vector<cv::Rect> faceRects;
+  std::vector<int> trackIds;
+  std::vector<FaceTrack>::const_iterator faceTrack;
+  RecognitionRequest faceROI;
+  cv::Rect faceRect;
+  cv::Mat faceImage;
+
+  for (size_t i = 0; i < detectionResult.faces.size(); i++) {
+    faceRects.push_back(detectionResult.faces[i].rect);
+  }
+  faceTracker.correct(faceRects, trackIds);
+
+  for (size_t i = 0; i < detectionResult.faces.size(); i++) {
+    if (!detectionResult.faces[i].complete) {
+      continue;
+    }
+
+    // Use the tracked position, the frame has moved on since the detection
+    faceRect = detectionResult.faces[i].rect;
+    for (faceTrack = faceTracker.tracks().begin(); faceTrack != faceTracker.tracks().end(); ++faceTrack) {
+      if (faceTrack->id == trackIds[i]) {
+        faceRect = faceTrack->rect;
+        break;
+      }
+    }
+    faceRect &= cv::Rect(0, 0, frame.cols, frame.rows);
+    if (faceRect.area() == 0) {
+      continue;
+    }
+
+    // Copy the face and mark its eyes and nose, training images are kept unmarked
+    frame(faceRect).copyTo(faceImage);
+    if (!trainingMode) {
+      drawFaceFeatures(faceImage, detectionResult.faces[i]);
+    }
+    faceROI.trackId = trackIds[i];
+    cv::resize(faceImage, faceROI.faceImage, faceROIImageSize);
+    faceROIImages.push_back(faceROI);
+    faceROI.faceImage = cv::Mat();
+  }
+}
+
+// ##### Define the stream configuration
+struct StreamConfig {
+  StreamConfig()
+    : output("file"), port(8080), width(640), height(480), jpegQuality(80), snapshotFramesPerSecond(15.0),
+      detectionInterval(5), trackingDownscale(2), recognitionMaximumAge(5.0), recognitionChangeThreshold(8),
+      motionGate(false), motionDownscale(8), motionThreshold(20), motionMinimumArea(0.005), motionCoolDown(3.0), motionMargin(48), frameBudget(0.0) {}
+
+  std::string name;
+  std::string source;               // As for --source
+  std::string output;               // file or mjpeg
+  std::string snapshotPath;         // Written when the output is file, the defaults hold the directory
+  int port;                         // Served when the output is mjpeg
+  int width, height;
+  int jpegQuality;
+  double snapshotFramesPerSecond;
+  int detectionInterval;
+  int trackingDownscale;
+  double recognitionMaximumAge;
+  int recognitionChangeThreshold;
+  bool motionGate;
+  int motionDownscale;
+  int motionThreshold;
+  double motionMinimumArea;
+  double motionCoolDown;
+  int motionMargin;
+  double frameBudget;               // Milliseconds, the load governor is off at 0
+};
+
+// ##### Define the function to load the stream configurations
+// The file is read with cv::FileStorage (YAML or XML). Each entry of the
+// streams list overrides the defaults, which come from the command line:
+//   %YAML:1.0
+//   streams:
+//     - { name: door, source: camera, output: mjpeg, port: 8080, motion_gate: 1 }
+//     - { name: garage, source: "video:garage.h264", output: file, path: "garage.jpg" }
+inline bool loadStreamConfigs(const std::string &configFilePath, const StreamConfig &defaults, std::vector<StreamConfig> &streamConfigs) {
+  int motionGate;
+
+  streamConfigs.clear();
+  try {
+    cv::FileStorage configFile(configFilePath, cv::FileStorage::READ);
+    if (!configFile.isOpened()) {
+      std::cerr << "Error opening stream configuration!..." << configFilePath << std::endl;
+      return false;
+    }
+    cv::FileNode streams = configFile["streams"];
+    for (cv::FileNodeIterator node = streams.begin(); node != streams.end(); ++node) {
+      StreamConfig config = defaults;
+      cv::read((*node)["name"], config.name, "stream" + std::to_string(streamConfigs.size() + 1));
+      cv::read((*node)["source"], config.source, defaults.source);
+      cv::read((*node)["output"], config.output, defaults.output);
+      cv::read((*node)["path"], config.snapshotPath, defaults.snapshotPath + config.name + ".jpg");
+      cv::read((*node)["port"], config.port, defaults.port + (int)streamConfigs.size());
+      cv::read((*node)["width"], config.width, defaults.width);
+      cv::read((*node)["height"], config.height, defaults.height);
+      cv::read((*node)["jpeg_quality"], config.jpegQuality, defaults.jpegQuality);
+      cv::read((*node)["snapshot_fps"], config.snapshotFramesPerSecond, defaults.snapshotFramesPerSecond);
+      cv::read((*node)["detection_interval"], config.detectionInterval, defaults.detectionInterval);
+      cv::read((*node)["tracking_downscale"], config.trackingDownscale, defaults.trackingDownscale);
+      cv::read((*node)["recognition_max_age"], config.recognitionMaximumAge, defaults.recognitionMaximumAge);
+      cv::read((*node)["recognition_change_threshold"], config.recognitionChangeThreshold, defaults.recognitionChangeThreshold);
+      cv::read((*node)["motion_gate"], motionGate, defaults.motionGate ? 1 : 0);
+      config.motionGate = motionGate != 0;
+      cv::read((*node)["motion_downscale"], config.motionDownscale, defaults.motionDownscale);
+      cv::read((*node)["motion_threshold"], config.motionThreshold, defaults.motionThreshold);
+      cv::read((*node)["motion_min_area"], config.motionMinimumArea, defaults.motionMinimumArea);
+      cv::read((*node)["motion_cooldown"], config.motionCoolDown, defaults.motionCoolDown);
+      cv::read((*node)["motion_margin"], config.motionMargin, defaults.motionMargin);
+      cv::read((*node)["frame_budget"], config.frameBudget, defaults.frameBudget);
+      if (config.output != "file" && config.output != "mjpeg") {
+        std::cerr << "Unknown stream output..." << config.name << " " << config.output << std::endl;
+        return false;
+      }
+      // The frame pools are sized from the stream, so a bad size is rejected before any are built
+      if (config.width <= 0 || config.height <= 0) {
+        std::cerr << "Invalid stream size!..." << config.name << " " << config.width << "x" << config.height << std::endl;
+        return false;
+      }
+      if (config.port <= 0 || config.port > 65535) {
+        std::cerr << "Invalid stream port!..." << config.name << " " << config.port << std::endl;
+        return false;
+      }
+      streamConfigs.push_back(config);
+    }
+  }
+  catch (cv::Exception &ex) {
+    std::cerr << "Error reading stream configuration!..." << ex.msg << std::endl;
+    return false;
+  }
+
+  if (streamConfigs.empty()) {
+    std::cerr << "No streams configured!..." << configFilePath << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// ##### Define the stream pipeline
+// One capture, overlay and output loop on its own thread. The detector pool
+// and the face recognizer model are shared by every stream, the frame
+// buffers, tracker, recognition cache and output belong to the stream.
+// Training mode, benchmarking and the ultrasonic sensor are only available
+// in the single stream capture loop.
+class StreamPipeline {
+public:
+  StreamPipeline(size_t stream, const StreamConfig &config, DetectorPool &detectorPool, const DetectionParameters &detectionParameters, PipelineStats &pipelineStats)
+    : stream(stream), config(config), detectorPool(detectorPool), detectionParameters(detectionParameters), pipelineStats(pipelineStats),
+      displayFramePool(6, config.height, config.width, CV_8UC3), greyFramePool(detectorPool.threadCount() * 3 + 2, config.height, config.width, CV_8UC1),
+      faceTracker(config.detectionInterval, config.trackingDownscale), recognitionWorker(&pipelineStats),
+      recognitionCache(config.recognitionMaximumAge, config.recognitionChangeThreshold),
+      overlay(cv::FONT_HERSHEY_DUPLEX, cv::Scalar(255, 255, 255), 1, CV_AA), mjpegServer(&pipelineStats), snapshotWriter(&pipelineStats),
+      minimumLabels(2), stopping(false), modelChanged(false), frameCount(0), framesPerSecond(0.0), trackCount(0), detectionsSkipped(0), detectionsGated(0), governorLevel(0) {
+    if (config.motionGate) {
+      motionGate.reset(new MotionGate(config.motionDownscale, config.motionThreshold, config.motionMinimumArea, config.motionCoolDown, config.motionMargin));
+    }
+    if (config.frameBudget > 0.0) {
+      loadGovernor.reset(new LoadGovernor(config.frameBudget, config.detectionInterval, detectionParameters.faceDownscale, config.name));
+    }
+  }
+
+  ~StreamPipeline() {
+    stop();
+  }
+
+  // Open the source and the output and start the capture thread
+  bool start(const cv::Ptr<cv::FaceRecognizer> &faceRecognizerModel, const std::vector<std::string> &faceRecognizerLabelNames, size_t faceRecognizerMinimumLabels) {
+    frameSource = createFrameSource(config.source, config.width, config.height, true);
+    if (!frameSource || !frameSource->open()) {
+      std::cerr << "Error opening stream source!..." << config.name << " " << config.source << std::endl;
+      return false;
+    }
+    if (config.output == "mjpeg") {
+      if (!mjpegServer.start(config.port, config.jpegQuality)) {
+        std::cerr << "Error starting MJPEG server!..." << config.name << " port " << config.port << std::endl;
+        return false;
+      }
+    }
+    else {
+      snapshotWriter.start(config.snapshotPath, config.snapshotFramesPerSecond, config.jpegQuality);
+    }
+
+    minimumLabels = faceRecognizerMinimumLabels;
+    setModel(faceRecognizerModel, faceRecognizerLabelNames);
+    recognitionWorker.start();
+    stopping = false;
+    captureThread = std::thread(&StreamPipeline::run, this);
+    std::cout << "Stream started..." << config.name << " " << frameSource->name() << " to "
+              << (config.output == "mjpeg" ? "port " + std::to_string(config.port) : config.snapshotPath) << std::endl;
+    return true;
+  }
+
+  void stop() {
+    stopping = true;
+    if (captureThread.joinable()) {
+      captureThread.join();
+    }
+    recognitionWorker.stop();
+    mjpegServer.stop();
+    snapshotWriter.stop();
+    if (frameSource) {
+      frameSource->release();
+    }
+  }
+
+  // Use a new face recognizer model, the label names are swapped in by the capture thread
+  void setModel(const cv::Ptr<cv::FaceRecognizer> &faceRecognizerModel, const std::vector<std::string> &faceRecognizerLabelNames) {
+    std::lock_guard<std::mutex> lock(modelMutex);
+    pendingLabelNames = faceRecognizerLabelNames;
+    modelChanged = true;
+    recognitionWorker.setModel(faceRecognizerLabelNames.size() >= minimumLabels ? faceRecognizerModel : cv::Ptr<cv::FaceRecognizer>());
+  }
+
+  // Append the statistics of the stream, each line prefixed with the stream name
+  void appendStats(std::string &text) const {
+    std::string prefix = "stream_" + config.name + "_";
+    char line[64];
+
+    snprintf(line, sizeof(line), "%.2f", framesPerSecond.load());
+    text += prefix + "frames " + std::to_string(frameCount.load()) + "\n"
+          + prefix + "fps " + line + "\n"
+          + prefix + "tracks " + std::to_string(trackCount.load()) + "\n"
+          + prefix + "dropped_detections " + std::to_string(detectionsSkipped.load()) + "\n"
+          + (motionGate ? prefix + "motion_gated_detections " + std::to_string(detectionsGated.load()) + "\n" : "")
+          + (loadGovernor ? prefix + "governor_level " + std::to_string(governorLevel.load()) + "\n" : "")
+          + (config.output == "mjpeg" ? prefix + "dropped_mjpeg_frames " + std::to_string(mjpegServer.replaced()) + "\n"
+                                        + prefix + "rejected_mjpeg_clients " + std::to_string(mjpegServer.rejected()) + "\n"
+                                      : prefix + "skipped_snapshots " + std::to_string(snapshotWriter.skipped()) + "\n");
+  }
+
+  const std::string &name() const {
+    return config.name;
+  }
+
+private:
+  // ##### Define the capture loop of the stream
+  void run() {
+    std::vector<std::string> labelNames;
+    std::vector<RecognitionRequest> faceROIImages, recognitionBatch;
+    std::vector<RecognitionResult> recognitionResults;
+    std::vector<FaceTrack>::const_iterator faceTrack;
+    DetectionJob detectionJob;
+    DetectionResult detectionResult;
+    FramePreprocessor framePreprocessor;
+    cv::Mat capturedFrame, frame, frameGrey;
+    cv::Size faceROIImageSize(100, 100);
+    cv::Rect faceTrackRect;
+    cv::Size textSize;
+    std::string text;
+    char textBuffer[128];
+    char dateTimestampFormatted[20];
+    time_t dateTimestamp;
+    int textMargin = 10;
+    int label;
+    double confidence;
+    bool motionGateOpen = true;
+    bool detectionDue;
+    size_t latestDetectionFrameNumber = 0, startFrameCount = 0, frameNumber = 0;
+    std::chrono::steady_clock::time_point frameStartTime, captureEndTime, stageStartTime, fpsStartTime = std::chrono::steady_clock::now();
+
+    for (; !stopping; frameNumber++) {
+      // Swap in a new model
+      if (modelChanged) {
+        std::lock_guard<std::mutex> lock(modelMutex);
+        labelNames.swap(pendingLabelNames);
+        modelChanged = false;
+        recognitionCache.clear();
+      }
+
+      // Update the frames per second once a second
+      frameStartTime = std::chrono::steady_clock::now();
+      if (frameStartTime - fpsStartTime >= std::chrono::seconds(1)) {
+        framesPerSecond = (frameNumber - startFrameCount) / std::chrono::duration<double>(frameStartTime - fpsStartTime).count();
+        fpsStartTime = frameStartTime;
+        startFrameCount = frameNumber;
+      }
+
+      // Get the frame and convert it, building the greyscale frame in the same pass
+      if (!frameSource->read(capturedFrame)) {
+        std::cout << "End of frames..." << config.name << std::endl;
+        break;
+      }
+      pipelineStats.record(stageCapture, frameStartTime);
+      captureEndTime = stageStartTime = std::chrono::steady_clock::now();
+      displayFramePool.acquire(frame);
+      framePreprocessor.process(capturedFrame, frame, &frameGrey);
+      pipelineStats.record(stageConvert, stageStartTime);
+
+      // Follow the tracked faces to this frame
+      stageStartTime = std::chrono::steady_clock::now();
+      faceTracker.prepareFrame(frameGrey);
+      faceTracker.update();
+      pipelineStats.record(stageTrack, stageStartTime);
+
+      // Check the motion gate, the tracked faces are followed by detection whether they move or not
+      if (motionGate) {
+        stageStartTime = std::chrono::steady_clock::now();
+        motionGateOpen = motionGate->update(frameGrey);
+        pipelineStats.record(stageMotion, stageStartTime);
+      }
+      detectionDue = faceTracker.detectionNeeded(frameNumber);
+      if (detectionDue && !motionGateOpen && faceTracker.tracks().empty()) {
+        detectionsGated++;
+        detectionDue = false;
+      }
+      if (detectionDue && !detectorPool.idleWorkerAvailable(stream)) {
+        detectionsSkipped++;
+      }
+
+      // Hand the equalized greyscale frame to the shared detector pool if this stream has a free share of it
+      if (detectionDue && detectorPool.idleWorkerAvailable(stream)) {
+        detectionJob.stream = stream;
+        detectionJob.frameNumber = frameNumber;
+        detectionJob.searchRegionCount = 0;
+        if (motionGate && faceTracker.tracks().empty()) {
+          detectionJob.searchRegionCount = motionGate->regionsFound();
+          for (int i = 0; i < detectionJob.searchRegionCount; i++) {
+            detectionJob.searchRegions[i] = motionGate->region(i);
+          }
+        }
+        greyFramePool.acquire(detectionJob.frameGrey);
+        framePreprocessor.equalize(frameGrey, detectionJob.frameGrey);
+        detectionJob.parameters = detectionParameters;
+        if (detectorPool.submit(std::move(detectionJob))) {
+          faceTracker.startDetection(frameNumber);
+        }
+      }
+
+      // Collect the finished detections of this stream, only keep the newest
+      while (detectorPool.tryGetResult(detectionResult, stream)) {
+        if (loadGovernor) {
+          loadGovernor->recordDetection(detectionResult.detectionTime);
+        }
+        if (detectionResult.frameNumber + 1 > latestDetectionFrameNumber) {
+          latestDetectionFrameNumber = detectionResult.frameNumber + 1;
+          faceROIImages.clear();
+          applyDetectionResult(detectionResult, faceTracker, frame, false, faceROIImages, faceROIImageSize);
+        }
+      }
+
+      // Queue the faces whose cached prediction is missing, out of date or for a different looking crop
+      if (!faceROIImages.empty() && labelNames.size() >= minimumLabels) {
+        recognitionBatch.clear();
+        for (size_t i = 0; i < faceROIImages.size(); i++) {
+          if (faceROIImages[i].trackId != 0 && recognitionCache.needsPrediction(faceROIImages[i])) {
+            recognitionBatch.push_back(faceROIImages[i]);
+          }
+        }
+        recognitionWorker.submit(recognitionBatch);
+      }
+      faceROIImages.clear();
+      recognitionWorker.collect(recognitionResults);
+      for (size_t i = 0; i < recognitionResults.size(); i++) {
+        recognitionCache.store(recognitionResults[i]);
+      }
+      recognitionCache.retainTracks(faceTracker.tracks());
+      trackCount = faceTracker.tracks().size();
+
+      // Draw a rectangle, the track ID and the name around each tracked face
+      stageStartTime = std::chrono::steady_clock::now();
+      size_t trackField = overlayFieldTracks;
+      for (faceTrack = faceTracker.tracks().begin(); faceTrack != faceTracker.tracks().end(); ++faceTrack, ++trackField) {
+        faceTrackRect = faceTrack->rect & cv::Rect(0, 0, frame.cols, frame.rows);
+        cv::rectangle(frame, faceTrackRect.tl(), faceTrackRect.br(), cv::Scalar(255, 255, 255), 1, CV_AA, 0);
+        snprintf(textBuffer, sizeof(textBuffer), "#%d", faceTrack->id);
+        text = textBuffer;
+        if (recognitionCache.lookup(faceTrack->id, label, confidence) && label >= 1 && label <= (int)labelNames.size()) {
+          text += " ";
+          text += labelNames[label - 1];
+        }
+        overlay.drawText(frame, trackField, text, 0.3, cv::Point(faceTrackRect.x, std::max(faceTrackRect.y - 4, textMargin)));
+      }
+
+      // Add the stream name, frames per second and date and timestamp text
+      textSize = overlay.prepare(overlayFieldName, config.name, 0.4);
+      overlay.draw(frame, overlayFieldName, cv::Point(textMargin, textSize.height + textMargin));
+      snprintf(textBuffer, sizeof(textBuffer), "FPS: %.1f", framesPerSecond.load());
+      text = textBuffer;
+      textSize = overlay.prepare(overlayFieldFramesPerSecond, text, 0.4);
+      overlay.draw(frame, overlayFieldFramesPerSecond, cv::Point(frame.cols - textSize.width - textMargin, frame.rows - textSize.height - (textMargin * 2)));
+      dateTimestamp = time(NULL);
+      strftime(dateTimestampFormatted, sizeof(dateTimestampFormatted), "%d/%m/%Y %H:%M:%S", localtime(&dateTimestamp));
+      text = dateTimestampFormatted;
+      textSize = overlay.prepare(overlayFieldDateTimestamp, text, 0.4);
+      overlay.draw(frame, overlayFieldDateTimestamp, cv::Point(frame.cols - textSize.width - textMargin, frame.rows - textMargin));
+      pipelineStats.record(stageOverlay, stageStartTime);
+
+      // Hand the frame to the output thread
+      stageStartTime = std::chrono::steady_clock::now();
+      if (config.output == "mjpeg") {
+        mjpegServer.publish(frame);
+      }
+      else {
+        snapshotWriter.submit(frame);
+      }
+      pipelineStats.record(stageOutput, stageStartTime);
+      pipelineStats.record(stageFrame, frameStartTime);
+      frameCount = frameNumber + 1;
+
+      // Scale the detection work to the frame budget, the wait for the camera is not part of the frame time
+      if (loadGovernor) {
+        loadGovernor->recordFrame(std::chrono::steady_clock::now() - captureEndTime);
+        if (loadGovernor->update()) {
+          faceTracker.setDetectionInterval(loadGovernor->current().detectionInterval);
+          detectionParameters.faceDownscale = loadGovernor->current().faceDownscale;
+          detectionParameters.featureStages = loadGovernor->current().featureStages;
+          governorLevel = loadGovernor->level();
+        }
+      }
+    }
+  }
+
+  // The overlay fields of a stream
+  enum OverlayField {
+    overlayFieldName,
+    overlayFieldFramesPerSecond,
+    overlayFieldDateTimestamp,
+    overlayFieldTracks          // One field per track drawn, must be last
+  };
+
+  size_t stream;
+  StreamConfig config;
+  DetectorPool &detectorPool;
+  DetectionParameters detectionParameters;
+  PipelineStats &pipelineStats;
+  std::unique_ptr<FrameSource> frameSource;
+  FramePool displayFramePool;
+  FramePool greyFramePool;
+  FaceTracker faceTracker;
+  std::unique_ptr<MotionGate> motionGate;
+  std::unique_ptr<LoadGovernor> loadGovernor;
+  RecognitionWorker recognitionWorker;
+  RecognitionCache recognitionCache;
+  OverlayRenderer overlay;
+  MjpegServer mjpegServer;
+  SnapshotWriter snapshotWriter;
+  size_t minimumLabels;
+  std::thread captureThread;
+  std::atomic<bool> stopping;
+  std::mutex modelMutex;
+  std::atomic<bool> modelChanged;
+  std::vector<std::string> pendingLabelNames;
+  std::atomic<size_t> frameCount;
+  std::atomic<double> framesPerSecond;
+  std::atomic<size_t> trackCount;
+  std::atomic<size_t> detectionsSkipped;
+  std::atomic<size_t> detectionsGated;
+  std::atomic<int> governorLevel;
+};
+
+#endif
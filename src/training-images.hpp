@@ -0,0 +1,255 @@
+#ifndef TRAINING_IMAGES_HPP
+#define TRAINING_IMAGES_HPP
+
+// Training images are decoded at a reduced size with libjpeg, which is found
+// automatically where the compiler supports __has_include, or build with
+// -DHAVE_LIBJPEG (and link with -ljpeg). Without it they are decoded at full
+// size by OpenCV.
+#ifndef HAVE_LIBJPEG
+#if defined(__has_include)
+#if __has_include(<jpeglib.h>)
+#define HAVE_LIBJPEG
+#endif
+#endif
+#endif
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <dirent.h>
+#ifdef HAVE_LIBJPEG
+#include <csetjmp>
+#include <cstdio>
+#include <jpeglib.h>
+#endif
+
+// Training images are stored as <label>_<timestamp>.jpg and loaded as 100x100 greyscale
+const int faceRecognizerImageWidth = 100;
+const int faceRecognizerImageHeight = 100;
+
+// ##### Define the function to read the width and height from a JPEG header without decoding it
+inline bool readJpegSize(const std::vector<uchar> &jpeg, int &width, int &height) {
+  size_t position = 2;
+  uchar marker;
+  size_t segmentLength;
+
+  if (jpeg.size() < 4 || jpeg[0] != 0xFF || jpeg[1] != 0xD8) {
+    return false;
+  }
+
+  // Walk the segments until a start of frame marker (C0 to CF, except DHT C4, JPG C8 and DAC CC)
+  while (position + 9 < jpeg.size()) {
+    if (jpeg[position] != 0xFF) {
+      return false;
+    }
+    marker = jpeg[position + 1];
+    if (marker == 0xFF) {
+      // Fill byte before a marker
+      position++;
+      continue;
+    }
+    segmentLength = ((size_t)jpeg[position + 2] << 8) | jpeg[position + 3];
+    if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+      height = (jpeg[position + 5] << 8) | jpeg[position + 6];
+      width = (jpeg[position + 7] << 8) | jpeg[position + 8];
+      return true;
+    }
+    position += 2 + segmentLength;
+  }
+  return false;
+}
+
+#ifdef HAVE_LIBJPEG
+// ##### Define the libjpeg error handler, returns to the decode instead of exiting
+struct TrainingImageJpegError {
+  jpeg_error_mgr manager;
+  jmp_buf returnPoint;
+};
+
+inline void trainingImageJpegErrorExit(j_common_ptr decompress) {
+  longjmp(((TrainingImageJpegError *)decompress->err)->returnPoint, 1);
+}
+
+// ##### Define the function to decode a JPEG as greyscale with libjpeg at 1/2, 1/4 or 1/8 scale
+// The scaled DCT skips the detail a 100x100 image does not need. Returns false
+// if libjpeg cannot decode the image, which is then left to cv::imdecode.
+inline bool decodeJpegReduced(const std::vector<uchar> &jpeg, unsigned int scaleDenominator, cv::Mat &decoded) {
+  jpeg_decompress_struct decompress;
+  TrainingImageJpegError error;
+
+  decompress.err = jpeg_std_error(&error.manager);
+  error.manager.error_exit = trainingImageJpegErrorExit;
+  if (setjmp(error.returnPoint)) {
+    jpeg_destroy_decompress(&decompress);
+    return false;
+  }
+  jpeg_create_decompress(&decompress);
+  jpeg_mem_src(&decompress, (unsigned char *)&jpeg[0], (unsigned long)jpeg.size());
+  jpeg_read_header(&decompress, TRUE);
+  decompress.out_color_space = JCS_GRAYSCALE;
+  decompress.scale_num = 1;
+  decompress.scale_denom = scaleDenominator;
+  jpeg_start_decompress(&decompress);
+
+  decoded.create((int)decompress.output_height, (int)decompress.output_width, CV_8UC1);
+  while (decompress.output_scanline < decompress.output_height) {
+    JSAMPROW row = decoded.ptr((int)decompress.output_scanline);
+    jpeg_read_scanlines(&decompress, &row, 1);
+  }
+  jpeg_finish_decompress(&decompress);
+  jpeg_destroy_decompress(&decompress);
+  return true;
+}
+#endif
+
+// ##### Define the function to decode a JPEG as greyscale, at a reduced size where libjpeg is available
+inline cv::Mat decodeTrainingImage(const std::vector<uchar> &jpeg) {
+#ifdef HAVE_LIBJPEG
+  // Only reduce as far as the image stays at least 100x100
+  int width, height;
+  if (readJpegSize(jpeg, width, height)) {
+    int reduction = std::min(width / faceRecognizerImageWidth, height / faceRecognizerImageHeight);
+    unsigned int scaleDenominator = reduction >= 8 ? 8 : reduction >= 4 ? 4 : reduction >= 2 ? 2 : 1;
+    cv::Mat decoded;
+    if (scaleDenominator > 1 && decodeJpegReduced(jpeg, scaleDenominator, decoded)) {
+      return decoded;
+    }
+  }
+#endif
+
+  return cv::imdecode(cv::Mat(1, (int)jpeg.size(), CV_8UC1, (void *)&jpeg[0]), CV_LOAD_IMAGE_GRAYSCALE);
+}
+
+// ##### Define the function to load the face recognizer training images
+// Labels are numbered from 1 in order of first appearance in the sorted file
+// list. The images are decoded in parallel straight into one contiguous
+// preallocated buffer, each returned image is a 100x100 view into it.
+inline bool loadFaceRecognizerTrainingImages(const std::string &openCVFaceRecognizerImagesPath, std::vector<cv::Mat> &faceRecognizerImages, std::vector<int> &faceRecognizerLabels, std::vector<std::string> &faceRecognizerLabelNames) {
+  // Initialise variables for loading of training face image files
+  DIR* dir;
+  dirent* pdir;
+  std::vector<std::string> faceImageFilenames;
+  std::string faceImageFilename;
+  std::string faceRecognizerLabelName;
+  std::unordered_map<std::string, int> faceRecognizerLabelIndex;
+  std::unordered_map<std::string, int>::iterator findIterator;
+  std::vector<int> faceImageLabels;
+  size_t underscorePosition;
+  std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+  // Read in the face recognizer image filenames
+  dir = opendir(openCVFaceRecognizerImagesPath.c_str());
+  if (dir == NULL) {
+    std::cerr << "Error opening face recognizer images directory!..." << openCVFaceRecognizerImagesPath << std::endl;
+    return false;
+  }
+  while ((pdir = readdir(dir))) {
+    faceImageFilename = pdir->d_name;
+
+    if (faceImageFilename.size() > 4) {
+      if (faceImageFilename.substr(faceImageFilename.size() - 4, 4) == ".jpg") {
+        faceImageFilenames.push_back(faceImageFilename);
+      }
+    }
+  }
+  closedir(dir);
+  std::sort(faceImageFilenames.begin(), faceImageFilenames.end());
+
+  // Resolve the label of each image through the label index
+  faceImageLabels.reserve(faceImageFilenames.size());
+  for (size_t i = 0; i < faceImageFilenames.size(); i++) {
+    // Find the position of the underscore in the filename and retrieve the label name
+    underscorePosition = faceImageFilenames[i].find_first_of("_");
+    faceRecognizerLabelName = faceImageFilenames[i].substr(0, underscorePosition);
+
+    // Check if the label name exists in the label index
+    findIterator = faceRecognizerLabelIndex.find(faceRecognizerLabelName);
+    if (findIterator == faceRecognizerLabelIndex.end()) {
+      faceRecognizerLabelNames.push_back(faceRecognizerLabelName);
+      faceRecognizerLabelIndex[faceRecognizerLabelName] = (int)faceRecognizerLabelNames.size();
+      faceImageLabels.push_back((int)faceRecognizerLabelNames.size());
+    }
+    else {
+      faceImageLabels.push_back(findIterator->second);
+    }
+  }
+
+  // Decode the images in parallel into the preallocated buffer
+  cv::Mat faceImageBuffer((int)faceImageFilenames.size() * faceRecognizerImageHeight, faceRecognizerImageWidth, CV_8UC1);
+  std::vector<char> faceImageLoaded(faceImageFilenames.size(), 0);
+  std::atomic<size_t> nextImage(0);
+  std::vector<std::thread> loaderThreads;
+  size_t threadCount = std::max(std::min((size_t)std::thread::hardware_concurrency(), faceImageFilenames.size()), (size_t)1);
+
+  for (size_t t = 0; t < threadCount; t++) {
+    loaderThreads.push_back(std::thread([&] {
+      std::vector<uchar> jpeg;
+      cv::Mat decoded;
+      size_t i;
+
+      while ((i = nextImage++) < faceImageFilenames.size()) {
+        // Read the whole file, the buffer is reused between images
+        std::ifstream faceImageFile((openCVFaceRecognizerImagesPath + faceImageFilenames[i]).c_str(), std::ios::binary | std::ios::ate);
+        if (!faceImageFile) {
+          continue;
+        }
+        jpeg.resize((size_t)faceImageFile.tellg());
+        faceImageFile.seekg(0);
+        if (jpeg.empty() || !faceImageFile.read((char *)&jpeg[0], jpeg.size())) {
+          continue;
+        }
+
+        decoded = decodeTrainingImage(jpeg);
+        if (decoded.empty()) {
+          continue;
+        }
+
+        // Resize straight into this image's slot of the buffer
+        cv::Mat faceImage = faceImageBuffer.rowRange((int)i * faceRecognizerImageHeight, (int)(i + 1) * faceRecognizerImageHeight);
+        if (decoded.cols == faceRecognizerImageWidth && decoded.rows == faceRecognizerImageHeight) {
+          decoded.copyTo(faceImage);
+        }
+        else {
+          cv::resize(decoded, faceImage, faceImage.size(), 0, 0, cv::INTER_AREA);
+        }
+        faceImageLoaded[i] = 1;
+      }
+    }));
+  }
+  for (size_t t = 0; t < loaderThreads.size(); t++) {
+    loaderThreads[t].join();
+  }
+
+  // Add the loaded images and their labels to the arrays
+  faceRecognizerImages.reserve(faceRecognizerImages.size() + faceImageFilenames.size());
+  faceRecognizerLabels.reserve(faceRecognizerLabels.size() + faceImageFilenames.size());
+  for (size_t i = 0; i < faceImageFilenames.size(); i++) {
+    if (!faceImageLoaded[i]) {
+      std::cerr << "Error loading face recognizer image!..." << faceImageFilenames[i] << std::endl;
+      continue;
+    }
+    faceRecognizerImages.push_back(faceImageBuffer.rowRange((int)i * faceRecognizerImageHeight, (int)(i + 1) * faceRecognizerImageHeight));
+    faceRecognizerLabels.push_back(faceImageLabels[i]);
+  }
+
+  // Output the face recognizer label names and the load time
+  for (size_t i = 0; i < faceRecognizerLabelNames.size(); i++) {
+    std::cout << "Face Recognizer Label Name..." << i + 1 << " " << faceRecognizerLabelNames[i] << std::endl;
+  }
+  std::cout << "Loaded face recognizer images..." << faceRecognizerImages.size() << " in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count()
+            << "ms on " << threadCount << " threads" << std::endl;
+
+  return true;
+}
+
+#endif
@@ -0,0 +1,120 @@
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include "distance-sampler.hpp"
+
+using namespace std;
+
+// Checks the distance sampler's echo timeouts and median filter against the simulated GPIO, whose simulated clock makes every measurement exact:
+//   distance-sampler-test
+// Prints a line per check and returns non-zero if any check failed.
+
+const int triggerGpioPin = 23;
+const int echoGpioPin = 24;
+int failedChecks = 0;
+
+// ##### Define the function to report a check
+void check(bool passed, const string &description) {
+  cout << (passed ? "PASS " : "FAIL ") << description << endl;
+  if (!passed) {
+    failedChecks++;
+  }
+}
+
+// ##### Define the function to time a single measurement on the simulated clock
+double timedMeasure(DistanceSampler &sampler, SimulatedGpio &gpio, double &milliseconds) {
+  uint64_t startTime = gpio.microseconds();
+  double distance = sampler.measure();
+  milliseconds = (gpio.microseconds() - startTime) / 1000.0;
+  return distance;
+}
+
+// ##### Define the function to wait until the sampler has taken a number of measurements
+bool waitForMeasurements(const DistanceSampler &sampler, size_t count) {
+  chrono::steady_clock::time_point deadline = chrono::steady_clock::now() + chrono::seconds(5);
+  while (sampler.measurements() < count) {
+    if (chrono::steady_clock::now() > deadline) {
+      return false;
+    }
+    this_thread::sleep_for(chrono::microseconds(200));
+  }
+  return true;
+}
+
+int main() {
+  SimulatedGpio *gpio = new SimulatedGpio(triggerGpioPin, echoGpioPin, 100.0);
+  DistanceSampler sampler(unique_ptr<Gpio>(gpio), triggerGpioPin, echoGpioPin);
+  double distance, milliseconds;
+  bool valid;
+
+  // Single measurements, the timeouts are 30ms for the echo to start and 30ms for it to end
+  distance = timedMeasure(sampler, *gpio, milliseconds);
+  check(fabs(distance - 100.0) < 0.1, "normal echo measures 100cm (" + to_string(distance) + ")");
+
+  gpio->setDistance(0.0);
+  distance = timedMeasure(sampler, *gpio, milliseconds);
+  check(distance < 0, "missed echo fails");
+  check(milliseconds >= 30.0 && milliseconds < 30.1, "missed echo times out after 30ms (" + to_string(milliseconds) + "ms)");
+
+  gpio->setDistance(100.0);
+  gpio->setEchoDelay(40000);
+  distance = timedMeasure(sampler, *gpio, milliseconds);
+  check(distance < 0, "echo starting after 40ms fails");
+  check(milliseconds >= 30.0 && milliseconds < 30.1, "late echo times out after 30ms (" + to_string(milliseconds) + "ms)");
+
+  // An echo that starts late but within the timeout is measured, the next trigger replaces the late echo still on its way
+  gpio->setEchoDelay(20000);
+  distance = timedMeasure(sampler, *gpio, milliseconds);
+  check(fabs(distance - 100.0) < 0.1, "echo starting after 20ms measures 100cm (" + to_string(distance) + ")");
+
+  gpio->setEchoDelay(450);
+  gpio->setDistance(600.0);
+  distance = timedMeasure(sampler, *gpio, milliseconds);
+  check(distance < 0, "echo longer than 30ms (over 5 metres) fails");
+  check(milliseconds >= 30.4 && milliseconds < 30.6, "long echo times out 30ms after it starts (" + to_string(milliseconds) + "ms)");
+
+  // The sampler thread publishes the median of the last 5 measurements, and expires it after 3 failures in a row
+  gpio->setDistance(100.0);
+  if (!sampler.start(60, 5, 3) || !waitForMeasurements(sampler, 5)) {
+    check(false, "sampler takes 5 measurements");
+    return 1;
+  }
+  valid = sampler.latest(distance);
+  check(valid && fabs(distance - 100.0) < 0.1, "median of 5 measurements at 100cm (" + to_string(distance) + ")");
+
+  // A single spike is filtered out, the value is only set after a measurement so it applies to the next one
+  gpio->setDistance(300.0);
+  waitForMeasurements(sampler, sampler.measurements() + 1);
+  gpio->setDistance(100.0);
+  waitForMeasurements(sampler, sampler.measurements() + 1);
+  valid = sampler.latest(distance);
+  check(valid && fabs(distance - 100.0) < 0.1, "one 300cm spike is filtered out (" + to_string(distance) + ")");
+
+  // A change that lasts for most of the window comes through
+  gpio->setDistance(200.0);
+  waitForMeasurements(sampler, sampler.measurements() + 3);
+  valid = sampler.latest(distance);
+  check(valid && fabs(distance - 200.0) < 0.1, "3 of 5 measurements at 200cm give 200cm (" + to_string(distance) + ")");
+
+  // One failure keeps the distance, three in a row expire it
+  gpio->setDistance(0.0);
+  waitForMeasurements(sampler, sampler.measurements() + 1);
+  valid = sampler.latest(distance);
+  check(valid, "distance still valid after one failure");
+  waitForMeasurements(sampler, sampler.measurements() + 2);
+  valid = sampler.latest(distance);
+  check(!valid, "distance expired after 3 failures in a row");
+
+  // The sensor answering again gives a valid distance from a fresh median
+  gpio->setDistance(150.0);
+  waitForMeasurements(sampler, sampler.measurements() + 2);
+  valid = sampler.latest(distance);
+  check(valid && fabs(distance - 150.0) < 0.1, "distance valid again at 150cm (" + to_string(distance) + ")");
+  sampler.stop();
+
+  cout << (failedChecks == 0 ? "All checks passed" : to_string(failedChecks) + " checks failed") << endl;
+  return failedChecks == 0 ? 0 : 1;
+}
@@ -0,0 +1,81 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "frame-preprocess.hpp"
+
+using namespace std;
+using namespace cv;
+
+// Checks the fused frame pre-processor against cvtColor(COLOR_BGR2RGB), flip(-1), cvtColor(COLOR_BGR2GRAY) and equalizeHist:
+//   frame-preprocess-test
+// Frame widths that are not a multiple of 16 exercise the scalar tail after the vector loop.
+// Prints a line per check and returns non-zero if any check failed.
+
+int failedChecks = 0;
+
+// ##### Define the function to report a check
+void check(bool passed, const string &description) {
+  cout << (passed ? "PASS " : "FAIL ") << description << endl;
+  if (!passed) {
+    failedChecks++;
+  }
+}
+
+// ##### Define the function to check one captured frame against the OpenCV chain
+void checkFrame(const Mat &capturedFrame, const string &description) {
+  ostringstream output;
+  bool passed = checkFramePreprocessor(capturedFrame, output);
+  string result = output.str();
+  check(passed, description + " " + to_string(capturedFrame.cols) + "x" + to_string(capturedFrame.rows) + ": " + result.substr(0, result.find('\n')));
+}
+
+int main() {
+  const int sizes[][2] = {
+    { 640, 480 }, { 1280, 720 }, { 641, 481 }, { 100, 75 }, { 47, 5 }, { 33, 7 }, { 31, 2 }, { 17, 3 }, { 16, 1 }, { 15, 1 }, { 1, 1 }
+  };
+  RNG rng(0x5eed);
+
+  cout << "Vector path..." << preprocessVectorPath() << endl;
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    int cols = sizes[i][0], rows = sizes[i][1];
+    Mat capturedFrame(rows, cols, CV_8UC3);
+
+    // Random content, every grey level and every position in a vector used
+    rng.fill(capturedFrame, RNG::UNIFORM, 0, 256);
+    checkFrame(capturedFrame, "random");
+
+    // Random content over a narrow range, so the equalization stretches it
+    rng.fill(capturedFrame, RNG::UNIFORM, 100, 140);
+    checkFrame(capturedFrame, "narrow");
+
+    // A single colour, which equalizeHist leaves at its grey level
+    capturedFrame.setTo(Scalar(rng.uniform(0, 256), rng.uniform(0, 256), rng.uniform(0, 256)));
+    checkFrame(capturedFrame, "constant");
+  }
+
+  // A region of a larger frame, whose rows are not contiguous
+  Mat largerFrame(120, 200, CV_8UC3);
+  rng.fill(largerFrame, RNG::UNIFORM, 0, 256);
+  checkFrame(largerFrame(Rect(3, 5, 157, 101)), "region");
+
+  // One pre-processor reused across frame sizes without the grey frame, as on frames no detector needs
+  FramePreprocessor preprocessor;
+  Mat displayFrame, expectedDisplayFrame;
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    int cols = sizes[i][0], rows = sizes[i][1];
+    Mat capturedFrame(rows, cols, CV_8UC3);
+    rng.fill(capturedFrame, RNG::UNIFORM, 0, 256);
+
+    preprocessor.process(capturedFrame, displayFrame, NULL);
+    cvtColor(capturedFrame, expectedDisplayFrame, COLOR_BGR2RGB);
+    flip(expectedDisplayFrame, expectedDisplayFrame, -1);
+    Mat displayMismatch = displayFrame != expectedDisplayFrame;
+    check(countNonZero(displayMismatch.reshape(1)) == 0, "display only " + to_string(cols) + "x" + to_string(rows));
+  }
+
+  cout << (failedChecks == 0 ? "All checks passed" : to_string(failedChecks) + " checks failed") << endl;
+  return failedChecks == 0 ? 0 : 1;
+}